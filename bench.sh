@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# bench.sh - end-to-end throughput benchmark for restoration (make bench)
+#
+# For each input size, pgmgen writes a hacked input and the image it should
+# restore to; restoration is then run once per reader/decoder mode, its
+# output checked against that image, and MB/s, lines/s and peak RSS printed.
+#
+# Environment (all optional):
+#       BENCH_SIZES   input sizes, K/M/G suffixes (default "1M 16M 256M 2G")
+#       BENCH_DIR     where inputs are generated (default $TMPDIR or /tmp)
+#       BENCH_WIDTH   pixels per row (default 640)
+#       BENCH_DECOYS  decoy rows per original row (default 0.5)
+#       BENCH_DENSITY mean non-digit bytes between pixels (default 2)
+#       BENCH_SEED    random seed (default 1)
+#
+# Exits nonzero if any run fails or restores the wrong image.
+
+sizes=${BENCH_SIZES:-"1M 16M 256M 2G"}
+dir=${BENCH_DIR:-${TMPDIR:-/tmp}}
+width=${BENCH_WIDTH:-640}
+decoys=${BENCH_DECOYS:-0.5}
+density=${BENCH_DENSITY:-2}
+seed=${BENCH_SEED:-1}
+cpus=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+
+in="$dir/bench.$$.txt"
+want="$dir/bench.$$.pgm"
+got="$dir/bench.$$.out"
+res="$dir/bench.$$.res"
+trap 'rm -f "$in" "$want" "$got" "$res"' EXIT INT TERM
+
+status=0
+
+# run_mode label stdin|file [restoration options...]
+run_mode()
+{
+        label=$1
+        how=$2
+        shift 2
+        if [ "$how" = stdin ]; then
+                ./benchrun "$res" ./restoration "$@" < "$in" > "$got"
+        else
+                ./benchrun "$res" ./restoration "$@" "$in" < /dev/null \
+                        > "$got"
+        fi
+        rc=$?
+        if [ $rc -ne 0 ] || ! cmp -s "$got" "$want"; then
+                printf "%-8s %-12s FAILED (exit %d or wrong image)\n" \
+                        "$size" "$label" $rc
+                status=1
+                return
+        fi
+        read secs rss < "$res"
+        awk -v size="$size" -v label="$label" -v bytes="$bytes" \
+            -v lines="$lines" -v secs="$secs" -v rss="$rss" 'BEGIN {
+                if (secs <= 0) secs = 1e-6
+                printf "%-8s %-12s %9.3f %10.1f %12.0f %10.1f\n", size, label,
+                       secs, bytes / 1048576 / secs, lines / secs, rss / 1024
+        }'
+}
+
+printf "%-8s %-12s %9s %10s %12s %10s\n" size mode seconds MB/s lines/s \
+        "RSS(MB)"
+for size in $sizes; do
+        lines=$(./pgmgen -w "$width" -S "$size" -d "$decoys" -n "$density" \
+                -s "$seed" "$in" "$want") || { status=1; break; }
+        bytes=$(wc -c < "$in")
+
+        run_mode mmap file
+        run_mode stream stdin
+        run_mode lazy stdin --lazy
+        run_mode two-pass file --two-pass
+        if [ "$cpus" -gt 1 ]; then
+                run_mode "j$cpus" file -j "$cpus"
+        fi
+done
+
+exit $status
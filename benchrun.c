@@ -0,0 +1,70 @@
+/* benchrun.c
+ *
+ * Runs a command once, with this process's stdin and stdout, and records its
+ * wall-clock time and peak resident set size for bench.sh. The figures are
+ * written as "<seconds> <peak RSS in KB>" to the result file, so that the
+ * command's own output is left alone.
+ *
+ * Usage: ./benchrun result.txt command [args...]
+ *
+ * The exit status is the command's (or 1 if it could not be run).
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int main(int argc, char *argv[])
+{
+        if (argc < 3)
+        {
+                fprintf(stderr, "usage: %s result.txt command [args...]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+                perror("fork");
+                return EXIT_FAILURE;
+        }
+        if (pid == 0)
+        {
+                execvp(argv[2], argv + 2);
+                perror(argv[2]);
+                _exit(127);
+        }
+
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0)
+        {
+                perror("wait4");
+                return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double secs = (double)(t1.tv_sec - t0.tv_sec) +
+                      (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        FILE *res = fopen(argv[1], "w");
+        if (res == NULL)
+        {
+                perror(argv[1]);
+                return EXIT_FAILURE;
+        }
+        /* Linux reports ru_maxrss in kilobytes */
+        fprintf(res, "%.6f %ld\n", secs, ru.ru_maxrss);
+        fclose(res);
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
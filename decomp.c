@@ -0,0 +1,496 @@
+/* decomp.c */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decomp.h"
+#include "mem.h"
+
+#define T Decomp_T
+
+/* Ring of output buffers between the decompressing thread and the reader */
+#define SLOTS 4
+#define SLOT_BYTES (1u << 20)
+
+/* Compressed bytes read from a stream at a time */
+#define IN_BYTES (256u * 1024)
+
+/* Most of a mapped input handed to the decoder at once (zlib counts in
+ * 32 bits) */
+#define MAP_PIECE ((size_t)1 << 30)
+
+struct slot
+{
+        char *data;
+        size_t len;
+};
+
+struct T
+{
+        Decomp_Kind kind;
+
+        /* The compressed input: a map, or a prefix followed by a stream */
+        const unsigned char *map;
+        size_t map_len;
+        size_t map_pos;       /* bytes of the map handed out so far */
+        FILE *fp;
+        unsigned char prefix[DECOMP_MAGIC];
+        size_t prefix_len;
+        int began;            /* the prefix has been handed out */
+        unsigned char *in;    /* staging for stream input */
+
+        /* Decoder state, used only by the thread */
+        z_stream z;
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *zd;
+        ZSTD_inBuffer zin;
+#endif
+        int input_end;        /* no compressed input is left */
+        int frame_open;       /* the input so far ends inside a frame */
+
+        /* The ring, under 'lock' */
+        struct slot slots[SLOTS];
+        size_t head;          /* slot the reader takes next */
+        size_t full;          /* filled slots not yet given back */
+        int held;             /* the reader holds slot head - 1 */
+        int done;             /* the last slot is filled: the input is spent */
+        int stop;             /* the reader wants no more */
+        const char *error;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t tid;
+        int started;
+};
+
+static void *produce(void *cl);
+static size_t fill_slot(T d, char *out, size_t cap);
+static size_t next_input(T d, const unsigned char **p);
+
+/********** Decomp_detect ********
+ *
+ * Recognises gzip (1f 8b) and zstd (28 b5 2f fd) data by its first bytes.
+ *
+ * Parameters:
+ *      const void *bytes: the start of the input
+ *      size_t len:        bytes available (DECOMP_MAGIC is enough)
+ *
+ * Return:
+ *      the format, or DECOMP_NONE for anything else
+ *
+ ************************/
+Decomp_Kind Decomp_detect(const void *bytes, size_t len)
+{
+        const unsigned char *b = bytes;
+        if (len >= 2 && b[0] == 0x1f && b[1] == 0x8b)
+        {
+                return DECOMP_GZIP;
+        }
+        if (len >= 4 && b[0] == 0x28 && b[1] == 0xb5 && b[2] == 0x2f &&
+            b[3] == 0xfd)
+        {
+                return DECOMP_ZSTD;
+        }
+        return DECOMP_NONE;
+}
+
+/********** Decomp_start ********
+ *
+ * Starts decompressing on a new thread.
+ *
+ * Parameters:
+ *      Decomp_Kind kind:  the input's format
+ *      const void *map:   the whole compressed input in memory, or NULL
+ *      size_t map_len:    its length
+ *      FILE *fp:          otherwise, the stream to read it from
+ *      const void *prefix: bytes already taken from fp (at most
+ *                         DECOMP_MAGIC), which come first
+ *      size_t prefix_len: how many
+ *
+ * Return:
+ *      the decompressor; its output is read with Decomp_next
+ *
+ * Notes:
+ *      the map or stream must stay open until Decomp_free. If no thread can
+ *      be started, decompression happens inside Decomp_next instead.
+ ************************/
+T Decomp_start(Decomp_Kind kind, const void *map, size_t map_len, FILE *fp,
+               const void *prefix, size_t prefix_len)
+{
+        T d;
+        NEW0(d);
+        d->kind = kind;
+        d->map = map;
+        d->map_len = map_len;
+        d->fp = fp;
+        if (prefix_len > DECOMP_MAGIC)
+        {
+                prefix_len = DECOMP_MAGIC;
+        }
+        if (prefix_len > 0)
+        {
+                memcpy(d->prefix, prefix, prefix_len);
+        }
+        d->prefix_len = prefix_len;
+        d->frame_open = 1;
+        if (map == NULL)
+        {
+                d->in = ALLOC(IN_BYTES);
+        }
+        for (int i = 0; i < SLOTS; i++)
+        {
+                d->slots[i].data = ALLOC(SLOT_BYTES);
+        }
+
+        if (kind == DECOMP_GZIP)
+        {
+                /* 15 + 32: any window size, gzip or zlib header */
+                if (inflateInit2(&d->z, 15 + 32) != Z_OK)
+                {
+                        d->error = "cannot start gzip decoder";
+                }
+        }
+        else if (kind == DECOMP_ZSTD)
+        {
+#ifdef HAVE_ZSTD
+                d->zd = ZSTD_createDCtx();
+                if (d->zd == NULL)
+                {
+                        d->error = "cannot start zstd decoder";
+                }
+#else
+                d->error = "zstd input is not supported by this build";
+#endif
+        }
+
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        d->started = pthread_create(&d->tid, NULL, produce, d) == 0;
+        return d;
+}
+
+/********** Decomp_next ********
+ *
+ * Gives back the buffer returned by the previous call, if any, and returns
+ * the next buffer of decompressed output, waiting for it if need be.
+ *
+ * Parameters:
+ *      T d:         the decompressor
+ *      size_t *len: set to the number of bytes in the buffer
+ *
+ * Return:
+ *      the buffer, which the caller may modify until its next call, or NULL
+ *      once the output is over (check Decomp_error)
+ *
+ ************************/
+char *Decomp_next(T d, size_t *len)
+{
+        if (!d->started)
+        {
+                /* No thread: decompress one slot's worth here */
+                struct slot *s = &d->slots[0];
+                s->len = d->done ? 0 : fill_slot(d, s->data, SLOT_BYTES);
+                d->done = s->len == 0;
+                *len = s->len;
+                return s->len > 0 ? s->data : NULL;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if (d->held)
+        {
+                d->held = 0;
+                d->full--;
+                pthread_cond_broadcast(&d->cond);
+        }
+        while (d->full == 0 && !d->done)
+        {
+                pthread_cond_wait(&d->cond, &d->lock);
+        }
+        struct slot *s = NULL;
+        if (d->full > 0)
+        {
+                s = &d->slots[d->head % SLOTS];
+                d->head++;
+                d->held = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        *len = s != NULL ? s->len : 0;
+        return s != NULL ? s->data : NULL;
+}
+
+/********** Decomp_error ********
+ *
+ * Return:
+ *      why the output ended early (bad or truncated data, a read error), or
+ *      NULL if it ended at the end of the input. Only meaningful once
+ *      Decomp_next has returned NULL.
+ *
+ ************************/
+const char *Decomp_error(T d)
+{
+        pthread_mutex_lock(&d->lock);
+        const char *error = d->error;
+        pthread_mutex_unlock(&d->lock);
+        return error;
+}
+
+/********** Decomp_free ********
+ *
+ * Stops the thread, even midway through the input, and frees everything
+ * (but not the map or stream). Sets *d to NULL.
+ *
+ ************************/
+void Decomp_free(T *d)
+{
+        T x = *d;
+        if (x->started)
+        {
+                pthread_mutex_lock(&x->lock);
+                x->stop = 1;
+                pthread_cond_broadcast(&x->cond);
+                pthread_mutex_unlock(&x->lock);
+                pthread_join(x->tid, NULL);
+        }
+
+        if (x->kind == DECOMP_GZIP)
+        {
+                inflateEnd(&x->z);
+        }
+#ifdef HAVE_ZSTD
+        if (x->zd != NULL)
+        {
+                ZSTD_freeDCtx(x->zd);
+        }
+#endif
+        for (int i = 0; i < SLOTS; i++)
+        {
+                FREE(x->slots[i].data);
+        }
+        FREE(x->in);
+        pthread_cond_destroy(&x->cond);
+        pthread_mutex_destroy(&x->lock);
+        FREE(*d);
+}
+
+/********** produce ********
+ *
+ * Thread body: fills free slots in ring order until the output ends or the
+ * reader stops. Slots are filled outside the lock; the reader only sees a
+ * slot once 'full' counts it.
+ *
+ ************************/
+static void *produce(void *cl)
+{
+        T d = cl;
+        size_t tail = 0;
+        while (1)
+        {
+                pthread_mutex_lock(&d->lock);
+                while (d->full == SLOTS && !d->stop)
+                {
+                        pthread_cond_wait(&d->cond, &d->lock);
+                }
+                int stop = d->stop;
+                pthread_mutex_unlock(&d->lock);
+                if (stop)
+                {
+                        break;
+                }
+
+                struct slot *s = &d->slots[tail % SLOTS];
+                s->len = fill_slot(d, s->data, SLOT_BYTES);
+
+                pthread_mutex_lock(&d->lock);
+                if (s->len > 0)
+                {
+                        d->full++;
+                        tail++;
+                }
+                int last = s->len == 0;
+                d->done = last;
+                pthread_cond_broadcast(&d->cond);
+                pthread_mutex_unlock(&d->lock);
+                if (last)
+                {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+/********** fill_slot ********
+ *
+ * Decompresses up to 'cap' bytes of output into 'out'. Sets d->error if the
+ * input was bad.
+ *
+ * Return:
+ *      bytes of output (0 only at the end, which the caller records in
+ *      d->done: under the lock when the decoder thread runs)
+ *
+ ************************/
+static size_t fill_slot(T d, char *out, size_t cap)
+{
+        size_t used = 0;
+        if (d->error != NULL)
+        {
+                return 0;
+        }
+
+        if (d->kind == DECOMP_NONE)
+        {
+                /* Straight copy: the prefix, then the stream */
+                if (!d->began)
+                {
+                        d->began = 1;
+                        memcpy(out, d->prefix, d->prefix_len);
+                        used = d->prefix_len;
+                }
+                while (used < cap && !d->input_end)
+                {
+                        size_t n = fread(out + used, 1, cap - used, d->fp);
+                        if (n == 0)
+                        {
+                                if (ferror(d->fp))
+                                {
+                                        d->error = "read error";
+                                }
+                                d->input_end = 1;
+                        }
+                        used += n;
+                }
+        }
+        else if (d->kind == DECOMP_GZIP)
+        {
+                d->z.next_out = (unsigned char *)out;
+                d->z.avail_out = (unsigned)cap;
+                while (d->z.avail_out > 0 && d->error == NULL)
+                {
+                        if (d->z.avail_in == 0)
+                        {
+                                const unsigned char *p;
+                                size_t n = next_input(d, &p);
+                                if (n == 0)
+                                {
+                                        break;
+                                }
+                                d->z.next_in = (unsigned char *)p;
+                                d->z.avail_in = (unsigned)n;
+                        }
+                        int rc = inflate(&d->z, Z_NO_FLUSH);
+                        if (rc == Z_STREAM_END)
+                        {
+                                /* Concatenated gzip members are one input */
+                                inflateReset(&d->z);
+                                d->frame_open = 0;
+                        }
+                        else if (rc == Z_OK)
+                        {
+                                d->frame_open = 1;
+                        }
+                        else if (rc != Z_BUF_ERROR)
+                        {
+                                d->error = "bad gzip data";
+                        }
+                }
+                used = cap - d->z.avail_out;
+                if (used == 0 && d->error == NULL && d->frame_open)
+                {
+                        d->error = "truncated gzip data";
+                }
+        }
+#ifdef HAVE_ZSTD
+        else if (d->kind == DECOMP_ZSTD)
+        {
+                ZSTD_outBuffer zout = {out, cap, 0};
+                while (zout.pos < zout.size && d->error == NULL)
+                {
+                        if (d->zin.pos == d->zin.size)
+                        {
+                                const unsigned char *p;
+                                size_t n = next_input(d, &p);
+                                if (n == 0)
+                                {
+                                        break;
+                                }
+                                d->zin.src = p;
+                                d->zin.size = n;
+                                d->zin.pos = 0;
+                        }
+                        size_t hint =
+                            ZSTD_decompressStream(d->zd, &zout, &d->zin);
+                        if (ZSTD_isError(hint))
+                        {
+                                d->error = "bad zstd data";
+                        }
+                        else
+                        {
+                                /* 0: the frame just decoded is complete */
+                                d->frame_open = hint != 0;
+                        }
+                }
+                used = zout.pos;
+                if (used == 0 && d->error == NULL && d->frame_open)
+                {
+                        d->error = "truncated zstd data";
+                }
+        }
+#endif
+
+        return used;
+}
+
+/********** next_input ********
+ *
+ * Hands out the next piece of compressed input: the map in pieces of up to
+ * MAP_PIECE bytes, or the prefix and then IN_BYTES-sized reads of the
+ * stream.
+ *
+ * Return:
+ *      bytes at *p, 0 at the end of the input (d->error is set on a read
+ *      error)
+ *
+ ************************/
+static size_t next_input(T d, const unsigned char **p)
+{
+        if (d->input_end)
+        {
+                return 0;
+        }
+        if (d->map != NULL)
+        {
+                size_t n = d->map_len - d->map_pos;
+                if (n > MAP_PIECE)
+                {
+                        n = MAP_PIECE;
+                }
+                *p = d->map + d->map_pos;
+                d->map_pos += n;
+                d->input_end = d->map_pos == d->map_len;
+                return n;
+        }
+        if (!d->began)
+        {
+                d->began = 1;
+                if (d->prefix_len > 0)
+                {
+                        *p = d->prefix;
+                        return d->prefix_len;
+                }
+        }
+
+        size_t n = d->fp != NULL ? fread(d->in, 1, IN_BYTES, d->fp) : 0;
+        if (n == 0)
+        {
+                if (d->fp != NULL && ferror(d->fp))
+                {
+                        d->error = "read error";
+                }
+                d->input_end = 1;
+        }
+        *p = d->in;
+        return n;
+}
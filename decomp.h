@@ -0,0 +1,43 @@
+/* decomp.h
+ *
+ * Decompresses gzip or zstd input on a thread of its own, a step ahead of
+ * the reader: output is handed over through a small ring of large buffers,
+ * so decompression overlaps with scanning and nothing goes to disk.
+ *
+ * The compressed input is either already in memory (a mapped file) or read
+ * from a stream, after a few bytes that were taken from it to recognise the
+ * format. DECOMP_NONE just copies such a stream, so that those bytes are
+ * not lost when it turns out not to be compressed after all.
+ */
+#ifndef DECOMP_INCLUDED
+#define DECOMP_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Bytes Decomp_detect needs to tell the formats apart */
+#define DECOMP_MAGIC 4
+
+typedef enum Decomp_Kind
+{
+        DECOMP_NONE,
+        DECOMP_GZIP,
+        DECOMP_ZSTD
+} Decomp_Kind;
+
+#define T Decomp_T
+typedef struct T *T;
+
+extern Decomp_Kind Decomp_detect(const void *bytes, size_t len);
+
+extern T Decomp_start(Decomp_Kind kind, const void *map, size_t map_len,
+                      FILE *fp, const void *prefix, size_t prefix_len);
+
+extern char *Decomp_next(T d, size_t *len);
+
+extern const char *Decomp_error(T d);
+
+extern void Decomp_free(T *d);
+
+#undef T
+#endif
@@ -0,0 +1,1620 @@
+/* engine.c */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "engine.h"
+#include "mem.h"
+
+const Except_T WidthBad = {"restoration: inconsistent row widths"};
+const Except_T SpillFail = {"restoration: could not spill input"};
+const Except_T NoInput = {"restoration: no useable rows"};
+
+/*
+ * A --prune scan met a skeleton it had dropped with another width, so it
+ * cannot tell whether the input is bad; the scan is done again in full. Never
+ * returned from the engine.
+ */
+static const Except_T PruneLost = {"restoration: pruned scan inconclusive"};
+
+/*
+ * Largest row storage kept in the scan slab. Most decoy Buckets hold a row
+ * or two and never leave the slab; a Bucket that grows past this moves its
+ * rows to a heap block of its own so that doubling does not waste slab space.
+ */
+#define SLAB_ROWS_MAX 4096
+
+/*
+ * Row storage doubles until it is this large, then grows by an eighth at a
+ * time, so that the spare room of a very tall image (billions of rows) stays
+ * a small fraction of its rows. Growth on the heap is a realloc, which moves
+ * pages rather than copying them at these sizes.
+ */
+#define ROWS_DOUBLE_MAX ((size_t)64 << 20)
+
+/*
+ * Rows in a speculation window: how often store_sequence checks that the
+ * Bucket it speculates on still leads by the margin.
+ */
+#define SPEC_WINDOW 4096
+
+/* Ghost width of a hash shared by pruned skeletons of different widths */
+#define GHOST_WIDTHS ((size_t)-1)
+
+/* Pixels of the winning image per decode thread, at the least */
+#define DECODE_PIXELS_PER_THREAD (256 * 1024)
+
+/* One piece of a mapped input, scanned by its own thread for -j */
+typedef struct Chunk
+{
+        const char *map;     /* the whole input */
+        size_t start;        /* the piece: lines [start, end) */
+        size_t end;
+        struct Scan scan;    /* thread-local buckets for the piece */
+        const Except_T *err; /* why the piece could not be scanned */
+} *Chunk;
+
+/* Closure for merging the pieces' Buckets into one table */
+typedef struct Merge
+{
+        Scan scan;
+        const Except_T *err; /* set when widths differ across pieces */
+} *Merge;
+
+/* Closure for picking the winner among merged Buckets */
+typedef struct Pick
+{
+        Scan scan;
+        const char *key; /* the winner's skeleton */
+        size_t len;
+} *Pick;
+
+/* A pruned skeleton; an empty slot has hash 0 (a hash of 0 is kept as 1) */
+typedef struct Ghost
+{
+        uint64_t hash;
+        size_t width;  /* its rows' width, or GHOST_WIDTHS */
+        size_t rows;   /* rows it had, over every time it was pruned */
+} Ghost;
+
+/* Open addressing with linear probing, like PatTable */
+struct Ghosts
+{
+        Ghost *slots;
+        size_t mask;    /* number of slots - 1 (a power of two) */
+        size_t length;
+        size_t most;    /* the most rows of any ghost */
+};
+
+/* Closure for pruning a table: survivors go to a new table and slab */
+typedef struct Prune
+{
+        Scan scan;
+        PatTable_T table;
+        Slab_T slab;
+        Seq_T heap;
+        size_t floor;   /* Buckets with no more rows than this are dropped */
+        Bucket best;    /* the new copy of scan->best */
+} *Prune;
+
+/* Closure for the rows another skeleton of a pruned scan may have */
+typedef struct Rival
+{
+        Bucket win;
+        size_t most;
+} *Rival;
+
+/* The winning rows [first, last) for one decode thread */
+typedef struct Slice
+{
+        const char *const *lines; /* start of each winning line in the map */
+        const char *end;          /* end of the map */
+        size_t width;
+        size_t first;
+        size_t last;
+        char *raster;             /* the W x H output image */
+} *Slice;
+
+static void *scan_chunk(void *cl);
+
+static void merge_bucket_cb(const char *key, size_t len, void **v, void *cl);
+
+static void pick_best_cb(const char *key, size_t len, void **v, void *cl);
+
+static void *decode_slice(void *cl);
+
+static const Except_T *scan_mapped(Scan scan, const char *map,
+                                   size_t start, size_t end);
+
+static const Except_T *store_sequence(Scan scan, const char *key,
+                                      size_t klen, const uint64_t *hash,
+                                      const void *row, size_t rowbytes,
+                                      size_t row_width, size_t pos);
+
+static void speculate(Scan scan, Bucket b, const char *key, size_t klen);
+
+static void prune_buckets(Scan scan);
+
+static void height_cb(const char *key, size_t len, void **v, void *cl);
+
+static int compare_heights(const void *a, const void *b);
+
+static void prune_cb(const char *key, size_t len, void **v, void *cl);
+
+static int prune_exact(Scan scan);
+
+static void rival_cb(const char *key, size_t len, void **v, void *cl);
+
+static Ghost *ghost_find(Ghosts g, uint64_t hash);
+
+static void ghost_add(Ghosts g, uint64_t hash, size_t width, size_t rows);
+
+static void ghosts_free(Ghosts *g);
+
+static Bucket new_bucket(Scan scan, size_t width, size_t rowbytes);
+
+static char *bucket_push(Scan scan, Bucket b);
+
+static void bucket_grow(Scan scan, Bucket b, size_t cap);
+static size_t footprint(Scan scan);
+
+static int spill_bucket(Scan scan, Bucket b);
+
+/********** scan_clock ********
+ *
+ * Monotonic clock reading in seconds, for --stats.
+ *
+ ************************/
+double scan_clock(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/********** add_stats ********
+ *
+ * Adds one set of stats (a -j piece, or a --batch file or worker) to a sum.
+ *
+ * Parameters:
+ *      Stats sum:  the running total
+ *      Stats part: the stats to add
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void add_stats(Stats sum, Stats part)
+{
+        sum->scan_s += part->scan_s;
+        sum->key_s += part->key_s;
+        sum->decode_s += part->decode_s;
+        sum->output_s += part->output_s;
+        sum->teardown_s += part->teardown_s;
+        sum->bytes += part->bytes;
+        sum->lines += part->lines;
+        sum->rejected += part->rejected;
+        sum->empty += part->empty;
+        sum->buckets += part->buckets;
+        sum->win_rows += part->win_rows;
+        sum->allocs += part->allocs;
+        sum->alloc_bytes += part->alloc_bytes;
+        sum->spill_bytes += part->spill_bytes;
+        sum->evicted += part->evicted;
+        sum->rescans += part->rescans;
+        sum->speculated += part->speculated;
+        sum->files += part->files;
+        sum->failed += part->failed;
+}
+
+/********** init_scan ********
+ *
+ * Sets up an empty scan state.
+ *
+ * Parameters:
+ *      Scan scan:        the scan state to set up
+ *      size_t input_len: bytes of input it will see, or 0 if unknown
+ *      int count_only:   nonzero to count rows per Bucket without storing
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void init_scan(Scan scan, size_t input_len, int count_only)
+{
+        /*
+         * Table of Buckets keyed by skeleton. A known input length sizes it,
+         * assuming lines of 64 bytes or more on average; the table still
+         * grows if there turn out to be more patterns.
+         */
+        size_t hint = input_len / 64;
+        if (hint > ((size_t)1 << 20))
+        {
+                hint = (size_t)1 << 20;
+        }
+        scan->buckets = PatTable_new(hint);
+        scan->slab = Slab_new();
+        scan->heap = Seq_new(0);
+        scan->skel = Skeleton_new();
+
+        /*
+         * Variables to keep track of the Bucket in the table that
+         * corresponds to the original lines (for later use)
+         */
+        scan->best = NULL;
+        scan->best_count = 0;
+        scan->count_only = count_only;
+        scan->timed = 0;
+        memset(&scan->stats, 0, sizeof(scan->stats));
+        memset(&scan->fault, 0, sizeof(scan->fault));
+
+        /* No spilling until the caller gives a --spill-dir */
+        scan->spill_dir = NULL;
+        scan->spill_limit = SPILL_LIMIT_DEFAULT;
+        scan->may_spill = 0;
+        scan->resident = 0;
+        scan->spill_fd = -1;
+        scan->spill_end = 0;
+
+        /* No pruning unless the caller asks for it */
+        scan->prune_cap = 0;
+        scan->ghosts = NULL;
+
+        /* Speculate with the default margin unless the caller says */
+        scan->spec_margin = SPEC_MARGIN_DEFAULT;
+        scan->spec = NULL;
+        scan->spec_key = Skeleton_new();
+        scan->spec_want = 0;
+        scan->spec_seen = 0;
+        scan->spec_lead = 0;
+}
+
+/********** reset_scan ********
+ *
+ * Empties a scan state for the next input, keeping its table slots, slab
+ * block and skeleton buffer.
+ *
+ * Parameters:
+ *      Scan scan: the scan state to empty
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void reset_scan(Scan scan)
+{
+        while (Seq_length(scan->heap) > 0)
+        {
+                Bucket b = Seq_remhi(scan->heap);
+                FREE(b->data);
+                FREE(b->runs);
+        }
+        Slab_reset(scan->slab);
+        PatTable_clear(scan->buckets);
+        if (scan->ghosts != NULL)
+        {
+                ghosts_free(&scan->ghosts);
+        }
+        scan->best = NULL;
+        scan->best_count = 0;
+        scan->resident = 0;
+        memset(&scan->fault, 0, sizeof(scan->fault));
+        scan->spec = NULL;
+        scan->spec_want = 0;
+        scan->spec_seen = 0;
+        scan->spec_lead = 0;
+
+        /* The spill file is kept, emptied, for the next input */
+        if (scan->spill_end > 0 && ftruncate(scan->spill_fd, 0) == 0)
+        {
+                scan->spill_end = 0;
+        }
+}
+
+/********** scan_parallel ********
+ *
+ * Scans a mapped input with several threads. The map is cut at line
+ * boundaries into one piece per thread, and each piece is scanned into its
+ * own Scan. The pieces are then merged in input order:
+ *      - row counts per skeleton are summed, and widths checked (WidthBad)
+ *        across pieces as they would be within one;
+ *      - the winner is the Bucket with the most rows, ties going to the one
+ *        whose last row comes first, which is the Bucket a sequential scan
+ *        would have settled on;
+ *      - only the winner's rows are gathered, piece by piece, so row order
+ *        is that of the input.
+ *
+ * Parameters:
+ *      Scan scan:       an empty scan state that receives the merged result
+ *      const char *map: the input in memory
+ *      size_t start:    offset of the first line to scan
+ *      size_t end:      offset just past the last
+ *      size_t jobs:     number of threads
+ *
+ * Return:
+ *      NULL, or &WidthBad if a row's width does not match its Bucket's;
+ *      scan->fault then holds the line a sequential scan would stop on
+ *
+ ************************/
+const Except_T *scan_parallel(Scan scan, const char *map, size_t start,
+                              size_t end, size_t jobs)
+{
+        Chunk chunks = CALLOC((long)jobs, (long)sizeof(*chunks));
+        pthread_t *tids = CALLOC((long)jobs, (long)sizeof(*tids));
+        int *started = CALLOC((long)jobs, (long)sizeof(*started));
+
+        size_t from = start;
+        for (size_t t = 0; t < jobs; t++)
+        {
+                size_t to = end;
+                if (t + 1 < jobs)
+                {
+                        /* Move the cut to just past the next newline */
+                        to = from + (end - from) / (jobs - t);
+                        const char *nl = memchr(map + to, '\n', end - to);
+                        to = nl != NULL ? (size_t)(nl - map) + 1 : end;
+                }
+                chunks[t].map = map;
+                chunks[t].start = from;
+                chunks[t].end = to;
+                init_scan(&chunks[t].scan, to - from, scan->count_only);
+                chunks[t].scan.timed = scan->timed;
+                chunks[t].scan.spec_margin = scan->spec_margin;
+                from = to;
+        }
+
+        /* Piece 0 is scanned on this thread; so is any piece that fails */
+        for (size_t t = 1; t < jobs; t++)
+        {
+                started[t] = pthread_create(&tids[t], NULL, scan_chunk,
+                                            &chunks[t]) == 0;
+        }
+        for (size_t t = 0; t < jobs; t++)
+        {
+                if (!started[t])
+                {
+                        scan_chunk(&chunks[t]);
+                }
+        }
+        for (size_t t = 1; t < jobs; t++)
+        {
+                if (started[t])
+                {
+                        pthread_join(tids[t], NULL);
+                }
+        }
+
+        /* The first failing piece is where a single scan stops */
+        struct Merge merge = {scan, NULL};
+        for (size_t t = 0; t < jobs && merge.err == NULL; t++)
+        {
+                merge.err = chunks[t].err;
+                if (merge.err == NULL)
+                {
+                        PatTable_map(chunks[t].scan.buckets, merge_bucket_cb,
+                                     &merge);
+                        add_stats(&scan->stats, &chunks[t].scan.stats);
+                }
+        }
+
+        if (merge.err != NULL)
+        {
+                /*
+                 * Widths may clash within a piece or only across pieces;
+                 * either way the line a single scan stops on is found by
+                 * counting rows alone up to it (this only costs on failure).
+                 */
+                struct Scan probe;
+                init_scan(&probe, end - start, 1);
+                if (obtain_mapped_sequence(&probe, map, start, end) != NULL)
+                {
+                        scan->fault = probe.fault;
+                }
+                free_scan(&probe);
+        }
+
+        struct Pick pick = {scan, NULL, 0};
+        if (merge.err == NULL)
+        {
+                PatTable_map(scan->buckets, pick_best_cb, &pick);
+        }
+
+        Bucket win = scan->best;
+        if (merge.err == NULL && win != NULL && !scan->count_only)
+        {
+                /*
+                 * Counts were summed; now gather the rows themselves, into
+                 * storage of exactly their size, a piece at a time
+                 */
+                size_t rows = win->height;
+                win->height = 0;
+                bucket_grow(scan, win, rows);
+                for (size_t t = 0; t < jobs; t++)
+                {
+                        Bucket b = PatTable_get(chunks[t].scan.buckets,
+                                                pick.key, pick.len);
+                        if (b != NULL && b->height > 0)
+                        {
+                                memcpy(win->data + win->height * win->rowbytes,
+                                       b->data, b->height * b->rowbytes);
+                                win->height += b->height;
+                        }
+                }
+        }
+
+        for (size_t t = 0; t < jobs; t++)
+        {
+                free_scan(&chunks[t].scan);
+        }
+        FREE(started);
+        FREE(tids);
+        FREE(chunks);
+        return merge.err;
+}
+
+/********** scan_chunk ********
+ *
+ * Thread body for scan_parallel: scans one piece of the map. A width
+ * mismatch inside the piece is left in c->err for scan_parallel to return.
+ *
+ ************************/
+static void *scan_chunk(void *cl)
+{
+        Chunk c = cl;
+        c->err = obtain_mapped_sequence(&c->scan, c->map, c->start, c->end);
+        return NULL;
+}
+
+/********** merge_bucket_cb ********
+ *
+ * Adds one piece's Bucket to the merged table: its row count is added to the
+ * merged Bucket for the same skeleton, and its last row becomes the merged
+ * Bucket's last (pieces are merged in input order).
+ *
+ * Parameters:
+ *      const char *key: the skeleton
+ *      size_t len:      the length of the skeleton
+ *      void **v:        address of the piece's Bucket
+ *      void *cl:        the Merge; its err is set to &WidthBad if the widths
+ *                       of the two Buckets differ
+ *
+ ************************/
+static void merge_bucket_cb(const char *key, size_t len, void **v, void *cl)
+{
+        Merge merge = cl;
+        Scan scan = merge->scan;
+        Bucket part = *v;
+        void **slot = PatTable_slot(scan->buckets, key, len);
+        Bucket b = *slot;
+        if (b == NULL)
+        {
+                b = new_bucket(scan, part->width, part->rowbytes);
+                *slot = b;
+        }
+        else if (b->width != part->width)
+        {
+                merge->err = &WidthBad;
+        }
+        b->height += part->height;
+        b->last = part->last;
+}
+
+/********** pick_best_cb ********
+ *
+ * Keeps the merged Bucket with the most rows, ties going to the Bucket whose
+ * last row comes first in the input.
+ *
+ * Parameters:
+ *      const char *key: the skeleton
+ *      size_t len:      the length of the skeleton
+ *      void **v:        address of the merged Bucket
+ *      void *cl:        the Pick being made
+ *
+ ************************/
+static void pick_best_cb(const char *key, size_t len, void **v, void *cl)
+{
+        Pick pick = cl;
+        Bucket b = *v;
+        Scan scan = pick->scan;
+        if (b->height > scan->best_count ||
+            (b->height == scan->best_count && b->last < scan->best->last))
+        {
+                scan->best = b;
+                scan->best_count = b->height;
+                pick->key = key;
+                pick->len = len;
+        }
+}
+
+/********** make_temp ********
+ *
+ * Creates an unlinked temporary file, gone once closed.
+ *
+ * Parameters:
+ *      const char *dir: the directory, or NULL for $TMPDIR (default /tmp)
+ *
+ * Return:
+ *      its file descriptor, open for reading and writing, or -1
+ *
+ ************************/
+int make_temp(const char *dir)
+{
+        if (dir == NULL)
+        {
+                dir = getenv("TMPDIR");
+        }
+        if (dir == NULL || dir[0] == '\0')
+        {
+                dir = "/tmp";
+        }
+        char *path = ALLOC((long)(strlen(dir) + sizeof("/restoration.XXXXXX")));
+        sprintf(path, "%s/restoration.XXXXXX", dir);
+        int fd = mkstemp(path);
+        if (fd >= 0)
+        {
+                unlink(path);
+        }
+        FREE(path);
+        return fd;
+}
+
+/********** format_where ********
+ *
+ * Writes " (line N, byte M)" for a scan that stopped on a known line, or
+ * nothing.
+ *
+ * Parameters:
+ *      char *buf:   where it goes
+ *      size_t cap:  room in buf
+ *      Fault fault: where the scan stopped, or NULL
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void format_where(char *buf, size_t cap, Fault fault)
+{
+        buf[0] = '\0';
+        if (fault != NULL && fault->err != NULL && fault->line > 0)
+        {
+                snprintf(buf, cap, " (line %zu, byte %zu)", fault->line,
+                         fault->offset);
+        }
+}
+
+/********** write_all ********
+ *
+ * writev that carries on after partial writes and interruptions.
+ *
+ * Parameters:
+ *      int fd:            where to write
+ *      struct iovec *iov: the pieces to write; consumed as they are written
+ *      int n:             number of pieces
+ *
+ * Return:
+ *      0 once everything is written, -1 on error
+ *
+ ************************/
+int write_all(int fd, struct iovec *iov, int n)
+{
+        while (n > 0)
+        {
+                ssize_t w = writev(fd, iov, n);
+                if (w < 0)
+                {
+                        if (errno == EINTR)
+                        {
+                                continue;
+                        }
+                        return -1;
+                }
+
+                /* Skip what was written, whole pieces then part of one */
+                size_t done = (size_t)w;
+                while (n > 0 && done >= iov->iov_len)
+                {
+                        done -= iov->iov_len;
+                        iov++;
+                        n--;
+                }
+                if (n > 0)
+                {
+                        iov->iov_base = (char *)iov->iov_base + done;
+                        iov->iov_len -= done;
+                }
+        }
+        return 0;
+}
+
+/********** decode_rows ********
+ *
+ * Decodes the winning Bucket's lines from the map into the output raster,
+ * splitting the rows over several threads for large images.
+ *
+ * Parameters:
+ *      Bucket win:      the winning Bucket (rows are line pointers)
+ *      const char *end: the end of the input the lines are in
+ *      char *raster:    W x H bytes for the image
+ *      int threaded:    zero to decode on this thread only (--batch workers,
+ *                       library callers)
+ *
+ * Return:
+ *      none
+ *
+ * Notes:
+ *      every row was validated during the scan, so decoding cannot RAISE
+ *      (Hanson exceptions must not be raised off the main thread)
+ ************************/
+void decode_rows(Bucket win, const char *end, char *raster, int threaded)
+{
+        size_t H = win->height;
+        size_t pixels = win->width * H;
+
+        long cpus = threaded ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+        if (nthreads > 64)
+                nthreads = 64;
+        if (nthreads > pixels / DECODE_PIXELS_PER_THREAD)
+                nthreads = pixels / DECODE_PIXELS_PER_THREAD;
+        if (nthreads > H)
+                nthreads = H;
+        if (nthreads == 0)
+                nthreads = 1;
+
+        struct Slice slices[64];
+        pthread_t tids[64];
+        int started[64];
+        for (size_t t = 0; t < nthreads; t++)
+        {
+                slices[t].lines = (const char *const *)win->data;
+                slices[t].end = end;
+                slices[t].width = win->width;
+                slices[t].first = H * t / nthreads;
+                slices[t].last = H * (t + 1) / nthreads;
+                slices[t].raster = raster;
+                /* Slice 0 runs on this thread; so does any failed start */
+                started[t] = t > 0 && pthread_create(&tids[t], NULL,
+                                                     decode_slice,
+                                                     &slices[t]) == 0;
+        }
+
+        for (size_t t = 0; t < nthreads; t++)
+        {
+                if (!started[t])
+                {
+                        decode_slice(&slices[t]);
+                }
+        }
+        for (size_t t = 1; t < nthreads; t++)
+        {
+                if (started[t])
+                {
+                        pthread_join(tids[t], NULL);
+                }
+        }
+}
+
+/********** decode_slice ********
+ *
+ * Thread body for decode_rows: decodes rows [first, last) of a Slice.
+ *
+ ************************/
+static void *decode_slice(void *cl)
+{
+        Slice s = cl;
+        for (size_t r = s->first; r < s->last; r++)
+        {
+                const char *line = s->lines[r];
+                scan_line(line, (size_t)(s->end - line),
+                          s->raster + r * s->width, NULL);
+        }
+        return NULL;
+}
+
+/********** free_scan ********
+ *
+ * Frees the table, every Bucket and all row storage. Buckets and small row
+ * storage go with the slab in one call; only Buckets that moved their rows
+ * to the heap are visited.
+ *
+ * Parameters:
+ *      Scan scan: the scan state to free
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void free_scan(Scan scan)
+{
+        int n = Seq_length(scan->heap);
+        for (int i = 0; i < n; i++)
+        {
+                Bucket b = Seq_get(scan->heap, i);
+                FREE(b->data);
+                FREE(b->runs);
+        }
+        Seq_free(&scan->heap);
+        if (scan->spill_fd >= 0)
+        {
+                close(scan->spill_fd);
+                scan->spill_fd = -1;
+        }
+        Slab_free(&scan->slab);
+        PatTable_free(&scan->buckets);
+        Skeleton_free(&scan->skel);
+        Skeleton_free(&scan->spec_key);
+        if (scan->ghosts != NULL)
+        {
+                ghosts_free(&scan->ghosts);
+        }
+}
+
+/********** obtain_mapped_sequence ********
+ *
+ * Same as obtain_sequence, but for a memory-mapped input. Lines are viewed in
+ * place and only scanned for their key and pixel count here; the bucket
+ * stores a pointer to the start of each line in the map, and digits are
+ * decoded when the image is written. Only the lines in [start, end) are
+ * read, and nothing here RAISEs except on allocation failure, so pieces of
+ * one map can be scanned on several threads at once.
+ *
+ * Parameters:
+ *      Scan scan:       the scan state receiving every usable line
+ *      const char *map: the input in memory (a mapped file or a buffer)
+ *      size_t start:    offset of the first line to scan
+ *      size_t end:      offset just past the last
+ *
+ * Return:
+ *      NULL, or &WidthBad if a row's width does not match its Bucket's (the
+ *      line is recorded in scan->fault)
+ *
+ * Notes:
+ *      with scan->prune_cap set, Buckets are pruned as the scan goes (see
+ *      prune_buckets). If the winner then cannot be shown exact, or a
+ *      pruned skeleton comes back with another width, the lines are
+ *      scanned again without pruning: the result is always that of a full
+ *      scan.
+ ************************/
+const Except_T *obtain_mapped_sequence(Scan scan, const char *map,
+                                       size_t start, size_t end)
+{
+        if (scan->prune_cap == 0)
+        {
+                return scan_mapped(scan, map, start, end);
+        }
+
+        struct Stats before = scan->stats;
+        const Except_T *err = scan_mapped(scan, map, start, end);
+        if (err != &PruneLost && (err != NULL || prune_exact(scan)))
+        {
+                return err;
+        }
+
+        size_t evicted = scan->stats.evicted;
+        reset_scan(scan);
+        scan->stats = before;
+        scan->stats.evicted = evicted;
+        scan->stats.rescans++;
+        size_t cap = scan->prune_cap;
+        scan->prune_cap = 0;
+        err = scan_mapped(scan, map, start, end);
+        scan->prune_cap = cap;
+        return err;
+}
+
+/********** scan_mapped ********
+ *
+ * The scan of obtain_mapped_sequence, pruning as it goes if asked to.
+ *
+ * Return:
+ *      NULL, &WidthBad (recorded in scan->fault), or &PruneLost
+ *
+ ************************/
+static const Except_T *scan_mapped(Scan scan, const char *map, size_t start,
+                                   size_t end)
+{
+        size_t pos = start;
+        while (pos < end)
+        {
+                const char *line = map + pos;
+                size_t left = end - pos;
+                const char *nl = memchr(line, '\n', left);
+                size_t n = nl != NULL ? (size_t)(nl - line) + 1 : left;
+                pos += n;
+                scan->stats.lines++;
+                scan->stats.bytes += n;
+
+                /* Count pixels without writing; skip row if any pix > 255 */
+                size_t row_w = scan_row(line, n, NULL, scan->skel);
+                if (row_w == SCAN_PIXEL_BAD)
+                {
+                        scan->stats.rejected++;
+                        continue;
+                }
+                if (row_w == 0)
+                {
+                        scan->stats.empty++;
+                        continue;
+                }
+
+                double t = scan->timed ? scan_clock() : 0;
+                const Except_T *err = store_sequence(scan, scan->skel->bytes,
+                                                     scan->skel->len, NULL,
+                                                     &line, sizeof(line),
+                                                     row_w,
+                                                     (size_t)(line - map));
+                if (scan->timed)
+                {
+                        scan->stats.key_s += scan_clock() - t;
+                }
+                if (err == &PruneLost)
+                {
+                        return err;
+                }
+                if (err != NULL)
+                {
+                        return note_fault(scan, err, scan->stats.lines,
+                                          (size_t)(line - map));
+                }
+                if (scan->prune_cap > 0 &&
+                    PatTable_length(scan->buckets) > scan->prune_cap)
+                {
+                        prune_buckets(scan);
+                }
+        }
+        return NULL;
+}
+
+/********** scan_stream_line ********
+ *
+ * Scans one line of a streamed input, decoding its digits to pixel bytes,
+ * and stores the row.
+ *
+ * Parameters:
+ *      Scan scan:        the scan state
+ *      const char *line: the line
+ *      size_t n:         its length, '\n' included
+ *      char *pixels:     n bytes for the decoded pixels; may be 'line' itself
+ *      size_t pos:       its offset in the input
+ *
+ * Return:
+ *      NULL, &WidthBad if the row's width does not match its Bucket's, or
+ *      &SpillFail (the line is recorded in scan->fault)
+ *
+ ************************/
+const Except_T *scan_stream_line(Scan scan, const char *line, size_t n,
+                                 char *pixels, size_t pos)
+{
+        scan->stats.lines++;
+        scan->stats.bytes += n;
+
+        /* Parse digits -> bytes; skip row if any pix > 255 */
+        size_t row_w = scan_row(line, n, pixels, scan->skel);
+        if (row_w == SCAN_PIXEL_BAD)
+        {
+                scan->stats.rejected++;
+                return NULL;
+        }
+        if (row_w == 0)
+        {
+                scan->stats.empty++;
+                return NULL;
+        }
+
+        /* The pixels are copied into the Bucket's raster */
+        double t = scan->timed ? scan_clock() : 0;
+        const Except_T *err = store_sequence(scan, scan->skel->bytes,
+                                             scan->skel->len, NULL, pixels,
+                                             row_w, row_w, pos);
+        if (scan->timed)
+        {
+                scan->stats.key_s += scan_clock() - t;
+        }
+        return err != NULL ? note_fault(scan, err, scan->stats.lines, pos)
+                           : NULL;
+}
+
+/********** store_scanned_line ********
+ *
+ * The second half of scan_stream_line, for a line already scanned on
+ * another thread (see pipeline.h): counts the line and stores its row.
+ *
+ * Parameters:
+ *      Scan scan:          the scan state
+ *      const char *key:    the line's skeleton
+ *      size_t klen:        its length
+ *      uint64_t hash:      its PatTable_hash
+ *      const char *pixels: the decoded pixels
+ *      size_t width:       how many there are, as scan_row returned it
+ *                          (SCAN_PIXEL_BAD and 0 rows are only counted)
+ *      size_t n:           the length of the line, '\n' included
+ *      size_t pos:         its offset in the input
+ *
+ * Return:
+ *      NULL, &WidthBad if the row's width does not match its Bucket's, or
+ *      &SpillFail (the line is recorded in scan->fault)
+ *
+ ************************/
+const Except_T *store_scanned_line(Scan scan, const char *key, size_t klen,
+                                   uint64_t hash, const char *pixels,
+                                   size_t width, size_t n, size_t pos)
+{
+        scan->stats.lines++;
+        scan->stats.bytes += n;
+        if (width == SCAN_PIXEL_BAD)
+        {
+                scan->stats.rejected++;
+                return NULL;
+        }
+        if (width == 0)
+        {
+                scan->stats.empty++;
+                return NULL;
+        }
+
+        double t = scan->timed ? scan_clock() : 0;
+        const Except_T *err = store_sequence(scan, key, klen, &hash, pixels,
+                                             width, width, pos);
+        if (scan->timed)
+        {
+                scan->stats.key_s += scan_clock() - t;
+        }
+        return err != NULL ? note_fault(scan, err, scan->stats.lines, pos)
+                           : NULL;
+}
+
+/********** note_fault ********
+ *
+ * Records where a scan failed, unless an earlier error already stopped it.
+ *
+ * Parameters:
+ *      Scan scan:           the scan state
+ *      const Except_T *err: the error
+ *      size_t line:         the line it was found on, counting from 1 (0
+ *                           if not known)
+ *      size_t offset:       input offset of the start of that line
+ *
+ * Return:
+ *      err, so that callers can return the result
+ *
+ ************************/
+const Except_T *note_fault(Scan scan, const Except_T *err, size_t line,
+                           size_t offset)
+{
+        if (scan->fault.err == NULL)
+        {
+                scan->fault.err = err;
+                scan->fault.line = line;
+                scan->fault.offset = offset;
+        }
+        return err;
+}
+
+/********** store_sequence ********
+ *
+ * Using the non-digit skeleton as the key, store its corresponding restored
+ * lines in the Bucket for that key
+ *
+ * Parameters:
+ *      Scan scan:         the scan state to store the row in
+ *      const char *key:   the line's skeleton
+ *      size_t klen:       its length
+ *      const uint64_t *hash: its PatTable_hash, or NULL to have the table
+ *                         compute it
+ *      const void *row:   the row to store (rowbytes bytes)
+ *      size_t rowbytes:   the number of bytes to store per row
+ *      size_t row_width:  the width of the line in pixels
+ *      size_t pos:        input offset of the line
+ *
+ * Return:
+ *      NULL, or &WidthBad if the row's width differs from earlier rows with
+ *      the same key (the row is then not stored), &SpillFail if --spill-dir
+ *      could not take the Bucket's rows, or &PruneLost if the key was
+ *      pruned with rows of another width
+ *
+ * Notes:
+ *      once the leader has held the margin (see speculate), the key is first
+ *      compared with the leader's: most lines of a hacked file are the
+ *      image's, and a match is the same Bucket the table would give, found
+ *      without hashing the key or touching the table
+ ************************/
+static const Except_T *store_sequence(Scan scan, const char *key,
+                                      size_t klen, const uint64_t *hash,
+                                      const void *row, size_t rowbytes,
+                                      size_t row_width, size_t pos)
+{
+        Bucket b = scan->spec;
+        void **slot = NULL;
+        if (b != NULL && klen == scan->spec_key->len &&
+            memcmp(key, scan->spec_key->bytes, klen) == 0)
+        {
+                scan->stats.speculated++;
+        }
+        else
+        {
+                slot = hash != NULL
+                        ? PatTable_slot_hash(scan->buckets, key, klen, *hash)
+                        : PatTable_slot(scan->buckets, key, klen);
+                b = *slot;
+        }
+
+        /* If the nondigit sequence key has not been stored yet */
+        if (b == NULL)
+        {
+                b = new_bucket(scan, row_width, rowbytes);
+                /* Insert into table */
+                *slot = b;
+
+                /* A pruned key comes back with the rows it had */
+                Ghost *g = scan->ghosts == NULL
+                        ? NULL
+                        : ghost_find(scan->ghosts,
+                                     hash != NULL ? *hash
+                                                  : PatTable_hash(key, klen));
+                if (g != NULL)
+                {
+                        b->prior = g->rows;
+                        if (g->width != row_width)
+                        {
+                                return &PruneLost;
+                        }
+                }
+        }
+        else if (row_width != b->width)
+        {
+                return &WidthBad;
+        }
+
+        /* Append the row to the Bucket (or just count it) */
+        if (scan->count_only)
+        {
+                b->height++;
+        }
+        else
+        {
+                char *dst = bucket_push(scan, b);
+                if (dst == NULL)
+                {
+                        return &SpillFail;
+                }
+                memcpy(dst, row, rowbytes);
+        }
+        size_t cnt = b->height;
+        b->last = pos;
+
+        /* The Bucket with the most rows stores the original lines */
+        if (cnt > scan->best_count)
+        {
+                scan->best_count = cnt;
+                scan->best = b;
+        }
+        if (scan->spec_margin > 0)
+        {
+                speculate(scan, b, key, klen);
+        }
+        return NULL;
+}
+
+/********** speculate ********
+ *
+ * Decides, a window of SPEC_WINDOW rows at a time, whether store_sequence
+ * speculates on the leader: it does after a window in which the leader took
+ * spec_margin percent of the rows or more, and stops after one in which it
+ * fell short. The leader's key is taken from the next of its rows that
+ * comes through the table.
+ *
+ * Parameters:
+ *      Scan scan:       the scan state
+ *      Bucket b:        the Bucket the row was stored in
+ *      const char *key: the row's skeleton
+ *      size_t klen:     its length
+ *
+ ************************/
+static void speculate(Scan scan, Bucket b, const char *key, size_t klen)
+{
+        if (b == scan->best)
+        {
+                scan->spec_lead++;
+                if (scan->spec_want)
+                {
+                        Skeleton spec = scan->spec_key;
+                        if (spec->cap < klen + 1)
+                        {
+                                spec->cap = klen + 1;
+                                RESIZE(spec->bytes, (long)spec->cap);
+                        }
+                        memcpy(spec->bytes, key, klen);
+                        spec->bytes[klen] = '\0';
+                        spec->len = klen;
+                        scan->spec = b;
+                        scan->spec_want = 0;
+                }
+        }
+        if (++scan->spec_seen < SPEC_WINDOW)
+        {
+                return;
+        }
+
+        if (scan->spec_lead * 100 >= (size_t)scan->spec_margin * SPEC_WINDOW)
+        {
+                scan->spec_want = scan->spec != scan->best;
+        }
+        else
+        {
+                scan->spec = NULL;
+                scan->spec_want = 0;
+        }
+        scan->spec_seen = 0;
+        scan->spec_lead = 0;
+}
+
+/********** prune_buckets ********
+ *
+ * --prune: keeps the prune_cap / 2 Buckets with the most rows (and the
+ * leader, whatever ties there are) and drops the rest, freeing their rows.
+ * A dropped skeleton leaves a ghost: its hash, width and row count. The
+ * survivors are copied to a fresh table and slab, so the table stays small
+ * however many decoys the input has.
+ *
+ * Parameters:
+ *      Scan scan: a scan holding more than prune_cap Buckets
+ *
+ ************************/
+static void prune_buckets(Scan scan)
+{
+        size_t n = PatTable_length(scan->buckets);
+        size_t *heights = ALLOC((long)(n * sizeof(*heights)));
+        size_t *fill = heights;
+        PatTable_map(scan->buckets, height_cb, &fill);
+        qsort(heights, n, sizeof(*heights), compare_heights);
+        size_t keep = scan->prune_cap / 2;
+
+        struct Prune p;
+        p.scan = scan;
+        p.table = PatTable_new(scan->prune_cap);
+        p.slab = Slab_new();
+        p.heap = Seq_new(0);
+        p.floor = heights[keep < n ? keep : n - 1];
+        p.best = NULL;
+        FREE(heights);
+        if (scan->ghosts == NULL)
+        {
+                NEW0(scan->ghosts);
+        }
+
+        PatTable_map(scan->buckets, prune_cb, &p);
+        Seq_free(&scan->heap);
+        Slab_free(&scan->slab);
+        PatTable_free(&scan->buckets);
+        scan->buckets = p.table;
+        scan->slab = p.slab;
+        scan->heap = p.heap;
+        scan->best = p.best;
+
+        /* The Bucket speculated on has moved; take its copy's next row */
+        scan->spec_want = scan->spec != NULL;
+        scan->spec = NULL;
+}
+
+/* Collects Bucket heights for prune_buckets */
+static void height_cb(const char *key, size_t len, void **v, void *cl)
+{
+        size_t **fill = cl;
+        Bucket b = *v;
+        (void)key;
+        (void)len;
+        *(*fill)++ = b->height;
+}
+
+/* qsort order for heights: most rows first */
+static int compare_heights(const void *a, const void *b)
+{
+        size_t x = *(const size_t *)a;
+        size_t y = *(const size_t *)b;
+        return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/********** prune_cb ********
+ *
+ * Moves one Bucket to the pruned table, with its rows if they are in the
+ * old slab, or drops it and leaves its ghost.
+ *
+ ************************/
+static void prune_cb(const char *key, size_t len, void **v, void *cl)
+{
+        Prune p = cl;
+        Scan scan = p->scan;
+        Bucket b = *v;
+        if (b != scan->best && b->height <= p->floor)
+        {
+                ghost_add(scan->ghosts, PatTable_hash(key, len), b->width,
+                          b->height);
+                if (b->on_heap)
+                {
+                        FREE(b->data);
+                        FREE(b->runs);
+                        scan->resident -= b->cap * b->rowbytes;
+                }
+                scan->stats.evicted++;
+                return;
+        }
+
+        Bucket nb = Slab_alloc(p->slab, sizeof(*nb));
+        *nb = *b;
+        if (b->on_heap)
+        {
+                Seq_addhi(p->heap, nb);
+        }
+        else if (b->cap > 0)
+        {
+                nb->data = Slab_alloc(p->slab, b->cap * b->rowbytes);
+                memcpy(nb->data, b->data,
+                       (b->height - b->spilled) * b->rowbytes);
+        }
+        *PatTable_slot(p->table, key, len) = nb;
+        if (b == scan->best)
+        {
+                p->best = nb;
+        }
+}
+
+/********** prune_exact ********
+ *
+ * Tells whether a pruned scan's winner is the one a full scan would pick,
+ * with all its rows: it was never dropped, and it has more rows than any
+ * other skeleton can have (a Bucket's rows plus those it had when pruned, or
+ * any ghost's).
+ *
+ * Return:
+ *      nonzero if it is, or if nothing was pruned
+ *
+ ************************/
+static int prune_exact(Scan scan)
+{
+        Bucket win = scan->best;
+        if (scan->ghosts == NULL || win == NULL)
+        {
+                return 1;
+        }
+        if (win->prior > 0)
+        {
+                return 0;
+        }
+        struct Rival r = {win, scan->ghosts->most};
+        PatTable_map(scan->buckets, rival_cb, &r);
+        return win->height > r.most;
+}
+
+static void rival_cb(const char *key, size_t len, void **v, void *cl)
+{
+        Rival r = cl;
+        Bucket b = *v;
+        (void)key;
+        (void)len;
+        if (b != r->win && b->height + b->prior > r->most)
+        {
+                r->most = b->height + b->prior;
+        }
+}
+
+/********** ghost_find ********
+ *
+ * Return:
+ *      the ghost of a pruned skeleton with this hash, or NULL
+ *
+ ************************/
+static Ghost *ghost_find(Ghosts g, uint64_t hash)
+{
+        hash = hash != 0 ? hash : 1;
+        if (g->length == 0)
+        {
+                return NULL;
+        }
+        for (size_t i = hash & g->mask; g->slots[i].hash != 0;
+             i = (i + 1) & g->mask)
+        {
+                if (g->slots[i].hash == hash)
+                {
+                        return &g->slots[i];
+                }
+        }
+        return NULL;
+}
+
+/********** ghost_add ********
+ *
+ * Records the rows of a pruned skeleton, adding to its ghost if it was
+ * pruned before. Two skeletons sharing a hash share a ghost: their rows are
+ * summed (only ever overstating a rival) and differing widths mark it
+ * GHOST_WIDTHS (so that either one coming back rescans the input).
+ *
+ ************************/
+static void ghost_add(Ghosts g, uint64_t hash, size_t width, size_t rows)
+{
+        hash = hash != 0 ? hash : 1;
+        if (2 * (g->length + 1) > g->mask + 1 || g->slots == NULL)
+        {
+                /* Keep the load factor at or under one half */
+                size_t old_n = g->slots == NULL ? 0 : g->mask + 1;
+                size_t n = old_n == 0 ? 1024 : old_n * 2;
+                Ghost *old = g->slots;
+                g->slots = CALLOC((long)n, (long)sizeof(Ghost));
+                g->mask = n - 1;
+                for (size_t i = 0; i < old_n; i++)
+                {
+                        if (old[i].hash != 0)
+                        {
+                                size_t j = old[i].hash & g->mask;
+                                while (g->slots[j].hash != 0)
+                                {
+                                        j = (j + 1) & g->mask;
+                                }
+                                g->slots[j] = old[i];
+                        }
+                }
+                FREE(old);
+        }
+
+        size_t i = hash & g->mask;
+        while (g->slots[i].hash != 0 && g->slots[i].hash != hash)
+        {
+                i = (i + 1) & g->mask;
+        }
+        Ghost *gh = &g->slots[i];
+        if (gh->hash == 0)
+        {
+                gh->hash = hash;
+                gh->width = width;
+                gh->rows = 0;
+                g->length++;
+        }
+        else if (gh->width != width)
+        {
+                gh->width = GHOST_WIDTHS;
+        }
+        gh->rows += rows;
+        if (gh->rows > g->most)
+        {
+                g->most = gh->rows;
+        }
+}
+
+static void ghosts_free(Ghosts *g)
+{
+        FREE((*g)->slots);
+        FREE(*g);
+}
+
+/********** new_bucket ********
+ *
+ * Allocates an empty Bucket in the scan slab.
+ *
+ * Parameters:
+ *      Scan scan:       the scan state to allocate from
+ *      size_t width:    pixels per row
+ *      size_t rowbytes: bytes stored per row
+ *
+ * Return:
+ *      the new Bucket
+ *
+ ************************/
+static Bucket new_bucket(Scan scan, size_t width, size_t rowbytes)
+{
+        Bucket b = Slab_alloc(scan->slab, sizeof(*b));
+        scan->stats.allocs++;
+        scan->stats.alloc_bytes += sizeof(*b);
+        b->width = width;
+        b->height = 0;
+        b->cap = 0;
+        b->rowbytes = rowbytes;
+        b->data = NULL;
+        b->on_heap = 0;
+        b->last = 0;
+        b->spilled = 0;
+        b->runs = NULL;
+        b->nruns = 0;
+        b->runs_cap = 0;
+        b->prior = 0;
+        return b;
+}
+
+/********** bucket_push ********
+ *
+ * Makes room for one more row at the end of a Bucket, doubling its storage
+ * when full (by an eighth past ROWS_DOUBLE_MAX). Under --spill-dir, a heap
+ * Bucket that would take the scan's footprint past the limit writes its
+ * rows to the spill file and starts over in the storage it has. Slab
+ * Buckets are not spilled: their rows are at most SLAB_ROWS_MAX bytes
+ * apiece, and count against the limit with the rest of the slab.
+ *
+ * Parameters:
+ *      Scan scan: the scan state owning the Bucket
+ *      Bucket b:  the Bucket to grow
+ *
+ * Return:
+ *      the address where the new row's rowbytes bytes go, or NULL if the
+ *      rows could not be spilled
+ *
+ ************************/
+static char *bucket_push(Scan scan, Bucket b)
+{
+        size_t held = b->height - b->spilled;
+        if (held == b->cap)
+        {
+                size_t cap = b->cap == 0 ? 1 : b->cap * 2;
+                if (b->cap * b->rowbytes >= ROWS_DOUBLE_MAX)
+                {
+                        cap = b->cap + b->cap / 8;
+                }
+                size_t bytes = cap * b->rowbytes;
+                size_t old = b->cap * b->rowbytes;
+                if (b->on_heap && scan->may_spill && scan->spill_dir != NULL &&
+                    footprint(scan) + bytes - old > scan->spill_limit)
+                {
+                        if (spill_bucket(scan, b) != 0)
+                        {
+                                return NULL;
+                        }
+                        b->height++;
+                        return b->data;
+                }
+                bucket_grow(scan, b, cap);
+        }
+        b->height++;
+        return b->data + b->rowbytes * held;
+}
+
+/********** bucket_grow ********
+ *
+ * Gives a Bucket's row storage room for 'cap' rows, keeping the rows it
+ * holds: in the slab while that is small, in a heap block of its own after.
+ *
+ * Parameters:
+ *      Scan scan:  the scan state owning the Bucket
+ *      Bucket b:   the Bucket
+ *      size_t cap: the rows it needs room for; no more than it has is a
+ *                  no-op
+ *
+ ************************/
+static void bucket_grow(Scan scan, Bucket b, size_t cap)
+{
+        if (cap <= b->cap)
+        {
+                return;
+        }
+        size_t held = b->height - b->spilled;
+        size_t bytes = cap * b->rowbytes;
+        size_t old = b->cap * b->rowbytes;
+        scan->stats.allocs++;
+        scan->stats.alloc_bytes += bytes;
+        if (b->on_heap)
+        {
+                RESIZE(b->data, (long)bytes);
+                scan->resident += bytes - old;
+        }
+        else if (bytes <= SLAB_ROWS_MAX)
+        {
+                /* The old storage is left to the slab */
+                char *data = Slab_alloc(scan->slab, bytes);
+                if (held > 0)
+                {
+                        memcpy(data, b->data, held * b->rowbytes);
+                }
+                b->data = data;
+        }
+        else
+        {
+                char *data = ALLOC((long)bytes);
+                if (held > 0)
+                {
+                        memcpy(data, b->data, held * b->rowbytes);
+                }
+                b->data = data;
+                b->on_heap = 1;
+                Seq_addhi(scan->heap, b);
+                scan->resident += bytes;
+        }
+        b->cap = cap;
+}
+
+/********** footprint ********
+ *
+ * The memory a scan holds for its input: the pattern table with its keys,
+ * the slab (Buckets and small row storage, dead copies included) and the
+ * rows on the heap. This, not the heap rows alone, is what --spill-limit
+ * bounds, so decoy skeletons push the image's rows out to the spill file
+ * sooner rather than adding to the limit.
+ *
+ ************************/
+static size_t footprint(Scan scan)
+{
+        return PatTable_bytes(scan->buckets) + Slab_bytes(scan->slab) +
+               scan->resident;
+}
+
+/********** spill_bucket ********
+ *
+ * Appends the rows a Bucket holds in memory to the spill file (creating it
+ * in the --spill-dir on first use) and records where they went, leaving the
+ * Bucket's storage empty for reuse. Rows that land right after the Bucket's
+ * previous run extend it.
+ *
+ * Parameters:
+ *      Scan scan: the scan state, with its spill file
+ *      Bucket b:  a heap Bucket with full storage
+ *
+ * Return:
+ *      0 on success, -1 if the file could not be created or written
+ *
+ * Notes:
+ *      does not RAISE, so --batch workers can spill too
+ ************************/
+static int spill_bucket(Scan scan, Bucket b)
+{
+        if (scan->spill_fd < 0)
+        {
+                scan->spill_fd = make_temp(scan->spill_dir);
+                if (scan->spill_fd < 0)
+                {
+                        return -1;
+                }
+        }
+
+        size_t rows = b->height - b->spilled;
+        size_t len = rows * b->rowbytes;
+        const char *p = b->data;
+        off_t off = scan->spill_end;
+        while (len > 0)
+        {
+                ssize_t n = pwrite(scan->spill_fd, p, len, off);
+                if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (n <= 0)
+                {
+                        return -1;
+                }
+                p += n;
+                off += n;
+                len -= (size_t)n;
+        }
+
+        Run *last = b->nruns > 0 ? &b->runs[b->nruns - 1] : NULL;
+        if (last != NULL &&
+            last->off + (off_t)(last->rows * b->rowbytes) == scan->spill_end)
+        {
+                last->rows += rows;
+        }
+        else
+        {
+                if (b->nruns == b->runs_cap)
+                {
+                        b->runs_cap = b->runs_cap == 0 ? 4 : b->runs_cap * 2;
+                        long bytes = (long)(b->runs_cap * sizeof(Run));
+                        if (b->runs == NULL)
+                        {
+                                b->runs = ALLOC(bytes);
+                        }
+                        else
+                        {
+                                RESIZE(b->runs, bytes);
+                        }
+                }
+                b->runs[b->nruns].off = scan->spill_end;
+                b->runs[b->nruns].rows = rows;
+                b->nruns++;
+        }
+
+        b->spilled += rows;
+        scan->stats.spill_bytes += rows * b->rowbytes;
+        scan->spill_end = off;
+        return 0;
+}
@@ -0,0 +1,213 @@
+/* engine.h
+ *
+ * The restoration engine: sorts the lines of a hacked PGM file into Buckets
+ * by their non-digit skeleton, keeps the Bucket with the most rows as the
+ * original image, and decodes its rows. The restoration program and the
+ * librestoration API (restore.h) are both built on it.
+ *
+ * Lines come either from memory that outlives the scan (a mapped file, a
+ * caller's buffer), in which case Buckets store a pointer to each line and
+ * only the winner's are decoded, or one at a time from a stream, in which
+ * case Buckets store the decoded pixels.
+ *
+ * Nothing here RAISEs except on allocation failure: errors are returned as
+ * the address of an Except_T (NULL for none), so that scans can run on any
+ * thread and callers choose how to report them.
+ */
+#ifndef ENGINE_INCLUDED
+#define ENGINE_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "except.h"
+#include "seq.h"
+#include "linescan.h"
+#include "pattable.h"
+#include "slab.h"
+
+/* Rows sharing a skeleton whose widths differ */
+extern const Except_T WidthBad;
+
+/* Rows that --spill-dir could not write out */
+extern const Except_T SpillFail;
+
+/* An input with no line that holds a usable row */
+extern const Except_T NoInput;
+
+/* Most scan threads -j accepts */
+#define MAX_JOBS 256
+
+/* Row bytes a --spill-dir run keeps in memory, unless --spill-limit says */
+#define SPILL_LIMIT_DEFAULT ((size_t)256 << 20)
+
+/* Skeletons a --prune scan keeps track of, unless --prune=N says */
+#define PRUNE_CAP_DEFAULT 4096
+
+/* Percent of recent rows one skeleton needs to be speculated on, by default */
+#define SPEC_MARGIN_DEFAULT 50
+
+/* Rows of one Bucket written to the spill file together */
+typedef struct Run
+{
+        off_t off;   /* where they start in the spill file */
+        size_t rows;
+} Run;
+
+/*
+ * This struct represents all lines sharing one non-digit sequence. Rows are
+ * stored back to back in 'data', rowbytes apiece: the decoded pixels for a
+ * streamed input, or a pointer to the start of the line for a mapped one.
+ */
+typedef struct Bucket
+{
+        size_t width;    /* pixels per row */
+        size_t height;   /* rows stored */
+        size_t cap;      /* rows 'data' has room for */
+        size_t rowbytes; /* bytes per stored row */
+        char *data;
+        int on_heap;     /* 'data' was ALLOCed rather than slab-allocated */
+        size_t last;     /* input offset of the newest row's line */
+        size_t spilled;  /* of the rows, how many went to the spill file */
+        Run *runs;       /* where they went, in row order (ALLOCed) */
+        size_t nruns;
+        size_t runs_cap;
+        size_t prior;    /* --prune: rows of this skeleton that were pruned
+                            before this Bucket was made */
+} *Bucket;
+
+/*
+ * Counters and phase timings for --stats. The counters are always kept (they
+ * cost an add per line); the clock is only read when --stats asked for it.
+ */
+typedef struct Stats
+{
+        double scan_s;      /* reading and scanning lines (obtain_*) */
+        double key_s;       /* of scan_s: skeleton lookups in the table */
+        double decode_s;    /* decoding the winning rows */
+        double output_s;    /* writing the image */
+        double teardown_s;  /* freeing the scan state and the input */
+        size_t bytes;       /* input bytes read */
+        size_t lines;       /* input lines read */
+        size_t rejected;    /* lines skipped for a pixel over 255 (PixelBad) */
+        size_t empty;       /* lines skipped for holding no pixels */
+        size_t buckets;     /* distinct skeletons */
+        size_t win_rows;    /* rows in the winning Bucket */
+        size_t allocs;      /* allocations made for scan storage */
+        size_t alloc_bytes; /* bytes asked for by those allocations */
+        size_t spill_bytes; /* row bytes written to --spill-dir */
+        size_t evicted;     /* --prune: Buckets pruned */
+        size_t rescans;     /* --prune: scans done again without pruning */
+        size_t speculated;  /* rows matched to the leader without a lookup */
+        size_t files;       /* inputs restored */
+        size_t failed;      /* --batch inputs that could not be restored */
+} *Stats;
+
+/*
+ * Where a scan stopped: its first fatal error and the line it was found on,
+ * for diagnostics. Offsets are into the (decompressed) input.
+ */
+typedef struct Fault
+{
+        const Except_T *err; /* NULL while the scan has not failed */
+        size_t line;         /* the line, counting from 1; 0 if unknown */
+        size_t offset;       /* input offset of the start of that line */
+} *Fault;
+
+/* Widths and row counts of pruned skeletons, by hash (engine.c) */
+typedef struct Ghosts *Ghosts;
+
+/* Everything gathered while scanning the input */
+typedef struct Scan
+{
+        PatTable_T buckets; /* Bucket per skeleton */
+        Slab_T slab;        /* Buckets and their small row storage */
+        Seq_T heap;         /* Buckets whose rows moved to the heap */
+        Skeleton skel;      /* skeleton of the line being scanned */
+        Bucket best;        /* Bucket with the most rows so far */
+        size_t best_count;  /* number of rows in best */
+        int count_only;     /* only count rows per Bucket; store nothing */
+        int timed;          /* read the clock for stats.key_s and friends */
+        struct Stats stats;
+        struct Fault fault; /* why the scan stopped, if it did */
+
+        /*
+         * --spill-dir: once the scan's memory (the table, the slab and the
+         * heap rows) passes spill_limit, a heap Bucket that needs more room
+         * writes its rows to the spill file instead. Only rows of streamed
+         * inputs (pixels, not pointers into a map) are spilled, and each
+         * skeleton's key and small row storage stay in memory whatever the
+         * limit.
+         */
+        const char *spill_dir; /* NULL: every row stays in memory */
+        size_t spill_limit;
+        int may_spill;         /* this input's rows can be spilled */
+        size_t resident;       /* bytes of row storage on the heap */
+        int spill_fd;          /* the spill file, -1 until first needed */
+        off_t spill_end;       /* bytes written to it */
+
+        /*
+         * --prune: a scan of an input in memory keeps at most prune_cap
+         * Buckets. Past that, those with the fewest rows are dropped and
+         * only their skeleton's hash, width and row count are kept (in
+         * 'ghosts'). The winner is exact if it was never dropped and no
+         * other skeleton can have as many rows; otherwise the input is
+         * scanned again without pruning.
+         */
+        size_t prune_cap;      /* 0: keep every Bucket */
+        Ghosts ghosts;         /* NULL until the first Bucket is dropped */
+
+        /*
+         * Speculation: once the leading Bucket has taken spec_margin percent
+         * of the rows of a window (see store_sequence), each line's skeleton
+         * is compared with the leader's before the table is searched, and a
+         * line that matches goes straight to it. A window in which the
+         * leader falls short of the margin ends the speculation until
+         * another window meets it again.
+         */
+        unsigned spec_margin;  /* percent; 0: never speculate */
+        Bucket spec;           /* the Bucket speculated on, or NULL */
+        Skeleton spec_key;     /* its skeleton */
+        int spec_want;         /* speculate on 'best' when its next row comes */
+        size_t spec_seen;      /* rows stored in the current window */
+        size_t spec_lead;      /* of those, rows stored in the leader */
+} *Scan;
+
+extern void init_scan(Scan scan, size_t input_len, int count_only);
+
+extern void reset_scan(Scan scan);
+
+extern void free_scan(Scan scan);
+
+extern const Except_T *obtain_mapped_sequence(Scan scan, const char *map,
+                                              size_t start, size_t end);
+
+extern const Except_T *scan_parallel(Scan scan, const char *map,
+                                     size_t start, size_t end, size_t jobs);
+
+extern const Except_T *scan_stream_line(Scan scan, const char *line,
+                                        size_t n, char *pixels, size_t pos);
+
+extern const Except_T *store_scanned_line(Scan scan, const char *key,
+                                          size_t klen, uint64_t hash,
+                                          const char *pixels, size_t width,
+                                          size_t n, size_t pos);
+
+extern const Except_T *note_fault(Scan scan, const Except_T *err,
+                                  size_t line, size_t offset);
+
+extern void decode_rows(Bucket win, const char *end, char *raster,
+                        int threaded);
+
+extern int make_temp(const char *dir);
+
+extern void format_where(char *buf, size_t cap, Fault fault);
+
+extern int write_all(int fd, struct iovec *iov, int n);
+
+extern double scan_clock(void);
+
+extern void add_stats(Stats sum, Stats part);
+
+#endif
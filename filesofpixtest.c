@@ -1,17 +1,30 @@
 /* filesofpix.c — tests for restoration + readaline
  *
- *  1) Batch tests: run ./restoration on known *-corrupt.pgm inputs.
+ *  1) Batch tests: run ./restoration on known *-corrupt.pgm inputs, one
+ *     file at a time and in a single --batch run, and check that a bad file
+ *     in a batch is skipped but reported.
  *  2) Validate P5 output: header parses, raster size == W*H, maxval==255.
- *  3) Edge cases: stdin mode, no usable rows, pixel >255, width mismatch,
- *     CRLF input, overlong line (>1000 without '\n' => exit(4)).
- *  4) Unit tests for readaline (EOF, CRLF, simple line).
+ *  3) Edge cases: stdin mode, no usable rows, pixel >255, width mismatch
+ *     (and the line, offset and exit status reported for it), CRLF input,
+ *     overlong line (>1000 without '\n' => exit(4)), --two-pass (file and
+ *     stdin), --lazy, --read-ahead, output decoded into a mapped file,
+ *     --prune, --speculate, -j on piped input.
+ *  4) Unit tests for readaline (EOF, CRLF, simple line, closing a stream
+ *     early), readaline_into (buffer reuse and growth) and LineReader.
+ *  5) --serve, driven by a small client stand-in over the Unix socket.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "readaline.h"   
 
@@ -21,6 +34,9 @@ static int run_cmd(const char *cmd);
 static int parse_p5_header(FILE *fp, size_t *W, size_t *H, int *maxval, long *data_off);
 static int check_output_file(const char *outpath, const char *label);
 static int write_text_file(const char *path, const char *data, size_t nbytes);
+static int serve_request(const char *sock, int kind, const char *payload, size_t len,
+                         char **reply, size_t *reply_len);
+static char *read_file(const char *path, size_t *len);
 
 /* Batch: run on the provided corrupted inputs */
 
@@ -113,6 +129,95 @@ static void test_readaline_crlf(void)
     remove(path);
 }
 
+static void test_readaline_into(void)
+{
+    const char *path = "tmp_readaline_into.txt";
+    char data[600];
+    memcpy(data, "ab\n", 3);
+    memset(data + 3, 'x', 499);
+    memcpy(data + 502, "\ncd", 3);
+    CHECKI(write_text_file(path, data, 505) == 0, "write readaline_into tmp");
+
+    FILE *fp = fopen(path, "rb");
+    CHECKI(fp != NULL, "open readaline_into tmp");
+
+    char *buf = NULL;
+    size_t cap = 0;
+    size_t n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 3 && buf && memcmp(buf, "ab\n", 4) == 0,
+           "readaline_into first line 'ab\\n', NUL-terminated");
+    CHECKI(cap >= 3, "capacity covers the line");
+
+    /* A 500-byte line grows the same buffer */
+    n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 500 && buf[0] == 'x' && buf[499] == '\n',
+           "readaline_into long line");
+    CHECKI(cap >= 500, "capacity grew for the long line");
+
+    /* Last line without a newline, then EOF */
+    n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 2 && memcmp(buf, "cd", 3) == 0, "readaline_into last line");
+    n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 0, "readaline_into EOF -> 0");
+    free(buf);
+
+    /* A NULL buffer is allocated at the capacity asked for, and a line
+       that fits does not grow it */
+    rewind(fp);
+    buf = NULL;
+    cap = 1024;
+    n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 3 && cap == 1024, "readaline_into keeps the size hint");
+    n = readaline_into(fp, &buf, &cap);
+    CHECKI(n == 500 && cap == 1024, "a line within the hint does not grow it");
+
+    free(buf);
+    fclose(fp);
+    remove(path);
+}
+
+static void test_readaline_close_early(void)
+{
+    /* Closing a stream mid-file leaves nothing behind for the next one */
+    const char *a = "tmp_readaline_a.txt";
+    const char *b = "tmp_readaline_b.txt";
+    CHECKI(write_text_file(a, "A1\nA2\nA3\n", 9) == 0, "write a tmp");
+    CHECKI(write_text_file(b, "B1\nB2\n", 6) == 0, "write b tmp");
+
+    FILE *fp = fopen(a, "rb");
+    CHECKI(fp != NULL, "open a tmp");
+    if (!fp) return;
+    char *line = NULL;
+    size_t n = readaline(fp, &line);
+    CHECKI(n == 3 && memcmp(line, "A1\n", 4) == 0, "first line of a");
+    CHECKI(ftell(fp) == 3, "readaline reads no further than the newline");
+    free(line);
+    fclose(fp);
+
+    fp = fopen(b, "rb");
+    CHECKI(fp != NULL, "open b tmp");
+    if (!fp) return;
+    n = readaline(fp, &line);
+    CHECKI(n == 3 && memcmp(line, "B1\n", 4) == 0,
+           "first line of b after a was closed early");
+    free(line);
+
+    /* A LineReader on the rest of b, closed before EOF */
+    LineReader r = LineReader_new(fp);
+    char *buf = NULL;
+    size_t cap = 0;
+    n = LineReader_next(r, &buf, &cap);
+    CHECKI(n == 3 && memcmp(buf, "B2\n", 4) == 0, "LineReader line");
+    n = LineReader_next(r, &buf, &cap);
+    CHECKI(n == 0 && buf[0] == '\0', "LineReader EOF -> 0");
+    LineReader_free(&r);
+    CHECKI(r == NULL, "LineReader_free clears the handle");
+    free(buf);
+    fclose(fp);
+    remove(a);
+    remove(b);
+}
+
 /* restoration integration tests */
 
 static void test_batch_corrupt_inputs(void)
@@ -135,6 +240,59 @@ static void test_batch_corrupt_inputs(void)
     }
 }
 
+static void test_batch_mode_corrupt_inputs(void)
+{
+    /* One process for all inputs: file list on stdin, outputs in . */
+    const char *list = "tmp_batch_list.txt";
+    FILE *fp = fopen(list, "wb");
+    CHECKI(fp != NULL, "write batch list");
+    if (!fp) return;
+    for (int i = 0; i < ARR_LEN(CORRUPT_LIST); i++)
+        fprintf(fp, "%s\n", CORRUPT_LIST[i]);
+    fclose(fp);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "./restoration --batch - . < %s", list);
+    int rc = run_cmd(cmd);
+    CHECKI(rc == 0, "restoration --batch failed on corrupted inputs");
+
+    for (int i = 0; i < ARR_LEN(CORRUPT_LIST); i++) {
+        const char *in = CORRUPT_LIST[i];
+        char out[256];
+        snprintf(out, sizeof(out), "%s.out", in);
+        CHECKF(check_output_file(out, in) == 0, "bad P5 output for %s", in);
+        remove(out);
+    }
+    remove(list);
+}
+
+static void test_batch_bad_file(void)
+{
+    /* The good file is restored even though the bad one fails */
+    const char *good = "tmp_batch_good.txt";
+    const char *bad = "tmp_batch_bad.txt";
+    CHECKI(write_text_file(good, "ab12\nab34\n", 10) == 0, "write batch good");
+    CHECKI(write_text_file(bad, "---\n", 4) == 0, "write batch bad");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "printf '%s\\n%s\\n' | ./restoration -j 2 --batch - . 2>/dev/null",
+             bad, good);
+    int rc = run_cmd(cmd);
+    CHECKI(rc != 0, "batch with a bad file should fail");
+
+    CHECKI(check_output_file("tmp_batch_good.txt.out", "batch good") == 0,
+           "batch good output check");
+    FILE *fp = fopen("tmp_batch_bad.txt.out", "rb");
+    CHECKI(fp == NULL, "no output for the bad batch file");
+    if (fp) fclose(fp);
+
+    remove("tmp_batch_good.txt.out");
+    remove("tmp_batch_bad.txt.out");
+    remove(good);
+    remove(bad);
+}
+
 static void test_stdin_mode(void)
 {
     const char *in = "tmp_stdin_mode.txt";
@@ -204,6 +362,42 @@ static void test_width_mismatch(void)
     remove(out);
 }
 
+static void test_diagnostics(void)
+{
+    /* A failed scan names its line and offset, by message, status and JSON */
+    const char *in = "tmp_diagnostics.txt";
+    const char *data = "a1b2c\n"
+                       "x300y\n"
+                       "\n"
+                       "a3b4c\n"
+                       "a1b2c3\n";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write diagnostics input");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > /dev/null 2> tmp_diagnostics.err;"
+             " test $? -eq 7"
+             " && grep -q 'inconsistent row widths (line 5, byte 19)'"
+             " tmp_diagnostics.err", in);
+    CHECKI(run_cmd(cmd) == 0, "width mismatch reports line 5, byte 19, status 7");
+
+    snprintf(cmd, sizeof(cmd),
+             "./restoration -j 2 --stats=json:tmp_diagnostics.json %s"
+             " > /dev/null 2>&1;"
+             " grep -q '\"code\": \"width_mismatch\", \"exit_status\": 7' tmp_diagnostics.json"
+             " && grep -q '\"line\": 5, \"offset\": 19' tmp_diagnostics.json"
+             " && grep -q '\"rows_rejected_pixelbad\": 1, \"rows_skipped_nopixels\": 1'"
+             " tmp_diagnostics.json", in);
+    CHECKI(run_cmd(cmd) == 0, "--stats=json reports the error and skipped rows");
+
+    CHECKI(run_cmd("./restoration tmp_no_such_input > /dev/null 2>&1; test $? -eq 3") == 0,
+           "missing input exits with status 3");
+
+    remove("tmp_diagnostics.err");
+    remove("tmp_diagnostics.json");
+    remove(in);
+}
+
 
 static void test_crlf_input(void)
 {
@@ -224,6 +418,539 @@ static void test_crlf_input(void)
     remove(in);
 }
 
+static void test_gzip_input(void)
+{
+    /* A gzip input, as a file and on stdin, restores to the plain image */
+    const char *in = "tmp_gzip_input.txt";
+    const char *data = "ab12\nab34\nxy99\n";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write gzip input");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "gzip -c %s > %s.gz && ./restoration %s > tmp_gzip_plain.pgm"
+             " && ./restoration %s.gz > tmp_gzip_file.pgm"
+             " && ./restoration < %s.gz > tmp_gzip_stdin.pgm"
+             " && cmp -s tmp_gzip_plain.pgm tmp_gzip_file.pgm"
+             " && cmp -s tmp_gzip_plain.pgm tmp_gzip_stdin.pgm",
+             in, in, in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "gzip input restores like the plain file");
+
+    snprintf(cmd, sizeof(cmd),
+             "head -c 12 %s.gz | ./restoration > /dev/null 2>&1", in);
+    CHECKI(run_cmd(cmd) != 0, "truncated gzip input should fail");
+
+    remove("tmp_gzip_plain.pgm");
+    remove("tmp_gzip_file.pgm");
+    remove("tmp_gzip_stdin.pgm");
+    remove("tmp_gzip_input.txt.gz");
+    remove(in);
+}
+
+static void test_spill_dir(void)
+{
+    /* Piped rows spilled under a zero limit still restore the same image */
+    const char *in = "tmp_spill_input.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "open spill input");
+    if (!fp) return;
+    for (int r = 0; r < 400; r++) {
+        fprintf(fp, "a");
+        for (int c = 0; c < 32; c++)
+            fprintf(fp, "%d,", (r + c) % 256);
+        fprintf(fp, "\n");
+        if (r % 3 == 0)
+            fprintf(fp, "decoy%d 1 2\n", r);
+    }
+    fclose(fp);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_spill_plain.pgm"
+             " && cat %s | ./restoration --spill-dir . --spill-limit 0"
+             " > tmp_spill_spilled.pgm"
+             " && cmp -s tmp_spill_plain.pgm tmp_spill_spilled.pgm",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "spilled rows restore like the plain file");
+
+    snprintf(cmd, sizeof(cmd),
+             "cat %s | ./restoration --spill-dir ./no-such-dir"
+             " --spill-limit 0 > /dev/null 2>&1", in);
+    CHECKI(run_cmd(cmd) != 0, "unusable spill dir should fail");
+
+    remove("tmp_spill_plain.pgm");
+    remove("tmp_spill_spilled.pgm");
+    remove(in);
+}
+
+static void test_spill_bound(void)
+{
+    /*
+     * 12.8 MB of image rows and a decoy every tenth line, piped under a
+     * 1 MB limit: the rows go to the spill file, so peak RSS stays well
+     * under the rows themselves
+     */
+    const char *in = "tmp_spill_bound.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "open spill bound input");
+    if (!fp) return;
+    for (int r = 0; r < 100000; r++) {
+        fputc('a', fp);
+        for (int c = 0; c < 128; c++)
+            fprintf(fp, "%d,", (r + c) % 10);
+        fputc('\n', fp);
+        if (r % 10 == 0)
+            fprintf(fp, "decoy%d 1 2\n", r);
+    }
+    fclose(fp);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_spill_plain.pgm"
+             " && cat %s | ./restoration --spill-dir . --spill-limit 1M"
+             " --stats=json:tmp_spill.json > tmp_spill_spilled.pgm"
+             " && cmp -s tmp_spill_plain.pgm tmp_spill_spilled.pgm",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "rows spilled under 1M restore like the file");
+
+    size_t len = 0;
+    char *json = read_file("tmp_spill.json", &len);
+    const char *rss = json ? memmem(json, len, "\"peak_rss_bytes\": ", 18)
+                           : NULL;
+    unsigned long long peak = rss ? strtoull(rss + 18, NULL, 10) : 0;
+    char got[32];
+    snprintf(got, sizeof(got), "%llu", peak);
+    CHECKF(peak > 0 && peak < (8ull << 20),
+           "peak RSS under --spill-limit 1M should stay under 8 MB, was %s",
+           got);
+    free(json);
+
+    remove("tmp_spill_plain.pgm");
+    remove("tmp_spill_spilled.pgm");
+    remove("tmp_spill.json");
+    remove(in);
+}
+
+static void test_two_pass(void)
+{
+    /* --two-pass counts rows first, then re-reads the file for the winner */
+    const char *in = "tmp_two_pass_input.txt";
+    const char *data = "ab12 7\nzz1\nab34 8\nq9q\nab56 9\nzz2\n";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write two-pass input");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_two_pass_plain.pgm"
+             " && ./restoration --two-pass %s > tmp_two_pass.pgm"
+             " && cmp -s tmp_two_pass_plain.pgm tmp_two_pass.pgm",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "--two-pass FILE restores like the plain run");
+
+    /* A file on stdin can be re-read; a pipe cannot and takes one pass */
+    snprintf(cmd, sizeof(cmd),
+             "./restoration --two-pass < %s > tmp_two_pass.pgm"
+             " && cmp -s tmp_two_pass_plain.pgm tmp_two_pass.pgm"
+             " && cat %s | ./restoration --two-pass > tmp_two_pass.pgm"
+             " && cmp -s tmp_two_pass_plain.pgm tmp_two_pass.pgm",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "--two-pass on stdin restores like the plain run");
+
+    remove("tmp_two_pass_plain.pgm");
+    remove("tmp_two_pass.pgm");
+    remove(in);
+}
+
+static void test_lazy(void)
+{
+    /* --lazy spills piped input to a file and decodes only the winner */
+    const char *in = "tmp_lazy_input.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "open lazy input");
+    if (!fp) return;
+    for (int r = 0; r < 5000; r++) {
+        fprintf(fp, "L");
+        for (int c = 0; c < 40; c++)
+            fprintf(fp, "%d.", (r + 2 * c) % 256);
+        fprintf(fp, "\n");
+        if (r % 5 == 0)
+            fprintf(fp, "decoy%d 8 9\n", r);
+    }
+    fclose(fp);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_lazy_plain.pgm"
+             " && cat %s | ./restoration --lazy > tmp_lazy.pgm"
+             " && cmp -s tmp_lazy_plain.pgm tmp_lazy.pgm"
+             " && cat %s | ./restoration --lazy -j 2 > tmp_lazy.pgm"
+             " && cmp -s tmp_lazy_plain.pgm tmp_lazy.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "--lazy and --lazy -j 2 restore like the plain run");
+
+    /* A bad row is reported where it lies in the input, as without --lazy */
+    const char *bad = "tmp_lazy_bad.txt";
+    const char *data = "a1b2c\n"
+                       "x300y\n"
+                       "\n"
+                       "a3b4c\n"
+                       "a1b2c3\n";
+    CHECKI(write_text_file(bad, data, strlen(data)) == 0, "write lazy width mismatch");
+    snprintf(cmd, sizeof(cmd),
+             "cat %s | ./restoration --lazy > /dev/null 2> tmp_lazy.err;"
+             " test $? -eq 7"
+             " && grep -q 'inconsistent row widths (line 5, byte 19)' tmp_lazy.err",
+             bad);
+    CHECKI(run_cmd(cmd) == 0, "--lazy width mismatch reports line 5, byte 19, status 7");
+
+    remove("tmp_lazy_plain.pgm");
+    remove("tmp_lazy.pgm");
+    remove("tmp_lazy.err");
+    remove(bad);
+    remove(in);
+}
+
+static void test_read_ahead(void)
+{
+    /* Over 1 MB, so that lines straddle the read-ahead buffers */
+    const char *in = "tmp_ra_input.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "open read-ahead input");
+    if (!fp) return;
+    for (int r = 0; r < 30000; r++) {
+        fprintf(fp, "a");
+        for (int c = 0; c < 32; c++)
+            fprintf(fp, "%d,", (r + c) % 256);
+        fprintf(fp, "\n");
+        if (r % 7 == 0)
+            fprintf(fp, "decoy%d 1 2\n", r);
+    }
+    fclose(fp);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_ra_plain.pgm"
+             " && ./restoration --read-ahead %s > tmp_ra_uring.pgm"
+             " && ./restoration --read-ahead=thread %s > tmp_ra_thread.pgm"
+             " && cmp -s tmp_ra_plain.pgm tmp_ra_uring.pgm"
+             " && cmp -s tmp_ra_plain.pgm tmp_ra_thread.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "read-ahead restores like the mapped file");
+
+    snprintf(cmd, sizeof(cmd),
+             "mkdir -p tmp_ra_in tmp_ra_out && cp %s tmp_ra_in/"
+             " && ./restoration -j 2 --read-ahead --batch tmp_ra_in tmp_ra_out"
+             " && cmp -s tmp_ra_plain.pgm tmp_ra_out/%s.out",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "batch read-ahead restores like the mapped file");
+
+    snprintf(cmd, sizeof(cmd),
+             "./restoration --read-ahead --two-pass %s > /dev/null 2>&1", in);
+    CHECKI(run_cmd(cmd) != 0, "read-ahead with --two-pass should be refused");
+
+    run_cmd("rm -rf tmp_ra_in tmp_ra_out");
+    remove("tmp_ra_plain.pgm");
+    remove("tmp_ra_uring.pgm");
+    remove("tmp_ra_thread.pgm");
+    remove(in);
+}
+
+static void test_mapped_output(void)
+{
+    /* Over 1 MB of raster, so the image is decoded into a mapped output file */
+    const char *in = "tmp_mapout_input.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "open mapped-output input");
+    if (!fp) return;
+    for (int r = 0; r < 1100; r++) {
+        fprintf(fp, "m");
+        for (int c = 0; c < 1024; c++)
+            fprintf(fp, "%d;", (r * 3 + c) % 256);
+        fprintf(fp, "\n");
+        if (r % 9 == 0)
+            fprintf(fp, "decoy%d 4 5\n", r);
+    }
+    fclose(fp);
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "./restoration %s | cat > tmp_mapout_plain.pgm", in);
+    CHECKI(run_cmd(cmd) == 0, "restore mapped-output input through a pipe");
+
+    /* After a prefix, so the image starts at a nonzero offset; the output is
+       write-only, as for any "> file", and is mapped through a second
+       descriptor */
+    snprintf(cmd, sizeof(cmd),
+             "{ printf 'prefix' && ./restoration %s; } > tmp_mapout.pgm"
+             " && printf 'prefix' | cat - tmp_mapout_plain.pgm | cmp -s - tmp_mapout.pgm",
+             in);
+    CHECKI(run_cmd(cmd) == 0, "mapped output after a prefix");
+
+    /* Appended with >>, which O_APPEND keeps off the mapped path */
+    snprintf(cmd, sizeof(cmd),
+             "printf 'prefix' > tmp_mapout.pgm"
+             " && ./restoration %s >> tmp_mapout.pgm"
+             " && printf 'prefix' | cat - tmp_mapout_plain.pgm | cmp -s - tmp_mapout.pgm",
+             in);
+    CHECKI(run_cmd(cmd) == 0, "output appended with >> after a prefix");
+
+    /* Read-write over a longer file, which keeps the bytes past the image */
+    snprintf(cmd, sizeof(cmd),
+             "n=$(wc -c < tmp_mapout_plain.pgm)"
+             " && head -c $((n + 5000)) /dev/zero | tr '\\0' z > tmp_mapout_long"
+             " && cp tmp_mapout_long tmp_mapout.pgm"
+             " && ./restoration %s 1<> tmp_mapout.pgm"
+             " && { cat tmp_mapout_plain.pgm; tail -c +$((n + 1)) tmp_mapout_long; }"
+             " | cmp -s - tmp_mapout.pgm",
+             in);
+    CHECKI(run_cmd(cmd) == 0, "mapped output over a longer file");
+
+    /* Twice into one file: the second image follows the first */
+    snprintf(cmd, sizeof(cmd),
+             "{ ./restoration %s && ./restoration %s; } > tmp_mapout.pgm"
+             " && cat tmp_mapout_plain.pgm tmp_mapout_plain.pgm | cmp -s - tmp_mapout.pgm",
+             in, in);
+    CHECKI(run_cmd(cmd) == 0, "two mapped images in one file");
+
+    remove("tmp_mapout_plain.pgm");
+    remove("tmp_mapout_long");
+    remove("tmp_mapout.pgm");
+    remove(in);
+}
+
+static void test_prune(void)
+{
+    /* The image's first row is pruned, so the scan must be done again */
+    const char *in = "tmp_prune_input.txt";
+    const char *data = "a1b2c\nx7y9\ndA0\ndB1\ndC2\ndD3\n"
+                       "x0y1\nx1y2\nx2y3\nx3y4\n";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write prune input");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_prune_plain.pgm"
+             " && ./restoration --prune=2 --stats=json:tmp_prune.json %s"
+             " > tmp_prune_pruned.pgm"
+             " && cmp -s tmp_prune_plain.pgm tmp_prune_pruned.pgm"
+             " && grep -q '\"prune_rescans\": 1,' tmp_prune.json"
+             " && ./restoration --prune=2 --two-pass %s > tmp_prune_pruned.pgm"
+             " && cmp -s tmp_prune_plain.pgm tmp_prune_pruned.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "pruned scan restores like the full scan");
+
+    remove("tmp_prune_plain.pgm");
+    remove("tmp_prune_pruned.pgm");
+    remove("tmp_prune.json");
+    remove(in);
+}
+
+static void test_speculate(void)
+{
+    /* Enough image rows to speculate on, then one of another width */
+    const char *in = "tmp_spec_input.txt";
+    const char *bad = "tmp_spec_bad.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "write speculate input");
+    if (fp == NULL) return;
+    for (int i = 0; i < 6000; i++) {
+        if (i % 3 == 2) fprintf(fp, "#%d#\n", i % 256);
+        else fprintf(fp, "a%db%dc\n", i % 256, (i * 7) % 256);
+    }
+    fclose(fp);
+
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration --speculate=0 %s > tmp_spec_plain.pgm"
+             " && ./restoration --stats=json:tmp_spec.json %s > tmp_spec.pgm"
+             " && cmp -s tmp_spec_plain.pgm tmp_spec.pgm"
+             " && ! grep -q '\"rows_speculated\": 0,' tmp_spec.json"
+             " && ./restoration --speculate=100 %s > tmp_spec.pgm"
+             " && cmp -s tmp_spec_plain.pgm tmp_spec.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "speculation restores like the table");
+
+    snprintf(cmd, sizeof(cmd),
+             "{ cat %s; printf 'a12b3c4\\n'; } > %s"
+             " && ./restoration --speculate=0 %s > /dev/null 2> tmp_spec_plain.err;"
+             " test $? -eq 7"
+             " && ./restoration %s > /dev/null 2> tmp_spec.err;"
+             " test $? -eq 7 && cmp -s tmp_spec_plain.err tmp_spec.err",
+             in, bad, bad, bad);
+    CHECKI(run_cmd(cmd) == 0, "speculation finds the width mismatch");
+
+    CHECKI(run_cmd("./restoration --speculate=101 tmp_spec_input.txt"
+                   " > /dev/null 2>&1; test $? -ne 0") == 0,
+           "--speculate over 100 is refused");
+
+    remove("tmp_spec_plain.pgm");
+    remove("tmp_spec.pgm");
+    remove("tmp_spec.json");
+    remove("tmp_spec_plain.err");
+    remove("tmp_spec.err");
+    remove(bad);
+    remove(in);
+}
+
+static void test_pipeline(void)
+{
+    /* Piped input over several 1 MB blocks, with lines cut between them */
+    const char *in = "tmp_pipe_input.txt";
+    const char *bad = "tmp_pipe_bad.txt";
+    FILE *fp = fopen(in, "wb");
+    CHECKI(fp != NULL, "write pipeline input");
+    if (fp == NULL) return;
+    for (int i = 0; i < 60000; i++) {
+        if (i % 4 == 1) fprintf(fp, "#%d#%d\n", i % 97, i % 256);
+        else fprintf(fp, "a%db%dc%dd%de%df\n", i % 256, (i * 7) % 256,
+                     (i * 3) % 256, (i * 5) % 256, (i * 11) % 256);
+    }
+    fclose(fp);
+
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd),
+             "cat %s | ./restoration > tmp_pipe_plain.pgm"
+             " && cat %s | ./restoration -j 3 > tmp_pipe.pgm"
+             " && cmp -s tmp_pipe_plain.pgm tmp_pipe.pgm"
+             " && gzip -c %s | ./restoration -j 2 > tmp_pipe.pgm"
+             " && cmp -s tmp_pipe_plain.pgm tmp_pipe.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "-j on piped input restores like one thread");
+
+    snprintf(cmd, sizeof(cmd),
+             "{ cat %s; printf 'a1b2c3d4e5f6\\n'; cat %s; } > %s"
+             " && cat %s | ./restoration > /dev/null 2> tmp_pipe_plain.err;"
+             " test $? -eq 7"
+             " && cat %s | ./restoration -j 4 > /dev/null 2> tmp_pipe.err;"
+             " test $? -eq 7 && cmp -s tmp_pipe_plain.err tmp_pipe.err",
+             in, in, bad, bad, bad);
+    CHECKI(run_cmd(cmd) == 0, "-j on piped input stops on the same line");
+
+    remove("tmp_pipe_plain.pgm");
+    remove("tmp_pipe.pgm");
+    remove("tmp_pipe_plain.err");
+    remove("tmp_pipe.err");
+    remove(bad);
+    remove(in);
+}
+
+static void test_library(void)
+{
+    /* librestoration, whole and pushed a few bytes at a time, agrees */
+    const char *in = "tmp_library_input.txt";
+    const char *data = "ab12 7\nzz1\nab34 8\nab56 9";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write library input");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "./restoration %s > tmp_library_cli.pgm"
+             " && ./restore_test %s > tmp_library_buffer.pgm"
+             " && ./restore_test -c 3 %s > tmp_library_push.pgm"
+             " && cmp -s tmp_library_cli.pgm tmp_library_buffer.pgm"
+             " && cmp -s tmp_library_cli.pgm tmp_library_push.pgm",
+             in, in, in);
+    CHECKI(run_cmd(cmd) == 0, "library restores like the program");
+
+    snprintf(cmd, sizeof(cmd), "printf -- '---\\n' > %s"
+             " && ./restore_test -c 2 %s > /dev/null 2>&1", in, in);
+    CHECKI(run_cmd(cmd) != 0, "library reports no usable rows");
+
+    remove("tmp_library_cli.pgm");
+    remove("tmp_library_buffer.pgm");
+    remove("tmp_library_push.pgm");
+    remove(in);
+}
+
+static void test_serve(void)
+{
+    /* Input and path requests to --serve agree with the program run alone */
+    const char *sock = "tmp_serve.sock";
+    const char *in = "tmp_serve_input.txt";
+    const char *data = "ab12 7\nzz1\nab34 8\nab56 9\n";
+    CHECKI(write_text_file(in, data, strlen(data)) == 0, "write serve input");
+    CHECKI(run_cmd("./restoration tmp_serve_input.txt > tmp_serve_cli.pgm") == 0,
+           "restore serve input alone");
+    size_t want_len = 0;
+    char *want = read_file("tmp_serve_cli.pgm", &want_len);
+
+    CHECKI(run_cmd("./restoration -j 2 --serve tmp_serve.sock &") == 0,
+           "start server");
+    char *reply = NULL;
+    size_t n = 0;
+    int status = -1;
+    for (int tries = 0; tries < 500 && status != 0; tries++) {
+        struct timespec pause = {0, 10000000};
+        nanosleep(&pause, NULL);
+        status = serve_request(sock, 'S', NULL, 0, &reply, &n);
+        free(reply);
+        reply = NULL;
+    }
+    CHECKI(status == 0, "server answers a stats request");
+    if (status != 0 || want == NULL) {
+        free(want);
+        remove(in);
+        return;
+    }
+
+    status = serve_request(sock, 'I', data, strlen(data), &reply, &n);
+    CHECKI(status == 0 && n == want_len && memcmp(reply, want, n) == 0,
+           "input request restores like the program");
+    free(reply);
+
+    status = serve_request(sock, 'P', in, strlen(in), &reply, &n);
+    CHECKI(status == 0 && n == want_len && memcmp(reply, want, n) == 0,
+           "path request restores like the program");
+    free(reply);
+
+    /* A request past what a worker keeps; the next one is served as before */
+    const char *row = "ab12 7\n";
+    size_t rows = (20u << 20) / strlen(row);
+    char *big = malloc(rows * strlen(row));
+    CHECKI(big != NULL, "allocate oversized serve input");
+    if (big != NULL) {
+        for (size_t i = 0; i < rows; i++)
+            memcpy(big + i * strlen(row), row, strlen(row));
+        char head[64];
+        int hlen = snprintf(head, sizeof(head), "P5\n2 %zu\n255\n", rows);
+        status = serve_request(sock, 'I', big, rows * strlen(row), &reply, &n);
+        CHECKI(status == 0 && n == (size_t)hlen + 2 * rows &&
+               memcmp(reply, head, (size_t)hlen) == 0,
+               "oversized input request is restored");
+        free(reply);
+        free(big);
+    }
+    status = serve_request(sock, 'I', data, strlen(data), &reply, &n);
+    CHECKI(status == 0 && n == want_len && memcmp(reply, want, n) == 0,
+           "input request after an oversized one");
+    free(reply);
+
+    status = serve_request(sock, 'I', "---\n", 4, &reply, &n);
+    CHECKI(status == 1 && n > 0, "input with no usable rows is an error reply");
+    free(reply);
+
+    status = serve_request(sock, 'P', "tmp_no_such_file", 16, &reply, &n);
+    CHECKI(status == 1, "missing path is an error reply");
+    free(reply);
+
+    status = serve_request(sock, 'S', NULL, 0, &reply, &n);
+    CHECKI(status == 0 && reply != NULL &&
+           strstr(reply, "\"requests\": 6, \"errors\": 2") != NULL &&
+           strstr(reply, "\"p99\"") != NULL,
+           "stats count requests and report latencies");
+    free(reply);
+
+    status = serve_request(sock, 'Q', NULL, 0, &reply, &n);
+    CHECKI(status == 0, "server acknowledges quit");
+    free(reply);
+    int gone = 0;
+    for (int tries = 0; tries < 500 && !gone; tries++) {
+        struct timespec pause = {0, 10000000};
+        nanosleep(&pause, NULL);
+        gone = access(sock, F_OK) != 0;
+    }
+    CHECKI(gone, "server removes its socket on quit");
+
+    free(want);
+    remove("tmp_serve_cli.pgm");
+    remove(in);
+}
+
 
 /* helpers */
 
@@ -313,6 +1040,67 @@ static int write_text_file(const char *path, const char *data, size_t nbytes)
     return ok;
 }
 
+/* A stand-in --serve client: one request on a new connection, one reply.
+ * Returns the reply's status byte (the payload, NUL-terminated, is in
+ * *reply), or -1 if the server cannot be reached. */
+static int serve_request(const char *sock, int kind, const char *payload, size_t len,
+                         char **reply, size_t *reply_len)
+{
+    *reply = NULL;
+    *reply_len = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char head[9];
+    head[0] = (unsigned char)kind;
+    for (int i = 0; i < 8; i++)
+        head[8 - i] = (unsigned char)((unsigned long long)len >> (8 * i));
+    int status = -1;
+    if (write(fd, head, 9) == 9 &&
+        (len == 0 || write(fd, payload, len) == (ssize_t)len) &&
+        read(fd, head, 9) == 9) {
+        size_t n = 0;
+        for (int i = 1; i < 9; i++)
+            n = (n << 8) | head[i];
+        char *buf = malloc(n + 1);
+        size_t got = 0;
+        ssize_t r = 1;
+        while (buf && got < n && (r = read(fd, buf + got, n - got)) > 0)
+            got += (size_t)r;
+        if (buf && got == n) {
+            buf[n] = '\0';
+            *reply = buf;
+            *reply_len = n;
+            status = head[0];
+        } else {
+            free(buf);
+        }
+    }
+    close(fd);
+    return status;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc(size > 0 ? (size_t)size : 1);
+    *len = buf ? fread(buf, 1, (size_t)size, fp) : 0;
+    fclose(fp);
+    return buf;
+}
+
 /*  main  */
 
 int main(void)
@@ -320,16 +1108,33 @@ int main(void)
     printf("== readaline unit tests ==\n");
     test_readaline_basic();
     test_readaline_crlf();
+    test_readaline_into();
+    test_readaline_close_early();
 
     printf("== restoration integration: corrupted inputs ==\n");
     test_batch_corrupt_inputs();
+    test_batch_mode_corrupt_inputs();
+    test_batch_bad_file();
 
     printf("== restoration edge cases ==\n");
     test_stdin_mode();
     test_no_usable_rows();
     test_pixel_over_255();
     test_width_mismatch();
+    test_diagnostics();
     test_crlf_input();
+    test_gzip_input();
+    test_spill_dir();
+    test_spill_bound();
+    test_two_pass();
+    test_lazy();
+    test_read_ahead();
+    test_mapped_output();
+    test_prune();
+    test_speculate();
+    test_pipeline();
+    test_library();
+    test_serve();
 
     if (failures == 0) {
         printf("ALL TESTS PASSED\n");
@@ -0,0 +1,582 @@
+/* input.c */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "input.h"
+#include "mem.h"
+#include "readaline.h"
+#include "pipeline.h"
+
+const Except_T OpenFail = {"restoration: could not open file"};
+const Except_T ReadFail = {"restoration: read error"};
+const Except_T DecompFail = {"restoration: could not decompress input"};
+
+/*
+ * What the reader of a -j pipeline reads: the stream, or the decompressor's
+ * buffers, copied out a block at a time
+ */
+typedef struct Feed
+{
+        Source src;
+        char *buf;       /* the decompressor's current buffer */
+        size_t len;
+        size_t used;     /* of its bytes, how many were handed on */
+} *Feed;
+
+static void map_input(FILE *in, Source src);
+
+static const Except_T *obtain_sequence(Source src, Scan scan);
+
+static const Except_T *obtain_ring_sequence(Source src, Scan scan);
+
+static size_t feed_pipe(void *cl, char *buf, size_t cap);
+
+static char *next_block(Source src, size_t *len);
+
+/********** open_input ********
+ *
+ * Opens the input for scanning: maps it (see map_input) or, with
+ * --read-ahead, starts reading it ahead if it is a non-empty regular file
+ * that is not gzip or zstd. A compressed file is mapped as before, for the
+ * decompressor to read.
+ *
+ * Parameters:
+ *      FILE *in:            the opened input stream
+ *      Source src:          the Source to fill in
+ *      int read_ahead:      nonzero for --read-ahead
+ *      ReadAhead_Kind kind: the read-ahead backend wanted
+ *
+ * Return:
+ *      none
+ *
+ * Notes:
+ *      the stream stays open under the reader, which reads its descriptor
+ *      from offset 0
+ ************************/
+void open_input(FILE *in, Source src, int read_ahead,
+                       ReadAhead_Kind kind)
+{
+        struct stat st;
+        int fd = fileno(in);
+        unsigned char magic[DECOMP_MAGIC];
+        if (!read_ahead || fd < 0 || fstat(fd, &st) != 0 ||
+            !S_ISREG(st.st_mode) || st.st_size <= 0)
+        {
+                map_input(in, src);
+                return;
+        }
+
+        /* The first bytes are peeked at without moving the file offset */
+        ssize_t n = pread(fd, magic, sizeof(magic), 0);
+        if (n < 0 || Decomp_detect(magic, (size_t)n) != DECOMP_NONE)
+        {
+                map_input(in, src);
+                return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        src->ra = ReadAhead_start(fd, kind);
+}
+
+/********** map_input ********
+ *
+ * Memory-maps the input when it is a non-empty regular file so that lines can
+ * be scanned in place instead of being read and copied one at a time.
+ *
+ * Parameters:
+ *      FILE *in:   the opened input stream
+ *      Source src: the Source to fill in
+ *
+ * Return:
+ *      none
+ *
+ * Notes:
+ *      leaves src streaming from 'in' if the file cannot be mapped (pipes,
+ *      terminals, empty files, or mmap failure)
+ ************************/
+static void map_input(FILE *in, Source src)
+{
+        struct stat st;
+        int fd = fileno(in);
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size <= 0)
+        {
+                return;
+        }
+
+        size_t len = (size_t)st.st_size;
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+                return;
+        }
+
+        /* Lines are consumed front to back exactly once */
+        madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        /* Only a hint: ignored where the filesystem cannot back it */
+        if (len >= (2u << 20))
+        {
+                madvise(map, len, MADV_HUGEPAGE);
+        }
+#endif
+
+        src->map = map;
+        src->len = len;
+        src->pos = 0;
+        if (in != stdin)
+        {
+                fclose(in);
+        }
+        src->fp = NULL;
+}
+
+/********** spill_input ********
+ *
+ * Copies an unmappable input (a pipe, or a compressed input's decompressed
+ * bytes) into an unlinked temporary file and maps that instead, so that rows
+ * can be kept as references and decoded only once the winner is known.
+ *
+ * Parameters:
+ *      Source src:      a streamed Source; on return it is mapped, or
+ *                       streams from the (empty) spill file
+ *      const char *dir: where the file goes (--spill-dir), or NULL for
+ *                       $TMPDIR (default /tmp)
+ *
+ * Return:
+ *      NULL, or &ReadFail, &DecompFail or &SpillFail if the input cannot be
+ *      read or decompressed or the spill file cannot be written
+ *
+ * Notes:
+ *      leaves src alone if no temporary file can be created
+ ************************/
+const Except_T *spill_input(Source src, const char *dir)
+{
+        int fd = make_temp(dir);
+        if (fd < 0)
+        {
+                return NULL;
+        }
+
+        FILE *spill = fdopen(fd, "w+b");
+        if (spill == NULL)
+        {
+                close(fd);
+                return NULL;
+        }
+
+        const Except_T *err = NULL;
+        if (src->dz != NULL)
+        {
+                /* The decompressor's buffers are written out as they come */
+                char *buf;
+                size_t got;
+                while (err == NULL &&
+                       (buf = Decomp_next(src->dz, &got)) != NULL)
+                {
+                        if (fwrite(buf, 1, got, spill) != got)
+                        {
+                                err = &SpillFail;
+                        }
+                }
+                if (err == NULL && Decomp_error(src->dz) != NULL)
+                {
+                        err = &DecompFail;
+                }
+        }
+        else
+        {
+                size_t cap = 1 << 20;
+                char *buf = ALLOC((long)cap);
+                size_t got;
+                while (err == NULL &&
+                       (got = fread(buf, 1, cap, src->fp)) > 0)
+                {
+                        if (fwrite(buf, 1, got, spill) != got)
+                        {
+                                err = &SpillFail;
+                        }
+                }
+                FREE(buf);
+                if (err == NULL && ferror(src->fp))
+                {
+                        err = &ReadFail;
+                }
+        }
+        if (err == NULL && fflush(spill) != 0)
+        {
+                err = &SpillFail;
+        }
+        if (err != NULL)
+        {
+                fclose(spill);
+                return err;
+        }
+        rewind(spill);
+
+        close_input(src);
+        src->fp = spill;
+        map_input(spill, src);
+        return NULL;
+}
+
+/********** open_compressed ********
+ *
+ * Starts decompressing the input if it is gzip or zstd, recognised by its
+ * first bytes. A mapped file stays mapped for the decompressor to read; for
+ * a stream the bytes are peeked at, and if they turn out not to be a known
+ * format the stream is passed through the decompressor unchanged so that
+ * they are not lost (only when the first byte could have started one).
+ *
+ * Parameters:
+ *      Source src: a Source fresh from open_input
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void open_compressed(Source src)
+{
+        if (src->ra != NULL)
+        {
+                /* open_input only reads ahead a file found uncompressed */
+                return;
+        }
+        if (src->map != NULL)
+        {
+                Decomp_Kind kind = Decomp_detect(src->map, src->len);
+                if (kind != DECOMP_NONE)
+                {
+                        src->zmap = src->map;
+                        src->zlen = src->len;
+                        src->map = NULL;
+                        src->len = 0;
+                        src->dz = Decomp_start(kind, src->zmap, src->zlen,
+                                               NULL, NULL, 0);
+                }
+                return;
+        }
+
+        int c = getc(src->fp);
+        if (c != 0x1f && c != 0x28)
+        {
+                if (c != EOF)
+                {
+                        ungetc(c, src->fp);
+                }
+                return;
+        }
+        unsigned char magic[DECOMP_MAGIC];
+        magic[0] = (unsigned char)c;
+        size_t n = 1 + fread(magic + 1, 1, sizeof(magic) - 1, src->fp);
+        src->dz = Decomp_start(Decomp_detect(magic, n), NULL, 0, src->fp,
+                               magic, n);
+}
+
+/********** close_input ********
+ *
+ * Releases the input, unmapping it or closing its stream as appropriate.
+ *
+ * Parameters:
+ *      Source src: the input to close
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+void close_input(Source src)
+{
+        if (src->dz != NULL)
+        {
+                /* Stops the decompressor before its input goes away */
+                Decomp_free(&src->dz);
+        }
+        if (src->ra != NULL)
+        {
+                /* Likewise the reads in flight, before the file is closed */
+                ReadAhead_free(&src->ra);
+        }
+        if (src->zmap != NULL)
+        {
+                munmap((void *)src->zmap, src->zlen);
+                src->zmap = NULL;
+        }
+        if (src->map != NULL)
+        {
+                munmap((void *)src->map, src->len);
+                src->map = NULL;
+        }
+        else if (src->fp != NULL)
+        {
+                if (src->fp != stdin)
+                {
+                        fclose(src->fp);
+                }
+        }
+        src->fp = NULL;
+}
+
+/********** scan_input ********
+ *
+ * Scans the whole of an input, in place if it is mapped, in the
+ * decompressor's or read-ahead buffers if it is compressed or read ahead,
+ * and a line at a time otherwise.
+ *
+ * Parameters:
+ *      Source src: the input
+ *      Scan scan:  the (empty) scan state
+ *
+ * Return:
+ *      NULL, or the exception that stopped the scan
+ *
+ ************************/
+const Except_T *scan_input(Source src, Scan scan)
+{
+        if (src->map != NULL)
+        {
+                return obtain_mapped_sequence(scan, src->map, src->pos,
+                                              src->len);
+        }
+        if (src->dz != NULL || src->ra != NULL)
+        {
+                return obtain_ring_sequence(src, scan);
+        }
+        return obtain_sequence(src, scan);
+}
+
+/********** obtain_sequence ********
+ *
+ * Parses non-digit sequence and store restored digit bytes into Table from
+ *   each line.
+ *
+ * Parameters:
+ *      Source src: the streamed input to be read
+ *      Scan scan:  the scan state receiving every usable line
+ *
+ * Return:
+ *      NULL, &WidthBad if a row's width does not match its Bucket's,
+ *      &SpillFail, or &ReadFail on a read error; the line is recorded in
+ *      scan->fault (nothing is RAISEd)
+ *
+ ************************/
+static const Except_T *obtain_sequence(Source src, Scan scan)
+{
+        /* One line buffer for the whole input, grown as lines need */
+        LineReader lines = LineReader_new(src->fp);
+        char *line = NULL;
+        size_t cap = 0;
+        size_t pos = 0;
+        const Except_T *err = NULL;
+        while (err == NULL)
+        {
+                size_t old_cap = cap;
+                size_t n = LineReader_next(lines, &line, &cap);
+                if (n == READALINE_ERROR)
+                {
+                        err = note_fault(scan, &ReadFail,
+                                         scan->stats.lines + 1, pos);
+                        break;
+                }
+                if (n == 0)
+                        break;
+                pos += n;
+                if (cap != old_cap)
+                {
+                        scan->stats.allocs++;
+                        scan->stats.alloc_bytes += cap + 1;
+                }
+
+                err = scan_stream_line(scan, line, n, line, pos - n);
+        }
+        FREE(line);
+        LineReader_free(&lines);
+        return err;
+}
+
+/********** obtain_ring_sequence ********
+ *
+ * Same as obtain_sequence, for a compressed or read-ahead input: lines are
+ * scanned in place in the decompressor's or reader's buffers, as they are
+ * handed over. Only a line split between two buffers is copied, to be put
+ * back together.
+ *
+ * Parameters:
+ *      Source src: the input, with a decompressor or a reader
+ *      Scan scan:  the scan state receiving every usable line
+ *
+ * Return:
+ *      NULL, &WidthBad if a row's width does not match its Bucket's,
+ *      &SpillFail, &DecompFail if the input is not valid gzip/zstd, or
+ *      &ReadFail if the reader hit a read error
+ *
+ ************************/
+static const Except_T *obtain_ring_sequence(Source src, Scan scan)
+{
+        char *carry = NULL;
+        size_t carry_len = 0;
+        size_t carry_cap = 0;
+        size_t pos = 0;
+        const Except_T *err = NULL;
+        char *buf;
+        size_t len;
+        while (err == NULL && (buf = next_block(src, &len)) != NULL)
+        {
+                size_t i = 0;
+                while (err == NULL && i < len)
+                {
+                        char *nl = memchr(buf + i, '\n', len - i);
+                        size_t n = nl != NULL ? (size_t)(nl - buf) + 1 - i
+                                              : len - i;
+                        if (carry_len == 0 && nl != NULL)
+                        {
+                                err = scan_stream_line(scan, buf + i, n,
+                                                       buf + i, pos);
+                                pos += n;
+                                i += n;
+                                continue;
+                        }
+
+                        /* The line continues into the next buffer */
+                        if (carry_len + n > carry_cap)
+                        {
+                                size_t cap = carry_cap == 0 ? 4096 : carry_cap;
+                                while (cap < carry_len + n)
+                                {
+                                        cap *= 2;
+                                }
+                                if (carry == NULL)
+                                {
+                                        carry = ALLOC((long)cap);
+                                }
+                                else
+                                {
+                                        RESIZE(carry, (long)cap);
+                                }
+                                carry_cap = cap;
+                                scan->stats.allocs++;
+                                scan->stats.alloc_bytes += cap;
+                        }
+                        memcpy(carry + carry_len, buf + i, n);
+                        carry_len += n;
+                        i += n;
+                        if (nl != NULL)
+                        {
+                                err = scan_stream_line(scan, carry, carry_len,
+                                                       carry, pos);
+                                pos += carry_len;
+                                carry_len = 0;
+                        }
+                }
+        }
+        if (err == NULL && carry_len > 0)
+        {
+                err = scan_stream_line(scan, carry, carry_len, carry,
+                                       pos);
+        }
+        FREE(carry);
+        if (err == NULL && src->dz != NULL && Decomp_error(src->dz) != NULL)
+        {
+                err = note_fault(scan, &DecompFail, scan->stats.lines + 1,
+                                 pos);
+        }
+        else if (err == NULL && src->ra != NULL &&
+                 ReadAhead_error(src->ra) != 0)
+        {
+                err = note_fault(scan, &ReadFail, scan->stats.lines + 1, pos);
+        }
+        return err;
+}
+
+/********** scan_input_piped ********
+ *
+ * Same as obtain_sequence, for -j N on an input that is not mapped: the
+ * stream (or the decompressor's output) is read, scanned and stored by a
+ * pipeline of threads (see pipeline.h), with the rows stored in input
+ * order as obtain_sequence would.
+ *
+ * Parameters:
+ *      Source src:  the streamed input, or one with a decompressor
+ *      Scan scan:   the scan state receiving every usable line
+ *      size_t jobs: number of scanner threads
+ *
+ * Return:
+ *      NULL, &WidthBad if a row's width does not match its Bucket's,
+ *      &SpillFail, &DecompFail if the input is not valid gzip/zstd, or
+ *      &ReadFail on a read error
+ *
+ ************************/
+const Except_T *scan_input_piped(Source src, Scan scan, size_t jobs)
+{
+        struct Feed feed = {src, NULL, 0, 0};
+        size_t end = 0;
+        const Except_T *err = scan_pipelined(scan, feed_pipe, &feed, jobs,
+                                             &end);
+        if (err == NULL && src->dz != NULL && Decomp_error(src->dz) != NULL)
+        {
+                err = note_fault(scan, &DecompFail, scan->stats.lines + 1,
+                                 end);
+        }
+        else if (err == NULL && src->dz == NULL && ferror(src->fp))
+        {
+                err = note_fault(scan, &ReadFail, scan->stats.lines + 1, end);
+        }
+        return err;
+}
+
+/********** feed_pipe ********
+ *
+ * The pipeline's Pipe_Fill: reads from the stream, or copies out of the
+ * decompressor's buffers, taking the next when one is used up.
+ *
+ ************************/
+static size_t feed_pipe(void *cl, char *buf, size_t cap)
+{
+        Feed feed = cl;
+        if (feed->src->dz == NULL)
+        {
+                return fread(buf, 1, cap, feed->src->fp);
+        }
+        if (feed->used == feed->len)
+        {
+                feed->buf = Decomp_next(feed->src->dz, &feed->len);
+                feed->used = 0;
+                if (feed->buf == NULL)
+                {
+                        feed->len = 0;
+                        return 0;
+                }
+        }
+        size_t n = feed->len - feed->used < cap ? feed->len - feed->used
+                                                : cap;
+        memcpy(buf, feed->buf + feed->used, n);
+        feed->used += n;
+        return n;
+}
+
+/********** next_block ********
+ *
+ * Takes the next buffer of a compressed or read-ahead input, handing the
+ * previous one back.
+ *
+ * Parameters:
+ *      Source src:  the input, with a decompressor or a reader
+ *      size_t *len: set to the number of bytes in the buffer
+ *
+ * Return:
+ *      the buffer, or NULL at the end of the input or on an error
+ *
+ ************************/
+static char *next_block(Source src, size_t *len)
+{
+        if (src->ra != NULL)
+        {
+                return ReadAhead_next(src->ra, len);
+        }
+        return Decomp_next(src->dz, len);
+}
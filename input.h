@@ -0,0 +1,69 @@
+/* input.h
+ *
+ * The inputs restoration reads, and how each is handed to the engine:
+ *
+ *      mapped      a non-empty regular file; lines are scanned in place
+ *      compressed  gzip or zstd, mapped or streamed; lines are scanned in
+ *                  the decompressor's buffers
+ *      read ahead  with --read-ahead, an uncompressed regular file read
+ *                  through a ReadAhead_T; lines are scanned in its buffers
+ *      streamed    anything else (pipes, stdin); lines are read one at a
+ *                  time with a LineReader
+ *
+ * Used by the command line, --batch and --serve alike. Nothing here RAISEs
+ * except on allocation failure.
+ */
+#ifndef INPUT_INCLUDED
+#define INPUT_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "except.h"
+#include "decomp.h"
+#include "readahead.h"
+#include "engine.h"
+
+/* A file that could not be opened */
+extern const Except_T OpenFail;
+
+/* A read error on the input */
+extern const Except_T ReadFail;
+
+/* A gzip or zstd input that is not valid */
+extern const Except_T DecompFail;
+
+/*
+ * The input being restored. A regular file is memory-mapped and its lines are
+ * scanned in place; anything else (pipes, stdin) is read with a LineReader. A
+ * gzip or zstd input, mapped or not, is decompressed by 'dz' and its lines
+ * are scanned in the decompressor's buffers. With --read-ahead, a regular
+ * file that is not compressed is read by 'ra' instead of being mapped, and
+ * its lines are scanned in the read-ahead buffers.
+ */
+typedef struct Source
+{
+        FILE *fp;        /* stream input, NULL once the file is mapped */
+        const char *map; /* start of the mapped file, or NULL */
+        size_t len;      /* length of the mapped file */
+        size_t pos;      /* offset of the next unread byte in the map */
+        Decomp_T dz;     /* decompressor of a compressed input, or NULL */
+        const char *zmap; /* the compressed file's map, while dz reads it */
+        size_t zlen;     /* its length */
+        ReadAhead_T ra;  /* reader of a --read-ahead input, or NULL */
+} *Source;
+
+extern void open_input(FILE *in, Source src, int read_ahead,
+                       ReadAhead_Kind kind);
+
+extern void open_compressed(Source src);
+
+extern const Except_T *spill_input(Source src, const char *dir);
+
+extern void close_input(Source src);
+
+extern const Except_T *scan_input(Source src, Scan scan);
+
+extern const Except_T *scan_input_piped(Source src, Scan scan, size_t jobs);
+
+#endif
@@ -0,0 +1,575 @@
+/* kernelbench.c
+ *
+ * Microbenchmarks for the per-byte kernels of a restoration, each variant
+ * timed against its baseline on the same input:
+ *
+ *      scan    scan_row, which keys and decodes a line in one pass, with
+ *              each kernel ("key+row") against the two passes it replaced,
+ *              make_pattern_key into an Atom then compact_digits_to_bytes
+ *              (kept here as the baseline); and its SSE2 and AVX2 kernels
+ *              against its scalar kernel when keying a line only ("key",
+ *              as a table lookup or --prune's counting pass does)
+ *      read    LineReader's block reader against the fgetc loop readaline
+ *              was first written with (kept here as the baseline)
+ *
+ * Each shape of input is a synthetic hacked-PGM buffer of about -b bytes:
+ * short, long and mixed line lengths, lines dense in digits or in junk,
+ * and CRLF line ends. Times are the best of -r runs, each variant taking
+ * turns with its baseline, in TSC cycles and in ns per input byte. A
+ * variant whose checksum differs from its baseline's is a MISMATCH, and
+ * one slower than its baseline by more than -t percent is a REGRESSION;
+ * either makes the exit status 1.
+ *
+ * Usage: ./kernelbench [-b bytes] [-r reps] [-t percent]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "except.h"
+#include "mem.h"
+#include "atom.h"
+#include "linescan.h"
+#include "readaline.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/* Kernels of scan_row timed: scalar, SSE2 and AVX2 */
+#define NKERNELS 3
+
+/* One kind of input: pixels per line, junk bytes per pixel, pixel values */
+typedef struct Shape
+{
+        const char *name;
+        size_t min_width, max_width;
+        int min_junk, max_junk;
+        int min_value, max_value;
+        int crlf;
+} Shape;
+
+static const Shape shapes[] = {
+        {"short", 4, 4, 1, 2, 0, 255, 0},
+        {"medium", 64, 64, 1, 2, 0, 255, 0},
+        {"long", 2048, 2048, 1, 2, 0, 255, 0},
+        {"mixed", 1, 512, 1, 2, 0, 255, 0},
+        {"digits", 64, 64, 1, 1, 100, 255, 0},
+        {"junk", 64, 64, 4, 8, 0, 9, 0},
+        {"crlf", 64, 64, 1, 2, 0, 255, 1},
+};
+
+typedef struct Corpus
+{
+        char *text;   /* all lines, back to back */
+        size_t len;
+        size_t *offs; /* start of each line; offs[nlines] == len */
+        size_t nlines;
+        size_t longest;
+} Corpus;
+
+/* Best run of a kernel, per input byte, and what it computed */
+typedef struct Timing
+{
+        double cycles;
+        double ns;
+        unsigned long long sum;
+} Timing;
+
+typedef unsigned long long (*Kernel)(Corpus *c, void *cl);
+
+/* One variant of a kernel: what to run, and with what */
+typedef struct Variant
+{
+        Kernel k;
+        void *cl;
+} Variant;
+
+/* What a scan run needs besides the corpus */
+typedef struct ScanArgs
+{
+        Scan_Kernel kernel;
+        char *pixels; /* NULL to key only */
+        Skeleton skel;
+} ScanArgs;
+
+static Corpus make_corpus(const Shape *s, size_t bytes);
+static void free_corpus(Corpus *c);
+static void best_of(const Variant *v, size_t n, Corpus *c, int reps,
+                    Timing *best);
+static int report(const char *shape, const char *what, const char *variant,
+                  Timing t, const Timing *base, double threshold);
+static unsigned long long run_scan(Corpus *c, void *cl);
+static unsigned long long run_two_pass(Corpus *c, void *cl);
+static unsigned long long line_sum(unsigned long long sum, const char *line,
+                                   size_t n);
+static unsigned long long run_fgetc(Corpus *c, void *cl);
+static unsigned long long run_reader(Corpus *c, void *cl);
+
+/* The pre-fusion code, kept here as the baseline */
+static const char *make_pattern_key(const char *line, size_t n);
+static size_t compact_digits_to_bytes(const char *line, size_t n,
+                                      char *out);
+
+int main(int argc, char *argv[])
+{
+        size_t bytes = 8u << 20;
+        int reps = 5;
+        double threshold = 10;
+        for (int i = 1; i < argc; i++)
+        {
+                if (i + 1 < argc && strcmp(argv[i], "-b") == 0)
+                        bytes = strtoul(argv[++i], NULL, 10);
+                else if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+                        reps = atoi(argv[++i]);
+                else if (i + 1 < argc && strcmp(argv[i], "-t") == 0)
+                        threshold = atof(argv[++i]);
+                else
+                        bytes = 0;
+        }
+        if (bytes == 0 || reps <= 0 || threshold < 0)
+        {
+                fprintf(stderr, "usage: %s [-b bytes] [-r reps] "
+                        "[-t percent]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* The scalar kernel, always available, is the baseline for "key" */
+        static const Scan_Kernel kernels[NKERNELS] = {SCAN_SCALAR,
+                                                      SCAN_SSE2, SCAN_AVX2};
+        Skeleton skel = Skeleton_new();
+        int failures = 0;
+
+        printf("%zu bytes per shape, best of %d, regression over %.0f%%\n",
+               bytes, reps, threshold);
+        printf("%-7s %-9s %-14s %10s %8s %8s\n", "shape", "kernel",
+               "variant", "cycles/B", "ns/B", "speedup");
+        for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+        {
+                Corpus c = make_corpus(&shapes[s], bytes);
+                char *pixels = ALLOC(c.longest + 1);
+
+                /*
+                 * key+row, then key only, for each kernel the CPU has; the
+                 * old two passes go first as the baseline for key+row
+                 */
+                for (int mode = 0; mode < 2; mode++)
+                {
+                        const char *what = mode == 0 ? "key+row" : "key";
+                        ScanArgs args[NKERNELS + 1];
+                        Variant v[NKERNELS + 1];
+                        const char *names[NKERNELS + 1];
+                        size_t n = 0;
+                        if (mode == 0)
+                        {
+                                args[n].pixels = pixels;
+                                v[n].k = run_two_pass;
+                                v[n].cl = &args[n];
+                                names[n++] = "two-pass";
+                        }
+                        for (size_t k = 0; k < NKERNELS; k++)
+                        {
+                                if (!scan_select(kernels[k]))
+                                        continue;
+                                args[n].kernel = kernels[k];
+                                args[n].pixels = mode == 0 ? pixels : NULL;
+                                args[n].skel = skel;
+                                v[n].k = run_scan;
+                                v[n].cl = &args[n];
+                                names[n++] = scan_kernel_name();
+                        }
+                        Timing t[NKERNELS + 1];
+                        best_of(v, n, &c, reps, t);
+                        for (size_t k = 0; k < n; k++)
+                        {
+                                failures += report(shapes[s].name, what,
+                                                   names[k], t[k],
+                                                   k == 0 ? NULL : &t[0],
+                                                   threshold);
+                        }
+                }
+
+                /* The readers read the corpus back from a temporary file */
+                FILE *fp = tmpfile();
+                if (fp == NULL || fwrite(c.text, 1, c.len, fp) != c.len ||
+                    fflush(fp) != 0)
+                {
+                        perror("kernelbench: temporary file");
+                        return EXIT_FAILURE;
+                }
+                Variant readers[2] = {{run_fgetc, fp}, {run_reader, fp}};
+                Timing t[2];
+                best_of(readers, 2, &c, reps, t);
+                failures += report(shapes[s].name, "read", "fgetc", t[0],
+                                   NULL, threshold);
+                failures += report(shapes[s].name, "read", "LineReader",
+                                   t[1], &t[0], threshold);
+                fclose(fp);
+
+                FREE(pixels);
+                free_corpus(&c);
+        }
+        Skeleton_free(&skel);
+
+        if (failures > 0)
+        {
+                printf("%d variant(s) regressed or mismatched\n", failures);
+                return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+}
+
+/********** make_corpus ********
+ *
+ * Builds lines of the given shape until they reach the given size. Every
+ * pixel is preceded by its junk bytes, and a line ends in "\n" or "\r\n".
+ *
+ ************************/
+static Corpus make_corpus(const Shape *s, size_t bytes)
+{
+        static const char junk[] = "abcdefghijklmnopqrstuvwxyz!#$%&*+-/<=>?@^_~";
+        Corpus c;
+        size_t line_max = s->max_width * (size_t)(s->max_junk + 3) + 2;
+        size_t cap = bytes + line_max;
+        size_t offs_cap = 1024;
+        c.text = ALLOC(cap);
+        c.offs = ALLOC(offs_cap * sizeof(*c.offs));
+        c.len = 0;
+        c.nlines = 0;
+        c.longest = 0;
+
+        srand(40);
+        while (c.len < bytes)
+        {
+                if (c.nlines + 1 >= offs_cap)
+                {
+                        offs_cap *= 2;
+                        RESIZE(c.offs, offs_cap * sizeof(*c.offs));
+                }
+                c.offs[c.nlines++] = c.len;
+                size_t start = c.len;
+                size_t width = s->min_width + (size_t)rand() %
+                               (s->max_width - s->min_width + 1);
+                for (size_t x = 0; x < width; x++)
+                {
+                        int nk = s->min_junk +
+                                 rand() % (s->max_junk - s->min_junk + 1);
+                        for (int k = 0; k < nk; k++)
+                        {
+                                c.text[c.len++] =
+                                        junk[rand() % (int)(sizeof(junk) - 1)];
+                        }
+                        c.len += (size_t)sprintf(c.text + c.len, "%d",
+                                s->min_value + rand() % (s->max_value -
+                                                         s->min_value + 1));
+                }
+                if (s->crlf)
+                        c.text[c.len++] = '\r';
+                c.text[c.len++] = '\n';
+                if (c.len - start > c.longest)
+                        c.longest = c.len - start;
+        }
+        c.offs[c.nlines] = c.len;
+        return c;
+}
+
+static void free_corpus(Corpus *c)
+{
+        FREE(c->offs);
+        FREE(c->text);
+}
+
+/********** best_of ********
+ *
+ * Runs each variant once to warm up, then all of them in turn reps times,
+ * and keeps each one's fastest run by wall time, divided by the size of
+ * the corpus. Taking turns means a slow spell of the machine (another
+ * process, a change of clock speed) falls on a variant and its baseline
+ * alike, rather than on whichever happened to be running.
+ *
+ * Parameters:
+ *      const Variant *v: the variants, baseline first
+ *      size_t n:         how many
+ *      Timing *best:     receives each variant's best run
+ *
+ ************************/
+static void best_of(const Variant *v, size_t n, Corpus *c, int reps,
+                    Timing *best)
+{
+        for (size_t i = 0; i < n; i++)
+        {
+                best[i].ns = best[i].cycles = 0;
+                best[i].sum = v[i].k(c, v[i].cl);
+        }
+        for (int r = 0; r < reps; r++)
+        {
+                for (size_t i = 0; i < n; i++)
+                {
+                        struct timespec ts0, ts1;
+                        unsigned long long t0 = 0, t1 = 0;
+                        clock_gettime(CLOCK_MONOTONIC, &ts0);
+#ifdef HAVE_RDTSC
+                        t0 = __rdtsc();
+#endif
+                        unsigned long long sum = v[i].k(c, v[i].cl);
+#ifdef HAVE_RDTSC
+                        t1 = __rdtsc();
+#endif
+                        clock_gettime(CLOCK_MONOTONIC, &ts1);
+                        double ns = (double)(ts1.tv_sec - ts0.tv_sec) * 1e9 +
+                                    (double)(ts1.tv_nsec - ts0.tv_nsec);
+                        if (r == 0 || ns < best[i].ns)
+                        {
+                                best[i].ns = ns;
+                                best[i].cycles = (double)(t1 - t0);
+                        }
+                        if (sum != best[i].sum)
+                                best[i].sum = ~0ull; /* not even stable */
+                }
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+                best[i].ns /= (double)c->len;
+                best[i].cycles /= (double)c->len;
+        }
+}
+
+/********** report ********
+ *
+ * Prints one line of results and checks a variant against its baseline.
+ *
+ * Parameters:
+ *      Timing t:           the variant's best run
+ *      const Timing *base: its baseline's, or NULL if t is the baseline
+ *      double threshold:   how much slower than the baseline, in percent,
+ *                            the variant may be
+ *
+ * Return:
+ *      1 if the variant computed something else or was too slow, else 0
+ *
+ ************************/
+static int report(const char *shape, const char *what, const char *variant,
+                  Timing t, const Timing *base, double threshold)
+{
+        printf("%-7s %-9s %-14s", shape, what, variant);
+#ifdef HAVE_RDTSC
+        printf(" %10.3f", t.cycles);
+#else
+        printf(" %10s", "-");
+#endif
+        printf(" %8.3f", t.ns);
+        if (base == NULL)
+        {
+                printf(" %8s\n", "baseline");
+                return 0;
+        }
+        printf(" %7.2fx", base->ns / t.ns);
+        if (t.sum != base->sum)
+        {
+                printf("  MISMATCH\n");
+                return 1;
+        }
+        if (t.ns > base->ns * (1 + threshold / 100))
+        {
+                printf("  REGRESSION\n");
+                return 1;
+        }
+        printf("\n");
+        return 0;
+}
+
+/********** run_scan ********
+ *
+ * Scans every line of the corpus with the variant's kernel.
+ *
+ * Return:
+ *      a checksum of the widths, the skeleton lengths and each row's last
+ *      pixel, which all kernels must agree on
+ *
+ ************************/
+static unsigned long long run_scan(Corpus *c, void *cl)
+{
+        ScanArgs *args = cl;
+        unsigned long long sum = 0;
+        scan_select(args->kernel);
+        for (size_t l = 0; l < c->nlines; l++)
+        {
+                const char *line = c->text + c->offs[l];
+                size_t n = c->offs[l + 1] - c->offs[l];
+                size_t w = scan_row(line, n, args->pixels, args->skel);
+                sum = sum * 31 + w + args->skel->len;
+                if (args->pixels != NULL && w > 0)
+                        sum += (unsigned char)args->pixels[w - 1];
+        }
+        return sum;
+}
+
+/********** run_two_pass ********
+ *
+ * Keys and decodes every line the way restoration did before scan_row:
+ * the skeleton is built and interned with make_pattern_key, then the
+ * digits are converted with compact_digits_to_bytes.
+ *
+ * Return:
+ *      the same checksum as run_scan
+ *
+ ************************/
+static unsigned long long run_two_pass(Corpus *c, void *cl)
+{
+        ScanArgs *args = cl;
+        unsigned long long sum = 0;
+        for (size_t l = 0; l < c->nlines; l++)
+        {
+                const char *line = c->text + c->offs[l];
+                size_t n = c->offs[l + 1] - c->offs[l];
+                const char *key = make_pattern_key(line, n);
+                size_t w = compact_digits_to_bytes(line, n, args->pixels);
+                sum = sum * 31 + w + (size_t)Atom_length(key);
+                if (w > 0)
+                        sum += (unsigned char)args->pixels[w - 1];
+        }
+        return sum;
+}
+
+/* Checksum of one line read back, the same for both readers */
+static unsigned long long line_sum(unsigned long long sum, const char *line,
+                                   size_t n)
+{
+        return sum * 31 + n + (unsigned char)line[n - 1];
+}
+
+/********** run_fgetc ********
+ *
+ * Reads the file back a byte at a time into a buffer that doubles as
+ * needed, as readaline first did.
+ *
+ ************************/
+static unsigned long long run_fgetc(Corpus *c, void *cl)
+{
+        FILE *fp = cl;
+        size_t cap = 1000;
+        char *buf = ALLOC(cap);
+        unsigned long long sum = 0;
+        size_t n = 0;
+        int ch;
+        (void)c;
+
+        rewind(fp);
+        while ((ch = fgetc(fp)) != EOF)
+        {
+                if (n == cap)
+                {
+                        cap *= 2;
+                        RESIZE(buf, cap);
+                }
+                buf[n++] = (char)ch;
+                if (ch == '\n')
+                {
+                        sum = line_sum(sum, buf, n);
+                        n = 0;
+                }
+        }
+        if (n > 0)
+                sum = line_sum(sum, buf, n);
+        FREE(buf);
+        return sum;
+}
+
+/********** run_reader ********
+ *
+ * Reads the file back through a LineReader, reusing one buffer.
+ *
+ ************************/
+static unsigned long long run_reader(Corpus *c, void *cl)
+{
+        FILE *fp = cl;
+        char *buf = NULL;
+        size_t cap = 0;
+        unsigned long long sum = 0;
+        size_t n;
+        (void)c;
+
+        rewind(fp);
+        LineReader r = LineReader_new(fp);
+        while ((n = LineReader_next(r, &buf, &cap)) != 0 &&
+               n != READALINE_ERROR)
+        {
+                sum = line_sum(sum, buf, n);
+        }
+        LineReader_free(&r);
+        FREE(buf);
+        return sum;
+}
+
+/********** make_pattern_key ********
+ *
+ * The line's non-digit bytes, up to its newline, as an Atom.
+ *
+ ************************/
+static const char *make_pattern_key(const char *line, size_t n)
+{
+        char *tmp = ALLOC(n + 1);
+        size_t out = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+                unsigned char c = (unsigned char)line[i];
+                if (c == '\n')
+                {
+                        break;
+                }
+                if (!isdigit(c))
+                {
+                        tmp[out++] = (char)c;
+                }
+        }
+        tmp[out] = '\0';
+        const char *key = Atom_string(tmp);
+        FREE(tmp);
+        return key;
+}
+
+/********** compact_digits_to_bytes ********
+ *
+ * Converts each run of digits in the line to a byte. The original worked
+ * in place in the line buffer; this one writes to 'out' so that the
+ * corpus can be read again on the next run.
+ *
+ * Return:
+ *      the number of pixels
+ *
+ ************************/
+static size_t compact_digits_to_bytes(const char *line, size_t n, char *out)
+{
+        size_t i = 0, w = 0;
+        while (i < n)
+        {
+                unsigned char c = (unsigned char)line[i];
+                if (c == '\n')
+                {
+                        break;
+                }
+                if (isdigit(c))
+                {
+                        unsigned v = 0;
+                        do
+                        {
+                                v = v * 10u + (unsigned)(line[i] - '0');
+                                i++;
+                        } while (i < n && isdigit((unsigned char)line[i]));
+                        if (v > 255u)
+                        {
+                                RAISE(PixelBad);
+                        }
+                        out[w++] = (char)(unsigned char)v;
+                }
+                else
+                {
+                        i++;
+                }
+        }
+        return w;
+}
@@ -0,0 +1,414 @@
+/* linescan.c */
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "linescan.h"
+#include "mem.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINESCAN_X86 1
+#include <immintrin.h>
+#endif
+
+const Except_T PixelBad = {"restoration: pixel out of range (0-255)"};
+
+/* Bytes classified per step by the vector kernels */
+#define BLOCK 32
+
+typedef size_t (*Scan_Fn)(const char *line, size_t n, char *pixels,
+                          char *key, size_t *klen);
+
+static size_t scan_scalar(const char *line, size_t n, char *pixels, char *key,
+                          size_t *klen);
+#ifdef LINESCAN_X86
+static size_t scan_sse2(const char *line, size_t n, char *pixels, char *key,
+                        size_t *klen);
+static size_t scan_avx2(const char *line, size_t n, char *pixels, char *key,
+                        size_t *klen);
+#endif
+
+static Scan_Fn scan_fn = NULL;
+static const char *scan_name = "scalar";
+
+/********** Skeleton_new ********
+ *
+ * Allocates an empty skeleton buffer; it grows on demand in scan_row.
+ *
+ * Return:
+ *      the new Skeleton
+ *
+ ************************/
+Skeleton Skeleton_new(void)
+{
+        Skeleton skel;
+        NEW(skel);
+        skel->cap = 128;
+        skel->bytes = ALLOC(skel->cap);
+        skel->len = 0;
+        return skel;
+}
+
+/********** Skeleton_free ********
+ *
+ * Frees a skeleton buffer and sets *skel to NULL.
+ *
+ * Parameters:
+ *      Skeleton *skel: address of the Skeleton to free
+ *
+ ************************/
+void Skeleton_free(Skeleton *skel)
+{
+        FREE((*skel)->bytes);
+        FREE(*skel);
+}
+
+/********** scan_select ********
+ *
+ * Chooses the kernel used by scan_row. SCAN_AUTO picks SSE2 where the CPU
+ * has it: AVX2 only widens the classification, and the digit runs are
+ * parsed the same way, so it measures no faster than SSE2 (make
+ * microbench) and slower in unoptimised builds; it is used only when asked
+ * for. scan_row makes the choice itself on first use, but threaded callers
+ * should choose up front so that the choice is not made in a race.
+ *
+ * Parameters:
+ *      Scan_Kernel k: the kernel to use
+ *
+ * Return:
+ *      1 if the kernel is available and now in use, 0 if not (in which case
+ *      the current choice is left alone)
+ *
+ ************************/
+int scan_select(Scan_Kernel k)
+{
+        switch (k)
+        {
+        case SCAN_SCALAR:
+                scan_fn = scan_scalar;
+                scan_name = "scalar";
+                return 1;
+#ifdef LINESCAN_X86
+        case SCAN_SSE2:
+                if (!__builtin_cpu_supports("sse2"))
+                        return 0;
+                scan_fn = scan_sse2;
+                scan_name = "sse2";
+                return 1;
+        case SCAN_AVX2:
+                if (!__builtin_cpu_supports("avx2"))
+                        return 0;
+                scan_fn = scan_avx2;
+                scan_name = "avx2";
+                return 1;
+        case SCAN_AUTO:
+                __builtin_cpu_init();
+                return scan_select(SCAN_SSE2) || scan_select(SCAN_SCALAR);
+#else
+        case SCAN_AUTO:
+                return scan_select(SCAN_SCALAR);
+#endif
+        default:
+                return 0;
+        }
+}
+
+/********** scan_kernel_name ********
+ *
+ * Return:
+ *      the name of the kernel scan_row is using ("scalar", "sse2", "avx2")
+ *
+ ************************/
+const char *scan_kernel_name(void)
+{
+        return scan_name;
+}
+
+/********** scan_row ********
+ *
+ * Walks the line once, up to its '\n' or n bytes. Digit runs are compacted
+ * into pixel bytes and every other byte is appended to the skeleton, so the
+ * key and the row come out of the same pass with no per-line allocation.
+ *
+ * Parameters:
+ *      const char *line: the line to scan
+ *      size_t n:         the length of the line
+ *      char *pixels:     where to store the pixel bytes; may be the line
+ *                          itself (the output never overtakes the input) or
+ *                          NULL to only count and validate the pixels
+ *      Skeleton skel:    receives the non-digit bytes (NUL-terminated), or
+ *                          NULL if the caller only needs the pixels
+ *
+ * Return:
+ *      the number of pixels in the line, or SCAN_PIXEL_BAD if any digit run
+ *      is greater than 255 (the skeleton is incomplete in that case)
+ *
+ * Notes:
+ *      never RAISEs except on allocation failure, so it is safe to call
+ *      from threads other than the one running the Hanson exception stack,
+ *      given that each thread has its own Skeleton
+ ************************/
+size_t scan_row(const char *line, size_t n, char *pixels, Skeleton skel)
+{
+        if (scan_fn == NULL)
+        {
+                scan_select(SCAN_AUTO);
+        }
+
+        char *key = NULL;
+        if (skel != NULL)
+        {
+                if (skel->cap < n + 1)
+                {
+                        skel->cap = n + 1;
+                        RESIZE(skel->bytes, skel->cap);
+                }
+                key = skel->bytes;
+        }
+
+        /* A line shorter than a block is all tail: skip the vector setup */
+        size_t k = 0;
+        Scan_Fn fn = n < BLOCK ? scan_scalar : scan_fn;
+        size_t out = fn(line, n, pixels, key, &k);
+
+        if (key != NULL && out != SCAN_PIXEL_BAD)
+        {
+                key[k] = '\0';
+                skel->len = k;
+        }
+        return out;
+}
+
+/********** scan_line ********
+ *
+ * scan_row, with a bad pixel reported as an exception.
+ *
+ * Return:
+ *      the number of pixels in the line
+ *
+ * Notes:
+ *      RAISEs PixelBad if any digit run is greater than 255; the skeleton is
+ *      incomplete in that case
+ ************************/
+size_t scan_line(const char *line, size_t n, char *pixels, Skeleton skel)
+{
+        size_t out = scan_row(line, n, pixels, skel);
+        if (out == SCAN_PIXEL_BAD)
+        {
+                RAISE(PixelBad);
+        }
+        return out;
+}
+
+/********** scan_rest ********
+ *
+ * The scalar scanner, starting at byte i with out pixels and *klen skeleton
+ * bytes already produced. It is the whole of the scalar kernel and finishes
+ * the tail of a line for the vector kernels. Like every kernel it returns
+ * SCAN_PIXEL_BAD for a digit run over 255.
+ *
+ ************************/
+static inline size_t scan_rest(const char *line, size_t n, size_t i,
+                               size_t out, char *pixels, char *key,
+                               size_t *klen)
+{
+        size_t k = *klen;
+        while (i < n)
+        {
+                unsigned char c = (unsigned char)line[i];
+                if (c == '\n')
+                {
+                        break;
+                }
+                if (isdigit(c))
+                {
+                        unsigned v = 0;
+                        /* Parse consecutive digit bytes into v */
+                        do
+                        {
+                                v = v * 10u + (unsigned)(line[i] - '0');
+                                i++;
+                        } while (i < n && isdigit((unsigned char)line[i]));
+                        if (v > 255u)
+                        {
+                                return SCAN_PIXEL_BAD;
+                        }
+                        if (pixels != NULL)
+                        {
+                                pixels[out] = (char)(unsigned char)v;
+                        }
+                        out++;
+                }
+                else
+                {
+                        /* Append the nondigit byte */
+                        if (key != NULL)
+                        {
+                                key[k++] = (char)c;
+                        }
+                        i++;
+                }
+        }
+        *klen = k;
+        return out;
+}
+
+static size_t scan_scalar(const char *line, size_t n, char *pixels, char *key,
+                          size_t *klen)
+{
+        return scan_rest(line, n, 0, 0, pixels, key, klen);
+}
+
+#ifdef LINESCAN_X86
+
+/*
+ * Digit and newline masks for the BLOCK bytes at p: bit j is set when p[j] is
+ * '0'-'9' (respectively '\n').
+ */
+typedef uint32_t (*Mask_Fn)(const char *p, uint32_t *newlines);
+
+static inline uint32_t masks_sse2(const char *p, uint32_t *newlines)
+{
+        const __m128i lo = _mm_set1_epi8('0' - 1);
+        const __m128i hi = _mm_set1_epi8('9' + 1);
+        const __m128i nl = _mm_set1_epi8('\n');
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+
+        /* Signed compares: bytes >= 0x80 are negative, so never digits */
+        __m128i da = _mm_and_si128(_mm_cmpgt_epi8(a, lo), _mm_cmplt_epi8(a, hi));
+        __m128i db = _mm_and_si128(_mm_cmpgt_epi8(b, lo), _mm_cmplt_epi8(b, hi));
+
+        *newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)) |
+                    (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl)) << 16;
+        return (uint32_t)_mm_movemask_epi8(da) |
+               (uint32_t)_mm_movemask_epi8(db) << 16;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t masks_avx2(const char *p, uint32_t *newlines)
+{
+        const __m256i lo = _mm256_set1_epi8('0' - 1);
+        const __m256i hi = _mm256_set1_epi8('9' + 1);
+        const __m256i nl = _mm256_set1_epi8('\n');
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+
+        __m256i d = _mm256_and_si256(_mm256_cmpgt_epi8(a, lo),
+                                     _mm256_cmpgt_epi8(hi, a));
+
+        *newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl));
+        return (uint32_t)_mm256_movemask_epi8(d);
+}
+
+/********** scan_blocks ********
+ *
+ * The vector kernel, generic over the mask function. Each block is
+ * classified at once; non-digit bytes are copied out by walking the set bits
+ * of the non-digit mask, and each digit run is found from the digit mask and
+ * parsed with straight-line code for the usual 1-3 digits. A run that reaches
+ * the end of the block is finished by the scalar loop and the next block
+ * starts right after it, so the result (including SCAN_PIXEL_BAD) always
+ * matches scan_scalar.
+ *
+ ************************/
+__attribute__((always_inline))
+static inline size_t scan_blocks(const char *line, size_t n, char *pixels,
+                                 char *key, size_t *klen, Mask_Fn masks)
+{
+        size_t i = 0, out = 0, k = 0;
+        while (i + BLOCK <= n)
+        {
+                const char *p = line + i;
+                uint32_t nl;
+                uint32_t d = masks(p, &nl);
+                /* Only bytes before the first newline belong to the line */
+                uint32_t live = nl != 0 ? (nl & (0u - nl)) - 1u : 0xFFFFFFFFu;
+                d &= live;
+
+                /*
+                 * Every non-digit byte of the block comes before a run that
+                 * spills over its end, so the key can be done up front.
+                 */
+                if (key != NULL)
+                {
+                        for (uint32_t m = ~d & live; m != 0; m &= m - 1)
+                        {
+                                key[k++] = p[__builtin_ctz(m)];
+                        }
+                }
+
+                size_t next = i + BLOCK;
+                while (d != 0)
+                {
+                        unsigned s = (unsigned)__builtin_ctz(d);
+                        uint32_t after = ~(d >> s);
+                        unsigned r = after != 0
+                                ? (unsigned)__builtin_ctz(after)
+                                : BLOCK - s;
+                        const unsigned char *q = (const unsigned char *)p + s;
+                        unsigned v = q[0] - '0';
+
+                        if (s + r == BLOCK)
+                        {
+                                /* The run may go on past the block */
+                                size_t j = i + s + 1;
+                                while (j < n && isdigit((unsigned char)line[j]))
+                                {
+                                        v = v * 10u +
+                                            (unsigned)(line[j] - '0');
+                                        j++;
+                                }
+                                next = j;
+                                d = 0;
+                        }
+                        else if (r <= 3)
+                        {
+                                if (r >= 2)
+                                        v = v * 10u + (q[1] - '0');
+                                if (r == 3)
+                                        v = v * 10u + (q[2] - '0');
+                                d &= ~(((1u << r) - 1u) << s);
+                        }
+                        else
+                        {
+                                for (unsigned t = 1; t < r; t++)
+                                        v = v * 10u + (q[t] - '0');
+                                d &= ~(((1u << r) - 1u) << s);
+                        }
+
+                        if (v > 255u)
+                        {
+                                return SCAN_PIXEL_BAD;
+                        }
+                        if (pixels != NULL)
+                        {
+                                pixels[out] = (char)(unsigned char)v;
+                        }
+                        out++;
+                }
+
+                if (nl != 0)
+                {
+                        *klen = k;
+                        return out;
+                }
+                i = next;
+        }
+        *klen = k;
+        return scan_rest(line, n, i, out, pixels, key, klen);
+}
+
+static size_t scan_sse2(const char *line, size_t n, char *pixels, char *key,
+                        size_t *klen)
+{
+        return scan_blocks(line, n, pixels, key, klen, masks_sse2);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *line, size_t n, char *pixels, char *key,
+                        size_t *klen)
+{
+        return scan_blocks(line, n, pixels, key, klen, masks_avx2);
+}
+
+#endif
@@ -0,0 +1,51 @@
+/* linescan.h
+ *
+ * Single-pass scanner for one line of a hacked PGM file. Each call splits the
+ * line into its non-digit skeleton (used as the bucket key) and its decoded
+ * pixel bytes.
+ */
+#ifndef LINESCAN_INCLUDED
+#define LINESCAN_INCLUDED
+
+#include <stddef.h>
+
+#include "except.h"
+
+/* Raised by scan_line when a run of digits in a line is larger than 255 */
+extern const Except_T PixelBad;
+
+/* Returned by scan_row instead of a width for the same error */
+#define SCAN_PIXEL_BAD ((size_t)-1)
+
+/* Growable buffer that receives the non-digit bytes of a line */
+typedef struct Skeleton
+{
+        char *bytes;
+        size_t len;
+        size_t cap;
+} *Skeleton;
+
+/* Implementations of scan_row; SCAN_AUTO picks the best one for the CPU */
+typedef enum Scan_Kernel
+{
+        SCAN_AUTO,
+        SCAN_SCALAR,
+        SCAN_SSE2,
+        SCAN_AVX2
+} Scan_Kernel;
+
+extern Skeleton Skeleton_new(void);
+
+extern void Skeleton_free(Skeleton *skel);
+
+extern size_t scan_row(const char *line, size_t n, char *pixels,
+                       Skeleton skel);
+
+extern size_t scan_line(const char *line, size_t n, char *pixels,
+                        Skeleton skel);
+
+extern int scan_select(Scan_Kernel k);
+
+extern const char *scan_kernel_name(void);
+
+#endif
@@ -0,0 +1,336 @@
+/* pattable.c */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattable.h"
+#include "mem.h"
+
+#define T PatTable_T
+
+/* Smallest key chunk; longer keys get a chunk of their own size */
+#define CHUNK_BYTES (64 * 1024)
+
+/* One slot of the table; an empty slot has key == NULL */
+struct entry
+{
+        uint64_t hash;
+        const char *key;
+        size_t len;
+        void *value;
+};
+
+/* Keys are packed back to back in a list of chunks */
+struct chunk
+{
+        struct chunk *next;
+        size_t used;
+        size_t cap;
+        char bytes[];
+};
+
+struct T
+{
+        struct entry *slots;
+        size_t mask;   /* number of slots - 1 (a power of two) */
+        size_t length; /* number of keys */
+        struct chunk *keys;
+        size_t key_bytes; /* of the key chunks, headers included */
+};
+
+static void grow(T table);
+static const char *copy_key(T table, const char *key, size_t len);
+
+/********** PatTable_new ********
+ *
+ * Creates an empty table sized to hold about 'hint' keys without growing.
+ *
+ * Parameters:
+ *      size_t hint: expected number of keys (0 if unknown)
+ *
+ * Return:
+ *      the new table
+ *
+ ************************/
+T PatTable_new(size_t hint)
+{
+        /* Keep the load factor at or under one half */
+        size_t nslots = 1024;
+        while (nslots < hint * 2 && nslots < ((size_t)1 << 40))
+        {
+                nslots <<= 1;
+        }
+
+        T table;
+        NEW(table);
+        table->slots = CALLOC((long)nslots, (long)sizeof(struct entry));
+        table->mask = nslots - 1;
+        table->length = 0;
+        table->keys = NULL;
+        table->key_bytes = 0;
+        return table;
+}
+
+/********** PatTable_free ********
+ *
+ * Frees the table and its copies of the keys (not the values) and sets
+ * *table to NULL.
+ *
+ ************************/
+void PatTable_free(T *table)
+{
+        struct chunk *c = (*table)->keys;
+        while (c != NULL)
+        {
+                struct chunk *next = c->next;
+                FREE(c);
+                c = next;
+        }
+        FREE((*table)->slots);
+        FREE(*table);
+}
+
+/********** PatTable_clear ********
+ *
+ * Removes every key, keeping the slots and the newest key chunk so that a
+ * table reused for another input does not have to grow again.
+ *
+ ************************/
+void PatTable_clear(T table)
+{
+        struct chunk *c = table->keys;
+        if (c != NULL)
+        {
+                struct chunk *rest = c->next;
+                while (rest != NULL)
+                {
+                        struct chunk *next = rest->next;
+                        FREE(rest);
+                        rest = next;
+                }
+                c->next = NULL;
+                c->used = 0;
+                table->key_bytes = sizeof(*c) + c->cap;
+        }
+        memset(table->slots, 0, (table->mask + 1) * sizeof(struct entry));
+        table->length = 0;
+}
+
+size_t PatTable_length(T table)
+{
+        return table->length;
+}
+
+/********** PatTable_bytes ********
+ *
+ * Return:
+ *      the memory the table holds for its slots and its copies of the keys
+ *
+ ************************/
+size_t PatTable_bytes(T table)
+{
+        return (table->mask + 1) * sizeof(struct entry) + table->key_bytes;
+}
+
+/********** PatTable_slot ********
+ *
+ * Finds the value slot for a key, adding the key with a NULL value if it is
+ * not in the table yet.
+ *
+ * Parameters:
+ *      T table:         the table
+ *      const char *key: the skeleton bytes (need not be NUL-terminated)
+ *      size_t len:      the number of bytes in the key
+ *
+ * Return:
+ *      the address of the key's value; it stays valid until the next call
+ *      that adds a key
+ *
+ ************************/
+void **PatTable_slot(T table, const char *key, size_t len)
+{
+        return PatTable_slot_hash(table, key, len, PatTable_hash(key, len));
+}
+
+/********** PatTable_slot_hash ********
+ *
+ * PatTable_slot for a key whose PatTable_hash is already known, so that the
+ * hashing can be done elsewhere (on another thread) than the lookup.
+ *
+ ************************/
+void **PatTable_slot_hash(T table, const char *key, size_t len, uint64_t h)
+{
+        size_t i = (size_t)h & table->mask;
+
+        for (;;)
+        {
+                struct entry *e = &table->slots[i];
+                if (e->key == NULL)
+                {
+                        break;
+                }
+                if (e->hash == h && e->len == len &&
+                    memcmp(e->key, key, len) == 0)
+                {
+                        return &e->value;
+                }
+                i = (i + 1) & table->mask;
+        }
+
+        if ((table->length + 1) * 2 > table->mask + 1)
+        {
+                grow(table);
+                i = (size_t)h & table->mask;
+                while (table->slots[i].key != NULL)
+                {
+                        i = (i + 1) & table->mask;
+                }
+        }
+
+        struct entry *e = &table->slots[i];
+        e->hash = h;
+        e->key = copy_key(table, key, len);
+        e->len = len;
+        e->value = NULL;
+        table->length++;
+        return &e->value;
+}
+
+/********** PatTable_get ********
+ *
+ * Looks up a key without adding it.
+ *
+ * Return:
+ *      the key's value, or NULL if the key is not in the table
+ *
+ ************************/
+void *PatTable_get(T table, const char *key, size_t len)
+{
+        uint64_t h = PatTable_hash(key, len);
+        size_t i = (size_t)h & table->mask;
+
+        for (;;)
+        {
+                struct entry *e = &table->slots[i];
+                if (e->key == NULL)
+                {
+                        return NULL;
+                }
+                if (e->hash == h && e->len == len &&
+                    memcmp(e->key, key, len) == 0)
+                {
+                        return e->value;
+                }
+                i = (i + 1) & table->mask;
+        }
+}
+
+/********** PatTable_map ********
+ *
+ * Calls apply(key, len, &value, cl) for every key in the table, in no
+ * particular order. apply must not add keys.
+ *
+ ************************/
+void PatTable_map(T table,
+                  void apply(const char *key, size_t len, void **value,
+                             void *cl),
+                  void *cl)
+{
+        for (size_t i = 0; i <= table->mask; i++)
+        {
+                struct entry *e = &table->slots[i];
+                if (e->key != NULL)
+                {
+                        apply(e->key, e->len, &e->value, cl);
+                }
+        }
+}
+
+/********** PatTable_hash ********
+ *
+ * 64-bit hash of a byte string, eight bytes per step with a multiply-xorshift
+ * mix. Not cryptographic; it only needs to spread skeletons across the table
+ * and make full key comparisons rare.
+ *
+ ************************/
+uint64_t PatTable_hash(const char *key, size_t len)
+{
+        const uint64_t m = 0x9E3779B97F4A7C15ull;
+        uint64_t h = 0xCBF29CE484222325ull ^ ((uint64_t)len * m);
+        size_t i = 0;
+
+        for (; i + 8 <= len; i += 8)
+        {
+                uint64_t w;
+                memcpy(&w, key + i, 8);
+                h = (h ^ w) * m;
+                h ^= h >> 29;
+        }
+        if (i < len)
+        {
+                uint64_t w = 0;
+                memcpy(&w, key + i, len - i);
+                h = (h ^ w) * m;
+                h ^= h >> 29;
+        }
+
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ull;
+        h ^= h >> 32;
+        return h;
+}
+
+/********** grow ********
+ *
+ * Doubles the number of slots, reinserting entries by their stored hash.
+ *
+ ************************/
+static void grow(T table)
+{
+        size_t old_n = table->mask + 1;
+        struct entry *old = table->slots;
+
+        table->slots = CALLOC((long)(old_n * 2), (long)sizeof(struct entry));
+        table->mask = old_n * 2 - 1;
+
+        for (size_t j = 0; j < old_n; j++)
+        {
+                if (old[j].key == NULL)
+                {
+                        continue;
+                }
+                size_t i = (size_t)old[j].hash & table->mask;
+                while (table->slots[i].key != NULL)
+                {
+                        i = (i + 1) & table->mask;
+                }
+                table->slots[i] = old[j];
+        }
+        FREE(old);
+}
+
+/********** copy_key ********
+ *
+ * Copies a key into the table's key chunks and returns the copy. Empty keys
+ * still get a (zero-length) non-NULL address, since NULL marks empty slots.
+ *
+ ************************/
+static const char *copy_key(T table, const char *key, size_t len)
+{
+        struct chunk *c = table->keys;
+        if (c == NULL || c->cap - c->used < len + 1)
+        {
+                size_t cap = len + 1 > CHUNK_BYTES ? len + 1 : CHUNK_BYTES;
+                c = ALLOC((long)(sizeof(*c) + cap));
+                c->used = 0;
+                c->cap = cap;
+                c->next = table->keys;
+                table->keys = c;
+                table->key_bytes += sizeof(*c) + cap;
+        }
+
+        char *copy = c->bytes + c->used;
+        memcpy(copy, key, len);
+        copy[len] = '\0';
+        c->used += len + 1;
+        return copy;
+}
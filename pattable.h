@@ -0,0 +1,42 @@
+/* pattable.h
+ *
+ * Hash table from line skeletons (the non-digit bytes of a line) to client
+ * values. Keys are hashed to 64 bits and stored by open addressing with
+ * linear probing; skeleton bytes are only compared when two hashes match.
+ * Keys are copied into the table, so callers may reuse their key buffer.
+ */
+#ifndef PATTABLE_INCLUDED
+#define PATTABLE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define T PatTable_T
+typedef struct T *T;
+
+extern T PatTable_new(size_t hint);
+
+extern void PatTable_free(T *table);
+
+extern void PatTable_clear(T table);
+
+extern size_t PatTable_length(T table);
+
+extern size_t PatTable_bytes(T table);
+
+extern void **PatTable_slot(T table, const char *key, size_t len);
+
+extern void **PatTable_slot_hash(T table, const char *key, size_t len,
+                                 uint64_t hash);
+
+extern void *PatTable_get(T table, const char *key, size_t len);
+
+extern void PatTable_map(T table,
+                         void apply(const char *key, size_t len, void **value,
+                                    void *cl),
+                         void *cl);
+
+extern uint64_t PatTable_hash(const char *key, size_t len);
+
+#undef T
+#endif
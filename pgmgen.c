@@ -0,0 +1,309 @@
+/* pgmgen.c
+ *
+ * Writes a synthetic hacked-PGM input together with the P5 image restoration
+ * should recover from it. The original rows all share one random skeleton
+ * (the non-digit bytes between and around their pixels); decoy rows, each
+ * with a skeleton of its own, are mixed in among them. Every decoy skeleton
+ * starts with a six-letter tag unique to that decoy, and the original one
+ * with a punctuation byte, so no two skeletons can collide whatever the
+ * density. Output is streamed, so inputs far larger than memory can be made.
+ *
+ * Usage: ./pgmgen [options] hacked.txt expected.pgm
+ *
+ *      -w W        pixels per row (default 640)
+ *      -h H        rows in the image (default: from -S, else 480)
+ *      -S SIZE     aim for an input of about SIZE bytes; K, M and G
+ *                  suffixes are accepted. Used to pick H when -h is not given
+ *      -d RATIO    decoy rows per original row (default 0.5)
+ *      -n DENSITY  mean non-digit bytes between pixels (default 2)
+ *      -c          CRLF line endings instead of LF
+ *      -s SEED     random seed (default 1)
+ *
+ * The input's line count is printed on stdout, for lines/s figures.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct Settings
+{
+        size_t width;
+        size_t height;     /* 0 until chosen */
+        double size;       /* -S target in bytes, or 0 */
+        double decoys;
+        double density;
+        int crlf;
+        uint64_t seed;
+} Settings;
+
+static uint64_t rng_state;
+
+static void usage(const char *prog);
+static double parse_size(const char *s);
+static uint64_t next_random(void);
+static size_t random_below(size_t n);
+static char random_nondigit(void);
+static size_t gap_length(double density, int need_one);
+static void write_gap(FILE *out, size_t n);
+static void write_tag(FILE *out, size_t id);
+static void write_pixel(FILE *out, unsigned char v);
+
+int main(int argc, char *argv[])
+{
+        Settings set = {640, 0, 0, 0.5, 2.0, 0, 1};
+        int i = 1;
+        for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+        {
+                char opt = argv[i][1];
+                if (opt == 'c' && argv[i][2] == '\0')
+                {
+                        set.crlf = 1;
+                        continue;
+                }
+                if (argv[i][2] != '\0' || i + 1 >= argc)
+                {
+                        usage(argv[0]);
+                }
+                const char *val = argv[++i];
+                switch (opt)
+                {
+                case 'w':
+                        set.width = strtoul(val, NULL, 10);
+                        break;
+                case 'h':
+                        set.height = strtoul(val, NULL, 10);
+                        break;
+                case 'S':
+                        set.size = parse_size(val);
+                        break;
+                case 'd':
+                        set.decoys = strtod(val, NULL);
+                        break;
+                case 'n':
+                        set.density = strtod(val, NULL);
+                        break;
+                case 's':
+                        set.seed = strtoull(val, NULL, 10);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (argc - i != 2 || set.width == 0 || set.decoys < 0 ||
+            set.density < 0)
+        {
+                usage(argv[0]);
+        }
+
+        /*
+         * Estimate bytes per row to pick H from -S: pixels average about
+         * 2.6 digits, and a decoy is on average about half as wide as a row.
+         */
+        double eol = set.crlf ? 2 : 1;
+        double row_bytes = (double)set.width * (2.6 + set.density) + eol;
+        double decoy_bytes = ((double)set.width + 4) / 2 *
+                             (2.6 + set.density + 1) + eol;
+        if (set.height == 0 && set.size > 0)
+        {
+                double h = set.size / (row_bytes + set.decoys * decoy_bytes);
+                set.height = h < 1 ? 1 : (size_t)h;
+        }
+        else if (set.height == 0)
+        {
+                set.height = 480;
+        }
+
+        FILE *in = fopen(argv[i], "wb");
+        FILE *img = fopen(argv[i + 1], "wb");
+        if (in == NULL || img == NULL)
+        {
+                fprintf(stderr, "%s: cannot create output files\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        rng_state = set.seed * 0x9E3779B97F4A7C15ull + 1;
+
+        /* The skeleton shared by every original row */
+        size_t *gaps = malloc((set.width + 1) * sizeof(*gaps));
+        char **gap_bytes = malloc((set.width + 1) * sizeof(*gap_bytes));
+        for (size_t g = 0; g <= set.width; g++)
+        {
+                /*
+                 * A gap before a pixel needs a byte: inner ones to keep two
+                 * pixels apart, the first for the punctuation mark below
+                 */
+                gaps[g] = gap_length(set.density, g < set.width);
+                gap_bytes[g] = malloc(gaps[g] + 1);
+                for (size_t k = 0; k < gaps[g]; k++)
+                {
+                        gap_bytes[g][k] = random_nondigit();
+                }
+        }
+        gap_bytes[0][0] = "!#$%&*+-/:;<=>?@^_|~"[random_below(20)];
+
+        const char *end = set.crlf ? "\r\n" : "\n";
+        unsigned char *row = malloc(set.width);
+        double p_decoy = set.decoys / (1 + set.decoys);
+        size_t lines = 0;
+        size_t ndecoys = 0;
+
+        fprintf(img, "P5\n%zu %zu\n255\n", set.width, set.height);
+        for (size_t y = 0; y < set.height; )
+        {
+                if ((double)(next_random() >> 11) / 9007199254740992.0 <
+                    p_decoy)
+                {
+                        /* Random width, and a fresh skeleton of its own */
+                        size_t w = 1 + random_below(set.width + 3);
+                        write_tag(in, ndecoys++);
+                        for (size_t x = 0; x < w; x++)
+                        {
+                                write_gap(in, gap_length(set.density, 1));
+                                write_pixel(in, (unsigned char)next_random());
+                        }
+                        write_gap(in, gap_length(set.density, 0));
+                }
+                else
+                {
+                        for (size_t x = 0; x < set.width; x++)
+                        {
+                                row[x] = (unsigned char)next_random();
+                                fwrite(gap_bytes[x], 1, gaps[x], in);
+                                write_pixel(in, row[x]);
+                        }
+                        fwrite(gap_bytes[set.width], 1, gaps[set.width], in);
+                        fwrite(row, 1, set.width, img);
+                        y++;
+                }
+                fputs(end, in);
+                lines++;
+        }
+
+        if (fclose(in) != 0 || fclose(img) != 0)
+        {
+                fprintf(stderr, "%s: write error\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        printf("%zu\n", lines);
+
+        for (size_t g = 0; g <= set.width; g++)
+        {
+                free(gap_bytes[g]);
+        }
+        free(gap_bytes);
+        free(gaps);
+        free(row);
+        return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-w W] [-h H] [-S SIZE] [-d RATIO] "
+                        "[-n DENSITY] [-c] [-s SEED] hacked.txt expected.pgm\n",
+                prog);
+        exit(EXIT_FAILURE);
+}
+
+/********** parse_size ********
+ *
+ * Reads a byte count with an optional K, M or G (binary) suffix.
+ *
+ ************************/
+static double parse_size(const char *s)
+{
+        char *end;
+        double v = strtod(s, &end);
+        switch (*end)
+        {
+        case 'G':
+        case 'g':
+                v *= 1024;
+                /* fall through */
+        case 'M':
+        case 'm':
+                v *= 1024;
+                /* fall through */
+        case 'K':
+        case 'k':
+                v *= 1024;
+                break;
+        default:
+                break;
+        }
+        return v;
+}
+
+/********** next_random ********
+ *
+ * xorshift64*: fast, and the same stream for a seed on every machine.
+ *
+ ************************/
+static uint64_t next_random(void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static size_t random_below(size_t n)
+{
+        return (size_t)(next_random() % n);
+}
+
+/* Any printable byte but a digit (or a line ending) */
+static char random_nondigit(void)
+{
+        char c;
+        do
+        {
+                c = (char)(' ' + random_below('~' - ' ' + 1));
+        } while (c >= '0' && c <= '9');
+        return c;
+}
+
+/********** gap_length ********
+ *
+ * Length of one run of non-digit bytes: uniform on [0, 2 * density], so
+ * that its mean is 'density', and at least 1 when 'need_one' is set.
+ *
+ ************************/
+static size_t gap_length(double density, int need_one)
+{
+        size_t n = random_below((size_t)(2 * density) + 1);
+        return n == 0 && need_one ? 1 : n;
+}
+
+static void write_gap(FILE *out, size_t n)
+{
+        for (size_t k = 0; k < n; k++)
+        {
+                putc(random_nondigit(), out);
+        }
+}
+
+/* Six letters spelling 'id' in base 52 */
+static void write_tag(FILE *out, size_t id)
+{
+        static const char letters[] =
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        for (int k = 0; k < 6; k++)
+        {
+                putc(letters[id % 52], out);
+                id /= 52;
+        }
+}
+
+/* Digit by digit: tall inputs have billions of pixels, and fprintf is slow */
+static void write_pixel(FILE *out, unsigned char v)
+{
+        if (v >= 100)
+        {
+                putc('0' + v / 100, out);
+        }
+        if (v >= 10)
+        {
+                putc('0' + v / 10 % 10, out);
+        }
+        putc('0' + v % 10, out);
+}
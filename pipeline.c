@@ -0,0 +1,473 @@
+/* pipeline.c */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "mem.h"
+
+/* Input bytes per block; a longer line gets a block of its own size */
+#define BLOCK_BYTES ((size_t)1 << 20)
+
+/* Lines a block has room for at first */
+#define BLOCK_LINES 4096
+
+/* Where a block is on its way round the ring */
+typedef enum Block_State
+{
+        BLOCK_EMPTY,    /* free for the reader */
+        BLOCK_FILLED,   /* holds lines for a scanner to take */
+        BLOCK_SCANNING,
+        BLOCK_SCANNED   /* ready for the storer */
+} Block_State;
+
+/* One line of a block, as its scanner left it */
+typedef struct Line
+{
+        size_t off;     /* where it starts in the block (and its pixels) */
+        size_t n;       /* its length, '\n' included */
+        size_t key;     /* where its skeleton starts in the block's keys */
+        size_t klen;
+        uint64_t hash;  /* PatTable_hash of the skeleton */
+        size_t width;   /* scan_row's result */
+} Line;
+
+/* Whole lines of the input, and what scanning them gave */
+typedef struct Block
+{
+        Block_State state;
+        char *bytes;    /* the lines; their pixels are decoded over them */
+        size_t cap;
+        size_t len;
+        size_t whole;   /* of len, bytes in lines ended by a newline */
+        size_t pos;     /* input offset of bytes[0] */
+        char *keys;     /* the lines' skeletons, back to back */
+        size_t keys_cap;
+        Line *lines;
+        size_t nlines;
+        size_t lines_cap;
+} Block;
+
+/* A pipeline, shared by the reader, the scanners and the storer */
+typedef struct Pipe
+{
+        Pipe_Fill fill;
+        void *cl;
+        Block *blocks;
+        size_t depth;     /* blocks in the ring */
+
+        /* The reader's own: a line cut off at the end of the last block */
+        char *carry;
+        size_t carry_len;
+        size_t carry_cap;
+        size_t pos;       /* input offset of the next block */
+
+        /* The ring, under 'lock'; the i-th block is blocks[i % depth] */
+        size_t filled;    /* blocks the reader has filled */
+        size_t claimed;   /* blocks taken to be scanned */
+        int eof;          /* the reader is done, so 'filled' is final */
+        int stop;         /* the storer wants no more */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+} *Pipe;
+
+static int await_block(Pipe p, Block *b, size_t seq, int reading);
+static void *read_blocks(void *cl);
+static int fill_block(Pipe p, Block *b);
+static void publish(Pipe p, Block *b, int last);
+static void *scan_blocks(void *cl);
+static void scan_block(Block *b);
+
+/********** scan_pipelined ********
+ *
+ * Scans a streamed input into 'scan' with a reader thread and 'jobs'
+ * scanner threads, storing the rows on this thread in input order. The ring
+ * holds two blocks per scanner and two more, so that the reader can stay a
+ * block ahead of the scanners and the scanners a block ahead of the storer.
+ *
+ * Parameters:
+ *      Scan scan:      the scan state receiving every usable line
+ *      Pipe_Fill fill: reads the input
+ *      void *cl:       fill's closure
+ *      size_t jobs:    number of scanner threads
+ *      size_t *end:    set to the input offset just past the last line
+ *                      stored that ended with a newline, for reporting a
+ *                      read error there
+ *
+ * Return:
+ *      NULL, &WidthBad if a row's width does not match its Bucket's, or
+ *      &SpillFail (the line is recorded in scan->fault)
+ *
+ * Notes:
+ *      threads that cannot be started are done without: this thread then
+ *      reads, or scans, the blocks it is waiting for itself. Once a row
+ *      cannot be stored, the pipeline stops as soon as the reader's read
+ *      returns.
+ ************************/
+const Except_T *scan_pipelined(Scan scan, Pipe_Fill fill, void *cl,
+                               size_t jobs, size_t *end)
+{
+        struct Pipe p;
+        p.fill = fill;
+        p.cl = cl;
+        p.depth = 2 * jobs + 2;
+        p.blocks = CALLOC((long)p.depth, (long)sizeof(Block));
+        p.carry = NULL;
+        p.carry_len = 0;
+        p.carry_cap = 0;
+        p.pos = 0;
+        p.filled = 0;
+        p.claimed = 0;
+        p.eof = 0;
+        p.stop = 0;
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.cond, NULL);
+
+        pthread_t reader;
+        int reading = pthread_create(&reader, NULL, read_blocks, &p) == 0;
+        pthread_t *tids = CALLOC((long)jobs, (long)sizeof(*tids));
+        size_t started = 0;
+        for (size_t t = 0; t < jobs; t++)
+        {
+                if (pthread_create(&tids[started], NULL, scan_blocks,
+                                   &p) == 0)
+                {
+                        started++;
+                }
+        }
+
+        const Except_T *err = NULL;
+        size_t pos = 0;
+        for (size_t seq = 0; err == NULL; seq++)
+        {
+                Block *b = &p.blocks[seq % p.depth];
+                if (!await_block(&p, b, seq, reading))
+                {
+                        break;
+                }
+                for (size_t i = 0; i < b->nlines && err == NULL; i++)
+                {
+                        Line *l = &b->lines[i];
+                        err = store_scanned_line(scan, b->keys + l->key,
+                                                 l->klen, l->hash,
+                                                 b->bytes + l->off, l->width,
+                                                 l->n, b->pos + l->off);
+                }
+                pos = b->pos + b->whole;
+
+                pthread_mutex_lock(&p.lock);
+                b->state = BLOCK_EMPTY;
+                pthread_cond_broadcast(&p.cond);
+                pthread_mutex_unlock(&p.lock);
+        }
+
+        pthread_mutex_lock(&p.lock);
+        p.stop = 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        if (reading)
+        {
+                pthread_join(reader, NULL);
+        }
+        for (size_t t = 0; t < started; t++)
+        {
+                pthread_join(tids[t], NULL);
+        }
+
+        for (size_t i = 0; i < p.depth; i++)
+        {
+                Block *b = &p.blocks[i];
+                scan->stats.allocs += (b->bytes != NULL) +
+                                      (b->keys != NULL) + (b->lines != NULL);
+                scan->stats.alloc_bytes += b->cap + b->keys_cap +
+                                           b->lines_cap * sizeof(Line);
+                FREE(b->bytes);
+                FREE(b->keys);
+                FREE(b->lines);
+        }
+        FREE(p.blocks);
+        FREE(p.carry);
+        FREE(tids);
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+        *end = pos;
+        return err;
+}
+
+/********** await_block ********
+ *
+ * Waits for the seq-th block to be scanned, for the storer. A block no
+ * scanner has taken yet is scanned here rather than waited for, and without
+ * a reader thread the block is read here too.
+ *
+ * Return:
+ *      1 once the block is scanned, 0 if the input ended before it
+ *
+ ************************/
+static int await_block(Pipe p, Block *b, size_t seq, int reading)
+{
+        pthread_mutex_lock(&p->lock);
+        while (b->state != BLOCK_SCANNED)
+        {
+                if (p->filled == seq && p->eof)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        return 0;
+                }
+                if (p->filled == seq && !reading)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        publish(p, b, fill_block(p, b));
+                        pthread_mutex_lock(&p->lock);
+                }
+                else if (b->state == BLOCK_FILLED && p->claimed == seq)
+                {
+                        p->claimed++;
+                        b->state = BLOCK_SCANNING;
+                        pthread_mutex_unlock(&p->lock);
+                        scan_block(b);
+                        pthread_mutex_lock(&p->lock);
+                        b->state = BLOCK_SCANNED;
+                }
+                else
+                {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                }
+        }
+        pthread_mutex_unlock(&p->lock);
+        return 1;
+}
+
+/********** read_blocks ********
+ *
+ * Reader thread body: fills the blocks in ring order as the storer empties
+ * them, until the input ends or the storer stops.
+ *
+ ************************/
+static void *read_blocks(void *cl)
+{
+        Pipe p = cl;
+        for (size_t seq = 0;; seq++)
+        {
+                Block *b = &p->blocks[seq % p->depth];
+                pthread_mutex_lock(&p->lock);
+                while (b->state != BLOCK_EMPTY && !p->stop)
+                {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                }
+                int stop = p->stop;
+                pthread_mutex_unlock(&p->lock);
+                if (stop)
+                {
+                        break;
+                }
+
+                int last = fill_block(p, b);
+                publish(p, b, last);
+                if (last)
+                {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+/********** fill_block ********
+ *
+ * Fills an empty block with the line the last one cut off and as many
+ * whole lines as fit after it. A block is read full and then cut after its
+ * last newline; the rest is carried over to the next block. A block with
+ * no newline at all (one very long line) grows until it has one.
+ *
+ * Return:
+ *      1 if the input ended (the block then ends with whatever is left of
+ *      it, newline or not), 0 if not
+ *
+ ************************/
+static int fill_block(Pipe p, Block *b)
+{
+        size_t cap = p->carry_len < BLOCK_BYTES / 2 ? BLOCK_BYTES
+                                                    : p->carry_len * 2;
+        if (b->cap < cap)
+        {
+                FREE(b->bytes);
+                b->bytes = ALLOC((long)cap);
+                b->cap = cap;
+        }
+        if (p->carry_len > 0)
+        {
+                memcpy(b->bytes, p->carry, p->carry_len);
+        }
+        size_t len = p->carry_len;
+        p->carry_len = 0;
+
+        int last = 0;
+        char *cut = NULL;
+        while (!last && cut == NULL)
+        {
+                while (len < b->cap)
+                {
+                        size_t got = p->fill(p->cl, b->bytes + len,
+                                             b->cap - len);
+                        if (got == 0)
+                        {
+                                last = 1;
+                                break;
+                        }
+                        len += got;
+                }
+                if (!last)
+                {
+                        cut = memrchr(b->bytes, '\n', len);
+                        if (cut == NULL)
+                        {
+                                b->cap *= 2;
+                                RESIZE(b->bytes, (long)b->cap);
+                        }
+                }
+        }
+
+        if (cut != NULL)
+        {
+                size_t keep = (size_t)(cut - b->bytes) + 1;
+                size_t rest = len - keep;
+                if (rest > p->carry_cap)
+                {
+                        FREE(p->carry);
+                        p->carry_cap = rest;
+                        p->carry = ALLOC((long)p->carry_cap);
+                }
+                if (rest > 0)
+                {
+                        memcpy(p->carry, b->bytes + keep, rest);
+                }
+                p->carry_len = rest;
+                len = keep;
+        }
+        b->len = len;
+        b->whole = len;
+        if (last)
+        {
+                char *nl = memrchr(b->bytes, '\n', len);
+                b->whole = nl != NULL ? (size_t)(nl - b->bytes) + 1 : 0;
+        }
+        b->pos = p->pos;
+        p->pos += len;
+        return last;
+}
+
+/********** publish ********
+ *
+ * Hands a block fill_block has filled to the scanners (unless it is empty)
+ * and, after the last one, tells everyone the input is over.
+ *
+ ************************/
+static void publish(Pipe p, Block *b, int last)
+{
+        pthread_mutex_lock(&p->lock);
+        if (b->len > 0)
+        {
+                b->state = BLOCK_FILLED;
+                p->filled++;
+        }
+        if (last)
+        {
+                p->eof = 1;
+        }
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+}
+
+/********** scan_blocks ********
+ *
+ * Scanner thread body: takes filled blocks in ring order and scans them,
+ * until there are no more or the storer stops.
+ *
+ ************************/
+static void *scan_blocks(void *cl)
+{
+        Pipe p = cl;
+        for (;;)
+        {
+                pthread_mutex_lock(&p->lock);
+                while (p->claimed == p->filled && !p->eof && !p->stop)
+                {
+                        pthread_cond_wait(&p->cond, &p->lock);
+                }
+                if (p->stop || p->claimed == p->filled)
+                {
+                        pthread_mutex_unlock(&p->lock);
+                        break;
+                }
+                Block *b = &p->blocks[p->claimed % p->depth];
+                p->claimed++;
+                b->state = BLOCK_SCANNING;
+                pthread_mutex_unlock(&p->lock);
+
+                scan_block(b);
+
+                pthread_mutex_lock(&p->lock);
+                b->state = BLOCK_SCANNED;
+                pthread_cond_broadcast(&p->cond);
+                pthread_mutex_unlock(&p->lock);
+        }
+        return NULL;
+}
+
+/********** scan_block ********
+ *
+ * Splits a block into lines and scans each: its pixels are decoded over
+ * the line itself and its skeleton goes to the block's keys, where it is
+ * hashed. A skeleton is never longer than its line, so keys as long as the
+ * block always have room for the next line's.
+ *
+ ************************/
+static void scan_block(Block *b)
+{
+        if (b->keys_cap < b->len + 1)
+        {
+                FREE(b->keys);
+                b->keys_cap = b->len + 1;
+                b->keys = ALLOC((long)b->keys_cap);
+        }
+        if (b->lines == NULL)
+        {
+                b->lines_cap = BLOCK_LINES;
+                b->lines = ALLOC((long)(b->lines_cap * sizeof(Line)));
+        }
+
+        b->nlines = 0;
+        size_t i = 0;
+        size_t k = 0;
+        while (i < b->len)
+        {
+                char *line = b->bytes + i;
+                char *nl = memchr(line, '\n', b->len - i);
+                size_t n = nl != NULL ? (size_t)(nl - line) + 1 : b->len - i;
+                if (b->nlines == b->lines_cap)
+                {
+                        b->lines_cap *= 2;
+                        RESIZE(b->lines, (long)(b->lines_cap * sizeof(Line)));
+                }
+
+                /* The skeleton is written straight into the keys */
+                struct Skeleton skel = {b->keys + k, 0, b->keys_cap - k};
+                Line *l = &b->lines[b->nlines++];
+                l->off = i;
+                l->n = n;
+                l->key = k;
+                l->klen = 0;
+                l->hash = 0;
+                l->width = scan_row(line, n, line, &skel);
+                if (l->width != SCAN_PIXEL_BAD && l->width != 0)
+                {
+                        l->klen = skel.len;
+                        l->hash = PatTable_hash(skel.bytes, skel.len);
+                        k += skel.len;
+                }
+                i += n;
+        }
+}
@@ -0,0 +1,34 @@
+/* pipeline.h
+ *
+ * Scans a stream that cannot be mapped (a pipe, a decompressor's output) on
+ * several threads at once, without spilling it to disk first:
+ *
+ *      reader     one thread fills large blocks with whole lines
+ *      scanners   N threads take the blocks as they fill and split them into
+ *                 lines, skeletons, skeleton hashes and decoded rows
+ *      storer     the caller's thread stores the rows in the Scan, a block
+ *                 at a time and in input order
+ *
+ * Blocks go round a ring, so memory is bounded by the ring and not by the
+ * input, and the Scan ends up exactly as a single-threaded scan leaves it
+ * (row order, the winner, the line a scan fails on).
+ */
+#ifndef PIPELINE_INCLUDED
+#define PIPELINE_INCLUDED
+
+#include <stddef.h>
+
+#include "except.h"
+#include "engine.h"
+
+/*
+ * Reads up to cap bytes of the input into buf for the reader. Returns the
+ * number of bytes read, 0 only at the end of the input or on an error (the
+ * caller's closure keeps track of which).
+ */
+typedef size_t (*Pipe_Fill)(void *cl, char *buf, size_t cap);
+
+extern const Except_T *scan_pipelined(Scan scan, Pipe_Fill fill, void *cl,
+                                      size_t jobs, size_t *end);
+
+#endif
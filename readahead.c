@@ -0,0 +1,641 @@
+/* readahead.c */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "readahead.h"
+#include "mem.h"
+
+#define T ReadAhead_T
+
+/* The buffer pool: piece k of the file goes in buffer k % BUFS */
+#define BUFS 4
+#define BUF_BYTES (1u << 20)
+
+struct buf
+{
+        char *data;
+        size_t want;  /* bytes of the file this piece holds */
+        size_t got;   /* of those, read so far */
+        int done;     /* the read is finished (or failed) */
+};
+
+#ifdef HAVE_IO_URING
+/* An io_uring instance: the rings shared with the kernel */
+struct uring
+{
+        int fd;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_map;
+        size_t sq_len;
+        void *cq_map;
+        size_t cq_len;
+        size_t sqes_len;
+        unsigned queued;    /* entries not yet handed to the kernel */
+        unsigned inflight;  /* reads queued and not yet completed */
+        int fixed;        /* the buffers are registered */
+};
+#endif
+
+struct T
+{
+        ReadAhead_Kind kind;  /* the backend in use */
+        int fd;
+        size_t size;          /* bytes to read (the size at the start) */
+        size_t pieces;        /* pieces of the file, BUF_BYTES apiece */
+        size_t head;          /* piece the reader takes next */
+        int held;             /* the reader holds piece head - 1 */
+        int error;            /* errno of a failed read, or 0 */
+        struct buf bufs[BUFS];
+#ifdef HAVE_IO_URING
+        struct uring ring;
+#endif
+
+        /* READAHEAD_THREAD: the ring of buffers, under 'lock' */
+        size_t full;          /* pieces read and not yet given back */
+        int finished;         /* the thread has read its last piece */
+        int stop;             /* the reader wants no more */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t tid;
+        int started;          /* the thread runs; produce never reads it */
+};
+
+static void *produce(void *cl);
+static size_t read_piece(T r, struct buf *b);
+#ifdef HAVE_IO_URING
+static int uring_open(T r);
+static void uring_close(T r);
+static void uring_queue(T r, size_t piece);
+static int uring_wait(T r, struct buf *b);
+static int uring_reap(T r);
+#endif
+
+/********** ReadAhead_start ********
+ *
+ * Starts reading a file ahead: queues a read for every buffer (io_uring) or
+ * starts the reading thread.
+ *
+ * Parameters:
+ *      int fd:              the file, read from offset 0; it must stay open
+ *                           until ReadAhead_free
+ *      ReadAhead_Kind kind: the backend wanted
+ *
+ * Return:
+ *      the reader; the file is read with ReadAhead_next
+ *
+ * Notes:
+ *      READAHEAD_URING falls back to READAHEAD_THREAD if no io_uring can be
+ *      set up; READAHEAD_THREAD reads inside ReadAhead_next if no thread
+ *      can be started
+ ************************/
+T ReadAhead_start(int fd, ReadAhead_Kind kind)
+{
+        T r;
+        NEW0(r);
+        r->fd = fd;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+                r->size = (size_t)st.st_size;
+        }
+        r->pieces = (r->size + BUF_BYTES - 1) / BUF_BYTES;
+        for (int i = 0; i < BUFS; i++)
+        {
+                r->bufs[i].data = ALLOC(BUF_BYTES);
+        }
+
+        r->kind = READAHEAD_THREAD;
+#ifdef HAVE_IO_URING
+        if (kind == READAHEAD_URING && uring_open(r) == 0)
+        {
+                r->kind = READAHEAD_URING;
+                for (size_t k = 0; k < BUFS && k < r->pieces; k++)
+                {
+                        uring_queue(r, k);
+                }
+                return r;
+        }
+#else
+        (void)kind;
+#endif
+
+        /*
+         * The lock is set up whether or not the thread starts, and
+         * read_piece takes it by the backend (fixed before the thread can
+         * run), so nothing the thread reads is written after it starts
+         */
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        r->started = pthread_create(&r->tid, NULL, produce, r) == 0;
+        return r;
+}
+
+/********** ReadAhead_next ********
+ *
+ * Gives back the buffer returned by the previous call, if any (io_uring
+ * queues the read of a later piece into it at once), and returns the next
+ * piece of the file, waiting for its read if need be.
+ *
+ * Parameters:
+ *      T r:         the reader
+ *      size_t *len: set to the number of bytes in the buffer
+ *
+ * Return:
+ *      the buffer, which the caller may modify until its next call, or NULL
+ *      once the file is over or a read failed (check ReadAhead_error)
+ *
+ ************************/
+char *ReadAhead_next(T r, size_t *len)
+{
+        *len = 0;
+#ifdef HAVE_IO_URING
+        if (r->kind == READAHEAD_URING)
+        {
+                if (r->held)
+                {
+                        r->held = 0;
+                        if (r->head - 1 + BUFS < r->pieces)
+                        {
+                                uring_queue(r, r->head - 1 + BUFS);
+                        }
+                }
+                if (r->head >= r->pieces || r->error != 0)
+                {
+                        return NULL;
+                }
+                struct buf *b = &r->bufs[r->head % BUFS];
+                if (uring_wait(r, b) != 0 || b->got == 0)
+                {
+                        return NULL;
+                }
+                if (b->got < b->want)
+                {
+                        /* The file shrank: this is its last piece */
+                        r->pieces = r->head + 1;
+                }
+                r->head++;
+                r->held = 1;
+                *len = b->got;
+                return b->data;
+        }
+#endif
+
+        if (!r->started)
+        {
+                /* No thread: read one piece here */
+                struct buf *b = &r->bufs[0];
+                if (r->finished || r->head >= r->pieces)
+                {
+                        return NULL;
+                }
+                b->want = r->size - r->head * BUF_BYTES;
+                if (b->want > BUF_BYTES)
+                {
+                        b->want = BUF_BYTES;
+                }
+                *len = read_piece(r, b);
+                r->head++;
+                r->finished = *len < b->want;
+                return *len > 0 ? b->data : NULL;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        if (r->held)
+        {
+                r->held = 0;
+                r->full--;
+                pthread_cond_broadcast(&r->cond);
+        }
+        while (r->full == 0 && !r->finished)
+        {
+                pthread_cond_wait(&r->cond, &r->lock);
+        }
+        struct buf *b = NULL;
+        if (r->full > 0)
+        {
+                b = &r->bufs[r->head % BUFS];
+                r->head++;
+                r->held = 1;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        *len = b != NULL ? b->got : 0;
+        return b != NULL ? b->data : NULL;
+}
+
+/********** ReadAhead_error ********
+ *
+ * Return:
+ *      the errno of the read that ended the file early, or 0 if it ended at
+ *      its end. Only meaningful once ReadAhead_next has returned NULL.
+ *
+ ************************/
+int ReadAhead_error(T r)
+{
+        if (r->kind == READAHEAD_URING)
+        {
+                return r->error;
+        }
+        pthread_mutex_lock(&r->lock);
+        int error = r->error;
+        pthread_mutex_unlock(&r->lock);
+        return error;
+}
+
+/********** ReadAhead_free ********
+ *
+ * Stops reading, even midway through the file: reads still in flight are
+ * waited for, or the thread is stopped. Frees everything but the file and
+ * sets *r to NULL.
+ *
+ ************************/
+void ReadAhead_free(T *r)
+{
+        T x = *r;
+#ifdef HAVE_IO_URING
+        if (x->kind == READAHEAD_URING)
+        {
+                uring_close(x);
+        }
+#endif
+        if (x->kind == READAHEAD_THREAD)
+        {
+                if (x->started)
+                {
+                        pthread_mutex_lock(&x->lock);
+                        x->stop = 1;
+                        pthread_cond_broadcast(&x->cond);
+                        pthread_mutex_unlock(&x->lock);
+                        pthread_join(x->tid, NULL);
+                }
+                pthread_cond_destroy(&x->cond);
+                pthread_mutex_destroy(&x->lock);
+        }
+        for (int i = 0; i < BUFS; i++)
+        {
+                FREE(x->bufs[i].data);
+        }
+        FREE(*r);
+}
+
+/********** produce ********
+ *
+ * READAHEAD_THREAD body: reads the pieces of the file into free buffers in
+ * ring order until the file ends, a read fails or the reader stops. Pieces
+ * are read outside the lock; the reader only sees a piece once 'full'
+ * counts it.
+ *
+ ************************/
+static void *produce(void *cl)
+{
+        T r = cl;
+        for (size_t k = 0; k < r->pieces; k++)
+        {
+                pthread_mutex_lock(&r->lock);
+                while (r->full == BUFS && !r->stop)
+                {
+                        pthread_cond_wait(&r->cond, &r->lock);
+                }
+                int stop = r->stop;
+                pthread_mutex_unlock(&r->lock);
+                if (stop)
+                {
+                        break;
+                }
+
+                struct buf *b = &r->bufs[k % BUFS];
+                b->want = r->size - k * BUF_BYTES;
+                if (b->want > BUF_BYTES)
+                {
+                        b->want = BUF_BYTES;
+                }
+                size_t got = read_piece(r, b);
+
+                pthread_mutex_lock(&r->lock);
+                if (got > 0)
+                {
+                        r->full++;
+                }
+                int last = got < b->want;
+                pthread_cond_broadcast(&r->cond);
+                pthread_mutex_unlock(&r->lock);
+                if (last)
+                {
+                        break;
+                }
+        }
+
+        pthread_mutex_lock(&r->lock);
+        r->finished = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+}
+
+/********** read_piece ********
+ *
+ * Reads the next b->want bytes of the file into b with read(), carrying on
+ * after short reads and interruptions.
+ *
+ * Return:
+ *      the bytes read: fewer than b->want at an early end of file or on a
+ *      read error (r->error is then set, under the lock for
+ *      READAHEAD_THREAD whether or not its thread started)
+ *
+ ************************/
+static size_t read_piece(T r, struct buf *b)
+{
+        b->got = 0;
+        while (b->got < b->want)
+        {
+                ssize_t n = read(r->fd, b->data + b->got, b->want - b->got);
+                if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (n < 0)
+                {
+                        int error = errno;
+                        if (r->kind == READAHEAD_THREAD)
+                        {
+                                pthread_mutex_lock(&r->lock);
+                        }
+                        r->error = error;
+                        if (r->kind == READAHEAD_THREAD)
+                        {
+                                pthread_mutex_unlock(&r->lock);
+                        }
+                        break;
+                }
+                if (n == 0)
+                {
+                        break;
+                }
+                b->got += (size_t)n;
+        }
+        return b->got;
+}
+
+#ifdef HAVE_IO_URING
+/********** uring_open ********
+ *
+ * Sets up an io_uring with room for a read per buffer, maps its rings and
+ * registers the buffers (reads into unregistered buffers are used if the
+ * kernel will not pin them, e.g. under a low RLIMIT_MEMLOCK).
+ *
+ * Return:
+ *      0, or -1 if io_uring is not available
+ *
+ ************************/
+static int uring_open(T r)
+{
+        struct uring *u = &r->ring;
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        u->fd = (int)syscall(__NR_io_uring_setup, BUFS, &p);
+        if (u->fd < 0)
+        {
+                return -1;
+        }
+
+        u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        u->cq_len = p.cq_off.cqes +
+                    p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+                if (u->cq_len > u->sq_len)
+                {
+                        u->sq_len = u->cq_len;
+                }
+                u->cq_len = 0;
+        }
+        u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd,
+                         IORING_OFF_SQ_RING);
+        u->cq_map = u->cq_len == 0 ? u->sq_map
+                                   : mmap(NULL, u->cq_len,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd,
+                                          IORING_OFF_CQ_RING);
+        void *sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED ||
+            sqes == MAP_FAILED)
+        {
+                if (sqes != MAP_FAILED)
+                {
+                        munmap(sqes, u->sqes_len);
+                }
+                if (u->cq_len > 0 && u->cq_map != MAP_FAILED)
+                {
+                        munmap(u->cq_map, u->cq_len);
+                }
+                if (u->sq_map != MAP_FAILED)
+                {
+                        munmap(u->sq_map, u->sq_len);
+                }
+                close(u->fd);
+                return -1;
+        }
+
+        char *sq = u->sq_map;
+        char *cq = u->cq_map;
+        u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        u->sq_array = (unsigned *)(sq + p.sq_off.array);
+        u->cq_head = (unsigned *)(cq + p.cq_off.head);
+        u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        u->sqes = sqes;
+        u->queued = 0;
+        u->inflight = 0;
+
+        struct iovec iov[BUFS];
+        for (int i = 0; i < BUFS; i++)
+        {
+                iov[i].iov_base = r->bufs[i].data;
+                iov[i].iov_len = BUF_BYTES;
+        }
+        u->fixed = syscall(__NR_io_uring_register, u->fd,
+                           IORING_REGISTER_BUFFERS, iov, BUFS) == 0;
+        return 0;
+}
+
+/********** uring_close ********
+ *
+ * Waits for the reads still in flight (their buffers are about to be
+ * freed), then tears the io_uring down.
+ *
+ ************************/
+static void uring_close(T r)
+{
+        struct uring *u = &r->ring;
+        while (u->inflight > 0)
+        {
+                if (uring_reap(r) != 0)
+                {
+                        /* The kernel cannot be waited on: keep the buffers */
+                        for (int i = 0; i < BUFS; i++)
+                        {
+                                r->bufs[i].data = NULL;
+                        }
+                        break;
+                }
+        }
+        munmap(u->sqes, u->sqes_len);
+        if (u->cq_len > 0)
+        {
+                munmap(u->cq_map, u->cq_len);
+        }
+        munmap(u->sq_map, u->sq_len);
+        close(u->fd);
+}
+
+/********** uring_queue ********
+ *
+ * Queues the read of a piece of the file into its buffer, or of the rest of
+ * it after a short read. The read is handed to the kernel at the next
+ * uring_wait.
+ *
+ ************************/
+static void uring_queue(T r, size_t piece)
+{
+        struct uring *u = &r->ring;
+        struct buf *b = &r->bufs[piece % BUFS];
+        size_t off = piece * BUF_BYTES;
+        if (b->done || b->want == 0)
+        {
+                /* A new piece, rather than the rest of one */
+                b->want = r->size - off < BUF_BYTES ? r->size - off
+                                                    : BUF_BYTES;
+                b->got = 0;
+                b->done = 0;
+        }
+
+        unsigned tail = *u->sq_tail;
+        unsigned idx = tail & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = r->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(b->data + b->got);
+        sqe->len = (unsigned)(b->want - b->got);
+        sqe->off = off + b->got;
+        sqe->buf_index = (uint16_t)(piece % BUFS);
+        sqe->user_data = piece;
+        u->sq_array[idx] = idx;
+
+        /* The kernel must see the entry before the new tail */
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        u->queued++;
+        u->inflight++;
+}
+
+/********** uring_wait ********
+ *
+ * Takes in completions until the read into b is finished.
+ *
+ * Return:
+ *      0, or -1 if a read failed (r->error says why)
+ *
+ ************************/
+static int uring_wait(T r, struct buf *b)
+{
+        while (!b->done)
+        {
+                if (uring_reap(r) != 0)
+                {
+                        return -1;
+                }
+        }
+        return r->error != 0 ? -1 : 0;
+}
+
+/********** uring_reap ********
+ *
+ * Hands queued reads to the kernel, waits for at least one completion and
+ * takes in all there are. A short read has the rest of its piece queued
+ * again; a read that returns nothing ends the piece (the file shrank).
+ *
+ * Return:
+ *      0, or -1 if io_uring_enter failed (r->error says why)
+ *
+ ************************/
+static int uring_reap(T r)
+{
+        struct uring *u = &r->ring;
+        int n = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0)
+        {
+                if (errno == EINTR)
+                {
+                        return 0;
+                }
+                if (r->error == 0)
+                {
+                        r->error = errno;
+                }
+                return -1;
+        }
+        u->queued -= (unsigned)n < u->queued ? (unsigned)n : u->queued;
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+                struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+                size_t piece = (size_t)cqe->user_data;
+                int res = cqe->res;
+                head++;
+                __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+                u->inflight--;
+
+                struct buf *c = &r->bufs[piece % BUFS];
+                if (res == -EINTR || res == -EAGAIN)
+                {
+                        uring_queue(r, piece);
+                }
+                else if (res < 0)
+                {
+                        c->done = 1;
+                        if (r->error == 0)
+                        {
+                                r->error = -res;
+                        }
+                }
+                else
+                {
+                        c->got += (size_t)res;
+                        c->done = res == 0 || c->got == c->want;
+                        if (!c->done)
+                        {
+                                uring_queue(r, piece);
+                        }
+                }
+        }
+        return 0;
+}
+#endif
@@ -0,0 +1,40 @@
+/* readahead.h
+ *
+ * Reads a file ahead of the scanner through a small fixed pool of large
+ * buffers, so that storage latency (a network volume, a busy disk) overlaps
+ * with parsing instead of stalling it on every page fault or read.
+ *
+ *      READAHEAD_URING   io_uring: every buffer the scanner is not holding
+ *                        has a read queued for the next piece of the file,
+ *                        into buffers registered with the kernel once, so
+ *                        several reads are in flight at a time and no
+ *                        thread is needed. Falls back to READAHEAD_THREAD
+ *                        where the kernel (or the build) lacks io_uring.
+ *      READAHEAD_THREAD  a thread calling read() into the next free buffer
+ *
+ * The file is read from offset 0 to the size it had when reading started.
+ */
+#ifndef READAHEAD_INCLUDED
+#define READAHEAD_INCLUDED
+
+#include <stddef.h>
+
+typedef enum ReadAhead_Kind
+{
+        READAHEAD_URING,
+        READAHEAD_THREAD
+} ReadAhead_Kind;
+
+#define T ReadAhead_T
+typedef struct T *T;
+
+extern T ReadAhead_start(int fd, ReadAhead_Kind kind);
+
+extern char *ReadAhead_next(T r, size_t *len);
+
+extern int ReadAhead_error(T r);
+
+extern void ReadAhead_free(T *r);
+
+#undef T
+#endif
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "readaline.h"
 #include "except.h"
@@ -8,6 +10,36 @@
 static const Except_T Readaline_BadArgs = {"readaline: bad arguments"};
 static const Except_T Readaline_ReadErr = {"readaline: read error"};
 
+/* Capacity a buffer allocated for the caller starts with */
+#define CAP_MIN 128
+
+/*
+ * A LineReader reads in blocks: the first BLOCK_MIN bytes, then doubling up
+ * to BLOCK_MAX per read as the stream proves long
+ */
+#define BLOCK_MIN (64u * 1024)
+#define BLOCK_MAX (1u << 20)
+
+/*
+ * Bytes read from the stream but not yet returned. Bytes [start, end) of
+ * 'buf' are pending; [start, scanned) are known to hold no newline.
+ */
+struct LineReader
+{
+        FILE *fp;
+        char *buf;
+        size_t cap;
+        size_t start;
+        size_t scanned;
+        size_t end;
+        size_t block;   /* bytes to ask for on the next read */
+        int eof;
+};
+
+static size_t read_line(FILE *inputfd, char **bufp, size_t *capp);
+static void fit(char **bufp, size_t *capp, size_t used);
+static int fill(LineReader r);
+
 /********** readaline ********
  *
  * Reads one line of bytes from inputfd into a newly allocated buffer.
@@ -27,20 +59,124 @@ size_t readaline(FILE *inputfd, char **datapp)
         }
 
         /* dynamically grow to handle arbitrary-length lines  */
-        size_t cap = 128;
-        char *buf = ALLOC(cap + 1);
+        char *buf = NULL;
+        size_t cap = CAP_MIN;
+        size_t used = read_line(inputfd, &buf, &cap);
+
+        if (ferror(inputfd))
+        {
+                FREE(buf);
+                RAISE(Readaline_ReadErr);
+        }
+
+        if (used == 0)
+        {
+                /* EOF before any bytes */
+                FREE(buf);
+                *datapp = NULL;
+                return 0;
+        }
+
+        *datapp = buf;
+        return used;
+}
+
+/********** readaline_into ********
+ *
+ * Reads one line of bytes from inputfd into a caller-owned buffer, as
+ * getline does. The buffer is kept from call to call and only grown when a
+ * line does not fit, so reading a file costs a handful of allocations rather
+ * than one per line.
+ *
+ * Parameters:
+ *      FILE *inputfd : input stream
+ *      char **bufp   : the buffer; NULL to have one allocated
+ *      size_t *capp  : bytes *bufp holds, not counting room for the NUL;
+ *                      updated when the buffer grows. With *bufp NULL, the
+ *                      size to allocate (0 for the default)
+ *
+ * Returns: The number of bytes read and stored in the buffer, or 0 if EOF.
+ *
+ * Notes:
+ *      the caller FREEs *bufp when done with it, even after a read error.
+ *      The buffer it keeps is the history of line lengths: once grown to
+ *      the longest line so far it is not grown again, and a caller that
+ *      knows its lines are long can say so with *capp on the first call
+ ************************/
+size_t readaline_into(FILE *inputfd, char **bufp, size_t *capp)
+{
+        size_t used = readaline_next(inputfd, bufp, capp);
+        if (used == READALINE_ERROR)
+        {
+                RAISE(Readaline_ReadErr);
+        }
+        return used;
+}
+
+/********** readaline_next ********
+ *
+ * Same as readaline_into, but a read error is returned rather than raised,
+ * so that it can be called where no exception may unwind (another thread,
+ * a loop holding resources).
+ *
+ * Returns: The number of bytes read and stored in the buffer, 0 if EOF, or
+ *          READALINE_ERROR on a read error.
+ *
+ * Notes:
+ *      still RAISEs Readaline_BadArgs for a NULL argument, which is a bug in
+ *      the caller rather than a condition of the input
+ ************************/
+size_t readaline_next(FILE *inputfd, char **bufp, size_t *capp)
+{
+        if (inputfd == NULL || bufp == NULL || capp == NULL)
+        {
+                RAISE(Readaline_BadArgs);
+        }
+
+        if (*bufp == NULL && *capp < CAP_MIN)
+        {
+                *capp = CAP_MIN;
+        }
+        size_t used = read_line(inputfd, bufp, capp);
+        if (ferror(inputfd))
+        {
+                return READALINE_ERROR;
+        }
+        return used;
+}
+
+/********** read_line ********
+ *
+ * Reads bytes up to and including the next newline into *bufp, allocating
+ * it (with room for *capp bytes) if NULL and growing it as needed, and
+ * NUL-terminates them. The bytes come out of the stream's own buffer with
+ * getc_unlocked under one lock for the line, so nothing is read past the
+ * newline and the stream may be closed, or read some other way, at any
+ * time. Read errors are left for the caller to find with ferror.
+ *
+ * Returns: The number of bytes stored, 0 at EOF.
+ *
+ ************************/
+static size_t read_line(FILE *inputfd, char **bufp, size_t *capp)
+{
+        char *buf = *bufp;
+        size_t cap = *capp;
+        if (buf == NULL)
+        {
+                buf = ALLOC(cap + 1);
+        }
         size_t used = 0;
         int ch;
 
         /* Walk through every byte */
-        while ((ch = fgetc(inputfd)) != EOF)
+        flockfile(inputfd);
+        while ((ch = getc_unlocked(inputfd)) != EOF)
         {
                 /* Resize the buffer when full */
                 if (used == cap)
                 {
-                        size_t new_cap = cap * 2;
-                        RESIZE(buf, new_cap + 1);
-                        cap = new_cap;
+                        cap = cap < CAP_MIN ? CAP_MIN : cap * 2;
+                        RESIZE(buf, cap + 1);
                 }
                 buf[used++] = (char)ch;
                 if (ch == '\n')
@@ -48,22 +184,186 @@ size_t readaline(FILE *inputfd, char **datapp)
                         break;
                 }
         }
+        funlockfile(inputfd);
 
-        if (ferror(inputfd))
+        buf[used] = '\0';
+        *bufp = buf;
+        *capp = cap;
+        return used;
+}
+
+/********** LineReader_new ********
+ *
+ * Starts reading a stream in large blocks. The reader owns the bytes it
+ * has read ahead until LineReader_free; the stream stays the caller's.
+ *
+ * Parameters:
+ *      FILE *inputfd : input stream
+ *
+ * Return:
+ *      the new LineReader
+ *
+ * Notes:
+ *      RAISEs Readaline_BadArgs for a NULL stream
+ ************************/
+LineReader LineReader_new(FILE *inputfd)
+{
+        if (inputfd == NULL)
         {
-                FREE(buf);
-                RAISE(Readaline_ReadErr);
+                RAISE(Readaline_BadArgs);
+        }
+
+        LineReader r;
+        NEW(r);
+        r->fp = inputfd;
+        r->buf = NULL;
+        r->cap = 0;
+        r->start = r->scanned = r->end = 0;
+        r->block = BLOCK_MIN;
+        r->eof = 0;
+        return r;
+}
+
+/********** LineReader_free ********
+ *
+ * Discards whatever the reader read ahead and frees it, setting *r to
+ * NULL. The stream is not closed.
+ *
+ * Parameters:
+ *      LineReader *r : address of the reader to free
+ *
+ ************************/
+void LineReader_free(LineReader *r)
+{
+        FREE((*r)->buf);
+        FREE(*r);
+}
+
+/********** LineReader_next ********
+ *
+ * readaline_next from the reader's read-ahead. Newlines are found with
+ * memchr and the read-ahead is refilled in large blocks, so a line costs
+ * one search and one copy however long it is.
+ *
+ * Parameters:
+ *      LineReader r  : the reader
+ *      char **bufp   : the caller's buffer; NULL to have one allocated
+ *      size_t *capp  : bytes *bufp holds, not counting room for the NUL;
+ *                      updated when the buffer grows
+ *
+ * Returns: The number of bytes read and stored in the buffer, 0 if EOF, or
+ *          READALINE_ERROR on a read error.
+ *
+ ************************/
+size_t LineReader_next(LineReader r, char **bufp, size_t *capp)
+{
+        if (r == NULL || bufp == NULL || capp == NULL)
+        {
+                RAISE(Readaline_BadArgs);
         }
 
-        if (used == 0 && ch == EOF)
+        const char *nl;
+        while ((nl = r->scanned < r->end
+                             ? memchr(r->buf + r->scanned, '\n',
+                                      r->end - r->scanned)
+                             : NULL) == NULL)
         {
-                /* EOF before any bytes */
-                FREE(buf);
-                *datapp = NULL;
-                return 0;
+                r->scanned = r->end;
+                if (r->eof || !fill(r))
+                {
+                        break;
+                }
         }
 
-        buf[used] = '\0';
-        *datapp = buf;
+        size_t used = nl != NULL ? (size_t)(nl - r->buf) + 1 - r->start
+                                 : r->end - r->start;
+        fit(bufp, capp, used);
+        if (used > 0)
+        {
+                memcpy(*bufp, r->buf + r->start, used);
+        }
+        (*bufp)[used] = '\0';
+        r->start += used;
+        r->scanned = r->start;
+
+        if (ferror(r->fp))
+        {
+                return READALINE_ERROR;
+        }
         return used;
-}
\ No newline at end of file
+}
+
+/********** fit ********
+ *
+ * Makes sure *bufp holds used bytes and a NUL, allocating it if NULL or
+ * replacing it (its contents are not needed) if too small.
+ *
+ ************************/
+static void fit(char **bufp, size_t *capp, size_t used)
+{
+        if (*bufp != NULL && used <= *capp)
+        {
+                return;
+        }
+        size_t cap = *capp < CAP_MIN ? CAP_MIN : *capp;
+        while (cap < used)
+        {
+                cap *= 2;
+        }
+        FREE(*bufp);
+        *bufp = ALLOC(cap + 1);
+        *capp = cap;
+}
+
+/********** fill ********
+ *
+ * Reads the next block of the stream after the pending bytes, first moving
+ * them to the front of the buffer and growing it if a line has filled it.
+ * The block goes through fread, which reads a request this large straight
+ * into 'buf'; using stdio rather than read(2) keeps bytes the stream had
+ * already buffered and leaves ferror/feof working for the caller.
+ *
+ * Returns: nonzero if any bytes were read; zero at EOF or on error (with
+ *          r->eof set).
+ *
+ ************************/
+static int fill(LineReader r)
+{
+        if (r->start > 0)
+        {
+                size_t pending = r->end - r->start;
+                memmove(r->buf, r->buf + r->start, pending);
+                r->scanned -= r->start;
+                r->end = pending;
+                r->start = 0;
+        }
+        if (r->cap - r->end < r->block)
+        {
+                size_t cap = r->cap == 0 ? r->block : r->cap;
+                while (cap - r->end < r->block)
+                {
+                        cap *= 2;
+                }
+                if (r->buf == NULL)
+                {
+                        r->buf = ALLOC(cap);
+                }
+                else
+                {
+                        RESIZE(r->buf, cap);
+                }
+                r->cap = cap;
+        }
+
+        size_t want = r->block;
+        size_t got = fread(r->buf + r->end, 1, want, r->fp);
+        r->end += got;
+        if (r->block < BLOCK_MAX)
+        {
+                r->block *= 2;
+        }
+
+        /* fread only comes up short at EOF or on an error */
+        r->eof = got < want;
+        return got > 0;
+}
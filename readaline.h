@@ -0,0 +1,48 @@
+/* readaline.h
+ *
+ * Reads input one line at a time; a line is every byte up to and including
+ * the next '\n' (or up to EOF for a last line without one).
+ *
+ *      readaline       returns each line in a newly ALLOCed buffer that the
+ *                      caller FREEs
+ *      readaline_into  reads into a buffer the caller keeps from line to line,
+ *                      growing it only when a line does not fit (as getline);
+ *                      given a NULL buffer, it allocates the capacity the
+ *                      caller passes (0 for a small default), so a caller
+ *                      that knows its line lengths sizes it right at once
+ *      readaline_next  readaline_into, returning READALINE_ERROR on a read
+ *                      error instead of raising, for loops that must not
+ *                      unwind
+ *
+ * All NUL-terminate the line (the terminator is not counted), return 0 at
+ * EOF, and (but for readaline_next) raise Readaline_ReadErr on a read error.
+ * They read no further than the newline, so the stream may be closed or
+ * read some other way between calls.
+ *
+ * A LineReader reads a whole stream, faster: in large blocks, finding each
+ * newline with memchr. The bytes it reads ahead are its own, so a stream
+ * given to one should be read only through it until LineReader_free.
+ */
+#ifndef READALINE_INCLUDED
+#define READALINE_INCLUDED
+
+#include <stdio.h>
+
+/* Returned by readaline_next instead of a length on a read error */
+#define READALINE_ERROR ((size_t)-1)
+
+typedef struct LineReader *LineReader;
+
+size_t readaline(FILE *inputfd, char **datapp);
+
+size_t readaline_into(FILE *inputfd, char **bufp, size_t *capp);
+
+size_t readaline_next(FILE *inputfd, char **bufp, size_t *capp);
+
+LineReader LineReader_new(FILE *inputfd);
+
+size_t LineReader_next(LineReader r, char **bufp, size_t *capp);
+
+void LineReader_free(LineReader *r);
+
+#endif
@@ -16,8 +16,10 @@ int main(int argc, char *argv[])
             return EXIT_FAILURE;
         }
 
-        char *string;
-        while (readaline(fp, &string)) {
+        /* One buffer, reused for every line */
+        char *string = NULL;
+        size_t cap = 0;
+        while (readaline_into(fp, &string, &cap)) {
             char *temp = string;
             while (*temp != '\0') {
                 if (*temp > 31) {
@@ -25,9 +27,8 @@ int main(int argc, char *argv[])
                 }
                 temp++;
             }
-            FREE(string);
-            string = NULL;
         }
+        FREE(string);
         
         fclose(fp);
     }
@@ -1,77 +1,215 @@
 /* restoration.c */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "except.h"
 #include "mem.h"
 #include "seq.h"
-#include "table.h"
 #include "readaline.h"
-#include "atom.h"
+#include "readahead.h"
+#include "linescan.h"
+#include "pattable.h"
+#include "slab.h"
+#include "engine.h"
+#include "input.h"
+#include "serve.h"
 
 /* Exception variables */
 static const Except_T ArgsBad = {"restoration: bad arguments"};
-static const Except_T OpenFail = {"restoration: could not open file"};
-static const Except_T NoInput = {"restoration: no useable rows"};
-static const Except_T WidthBad = {"restoration: inconsistent row widths"};
-static const Except_T PixelBad = {"restoration: pixel out of range (0-255)"};
 static const Except_T WriteFail = {"restoration: write error"};
 
-/* This struct represents one line of the file and its width */
-typedef struct Bucket
+/*
+ * How each failure is reported: its code in the --stats=json "error" object
+ * and the exit status, one per kind of failure so that callers can sort
+ * failures without reading messages. Anything else exits with EXIT_FAILURE.
+ */
+typedef struct Failure
+{
+        const Except_T *err;
+        const char *code;
+        int status;
+} Failure;
+
+static const Failure failures[] = {
+        {&OpenFail, "open_failed", 3},
+        {&ReadFail, "read_failed", 4},
+        {&DecompFail, "decompress_failed", 5},
+        {&NoInput, "no_rows", 6},
+        {&WidthBad, "width_mismatch", 7},
+        {&WriteFail, "write_failed", 8},
+        {&SpillFail, "spill_failed", 9}
+};
+
+/* Smallest raster written by mapping a regular output file */
+#define OUTPUT_MAP_MIN (1u << 20)
+
+/* Command-line options */
+typedef struct Options
+{
+        const char *path; /* input file, or NULL for stdin */
+        int two_pass;     /* --two-pass: bounded-memory mode for files */
+        int lazy;         /* --lazy: spill unmappable input, decode late */
+        size_t jobs;      /* -j N: threads scanning the input, 0 if unset */
+        const char *batch_in;  /* --batch: input directory, "-" for a list */
+        const char *batch_out; /* --batch: output directory */
+        int stats;             /* --stats=json: print a run report */
+        const char *stats_path; /* --stats=json:FILE, or NULL for stderr */
+        const char *spill_dir; /* --spill-dir: where spill files go */
+        size_t spill_limit;    /* --spill-limit: scan bytes kept in memory */
+        size_t prune;          /* --prune[=N]: skeletons tracked, or 0 */
+        unsigned speculate;    /* --speculate=PCT: margin, 0 for never */
+        const char *serve;     /* --serve: the socket to listen on */
+        int read_ahead;        /* --read-ahead: read files ahead */
+        ReadAhead_Kind ra_kind; /* and with what */
+} *Options;
+
+/*
+ * The files of one --batch run, shared by the worker threads. Each worker
+ * takes the next unclaimed file under 'lock' and keeps its own Scan and
+ * raster from one file to the next.
+ */
+typedef struct Batch
 {
-        size_t width;
-        Seq_T rows;
-} *Bucket;
+        Seq_T paths;          /* input file names */
+        int next;             /* index of the next unclaimed file */
+        const char *out_dir;
+        int two_pass;
+        int timed;            /* --stats: time each worker's phases */
+        const char *spill_dir; /* --spill-dir, for each worker's scan */
+        size_t spill_limit;
+        size_t prune;         /* --prune, likewise */
+        unsigned speculate;   /* --speculate, likewise */
+        int read_ahead;       /* --read-ahead, and with what */
+        ReadAhead_Kind ra_kind;
+        struct Stats stats;   /* the workers' stats, summed */
+        pthread_mutex_t lock;
+} *Batch;
+
+/* A regular output file mapped so that rows are decoded straight into it */
+typedef struct OutMap
+{
+        char *map;   /* the mapping, from the page holding 'off' */
+        size_t len;  /* bytes mapped */
+        int fd;
+        off_t end;   /* file offset just past the image */
+} *OutMap;
+
+static void parse_args(int argc, char *argv[], Options opts);
+
+static size_t parse_size(const char *arg);
+
+static void print_stats(Options opts, Stats st, const Except_T *err,
+                        Fault fault);
+
+static int fail(Options opts, const Except_T *err, Stats st, Fault fault);
+
+static const Failure *find_failure(const Except_T *err);
 
-static void run(FILE *in);
+static int run(Source src, Options opts);
 
-static const char *make_pattern_key(const char *line, size_t n);
+static int run_batch(Options opts);
 
-static size_t compact_digits_to_bytes(char *buf, size_t n);
+static Seq_T list_inputs(const char *in);
 
-static void free_bucket_cb(const void *k, void **v, void *cl);
+static int compare_names(const void *a, const void *b);
 
-static void obtain_sequence(FILE *in, Table_T buckets, const char **best_key,
-                            size_t *best_count);
+static void *batch_worker(void *cl);
 
-static void store_sequence(Table_T buckets, const char *key, char *row_buf,
-                           size_t row_width, const char **best_key,
-                           size_t *best_count);
+static const Except_T *restore_file(const char *in_path, const char *out_path,
+                                    Scan scan, char **raster, size_t *cap,
+                                    Batch batch, Stats total, Fault fault);
+
+static int run_serve(Options opts);
+
+static int write_image(FILE *out, Source src, Scan scan, char **raster,
+                       size_t *cap, int threaded);
+
+static char *map_output(int fd, const char *header, size_t hlen,
+                        size_t raster_len, OutMap om);
+
+static int unmap_output(OutMap om);
+
+static int write_spilled(int fd, struct iovec *header, Scan scan,
+                         Bucket win);
+
+static int copy_spilled(int in, off_t off, size_t len, int out);
+
+static int emit_second_pass(FILE *out, Source src, Scan scan);
 
 /********** main ********
+ *
+ * Usage: restoration [--two-pass] [--lazy] [--prune[=N] | -j N]
+ *                   [--stats=json[:FILE]]
+ *                   [--spill-dir DIR [--spill-limit SIZE]] [pgmFile]
+ *        restoration --read-ahead[=thread] [--stats=json[:FILE]]
+ *                    [--spill-dir DIR [--spill-limit SIZE]] [pgmFile]
+ *        restoration [--two-pass | --read-ahead[=thread]] [--prune[=N]]
+ *                    [-j N] [--stats=json[:FILE]]
+ *                    [--spill-dir DIR [--spill-limit SIZE]]
+ *                    --batch inDir|- outDir
+ *        restoration [-j N] [--read-ahead[=thread]] [--stats=json[:FILE]]
+ *                    --serve socketPath
+ *
+ *        Each form also takes --speculate=PCT (default 50, 0 for off).
  *
  * Parameters:
  *      int argc:     number of arguments given in the command-line
  *      char *argv[]: array that stores all the arguments
  *
  * Return:
- *      true if all scores are under limit, false if not
+ *      EXIT_SUCCESS; if the input cannot be restored, the exit status for
+ *      the reason (see failures); EXIT_FAILURE if a --batch file could not
+ *      be restored (--serve returns once a client asks it to quit)
  *
  * Expects:
  *      a filename given in the command-line or stdin
  * Notes:
- *      CRE if more than one argument given, input file cannot be opened, error
- *      encountered reading file, memory allocation fails
+ *      an input that cannot be restored is reported on stderr with the line
+ *      and byte offset the scan stopped at (see fail). CRE if more than one
+ *      file or an unknown option is given or memory allocation fails. In
+ *      --batch mode a bad file is reported on stderr and skipped.
  ************************/
 int main(int argc, char *argv[])
 {
-        if (argc > 2)
+        struct Options opts;
+        parse_args(argc, argv, &opts);
+
+        /* Pick the scan kernel now, before any thread might */
+        scan_select(SCAN_AUTO);
+
+        if (opts.batch_in != NULL)
         {
-                RAISE(ArgsBad);
+                return run_batch(&opts);
+        }
+        if (opts.serve != NULL)
+        {
+                return run_serve(&opts);
         }
 
         FILE *in = NULL;
 
         /* Filename is given in command-line */
-        if (argc == 2)
+        if (opts.path != NULL)
         {
-                in = fopen(argv[1], "rb");
+                in = fopen(opts.path, "rb");
                 if (in == NULL)
                 {
-                        RAISE(OpenFail);
+                        return fail(&opts, &OpenFail, NULL, NULL);
                 }
         }
         else
@@ -79,9 +217,402 @@ int main(int argc, char *argv[])
                 in = stdin;
         }
 
-        run(in);
+        struct Source src = {in, NULL, 0, 0, NULL, NULL, 0, NULL};
+        open_input(in, &src, opts.read_ahead, opts.ra_kind);
+        open_compressed(&src);
+        if (opts.lazy && src.map == NULL)
+        {
+                const Except_T *err = spill_input(&src, opts.spill_dir);
+                if (err != NULL)
+                {
+                        close_input(&src);
+                        return fail(&opts, err, NULL, NULL);
+                }
+        }
+        return run(&src, &opts);
+}
+
+/********** parse_args ********
+ *
+ * Fills in the options from the command line.
+ *
+ * Parameters:
+ *      int argc:     number of arguments given in the command-line
+ *      char *argv[]: array that stores all the arguments
+ *      Options opts: the options to fill in
+ *
+ * Return:
+ *      none
+ *
+ * Notes:
+ *      CRE (ArgsBad) on an unknown option or more than one file name
+ ************************/
+static void parse_args(int argc, char *argv[], Options opts)
+{
+        opts->path = NULL;
+        opts->two_pass = 0;
+        opts->lazy = 0;
+        opts->jobs = 0;
+        opts->batch_in = NULL;
+        opts->batch_out = NULL;
+        opts->stats = 0;
+        opts->stats_path = NULL;
+        opts->spill_dir = NULL;
+        opts->spill_limit = SPILL_LIMIT_DEFAULT;
+        opts->prune = 0;
+        opts->speculate = SPEC_MARGIN_DEFAULT;
+        opts->serve = NULL;
+        opts->read_ahead = 0;
+        opts->ra_kind = READAHEAD_URING;
+
+        for (int i = 1; i < argc; i++)
+        {
+                if (strcmp(argv[i], "--two-pass") == 0)
+                {
+                        opts->two_pass = 1;
+                }
+                else if (strcmp(argv[i], "--lazy") == 0)
+                {
+                        opts->lazy = 1;
+                }
+                else if (strcmp(argv[i], "--read-ahead") == 0 ||
+                         strcmp(argv[i], "--read-ahead=uring") == 0)
+                {
+                        opts->read_ahead = 1;
+                        opts->ra_kind = READAHEAD_URING;
+                }
+                else if (strcmp(argv[i], "--read-ahead=thread") == 0)
+                {
+                        opts->read_ahead = 1;
+                        opts->ra_kind = READAHEAD_THREAD;
+                }
+                else if (strncmp(argv[i], "--stats=json", 12) == 0)
+                {
+                        /* --stats=json to stderr, --stats=json:FILE to FILE */
+                        const char *rest = argv[i] + 12;
+                        if (rest[0] == ':' && rest[1] != '\0')
+                        {
+                                opts->stats_path = rest + 1;
+                        }
+                        else if (rest[0] != '\0')
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->stats = 1;
+                }
+                else if (strcmp(argv[i], "--spill-dir") == 0)
+                {
+                        if (i + 1 >= argc)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->spill_dir = argv[++i];
+                }
+                else if (strcmp(argv[i], "--spill-limit") == 0)
+                {
+                        if (i + 1 >= argc)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->spill_limit = parse_size(argv[++i]);
+                }
+                else if (strcmp(argv[i], "--prune") == 0)
+                {
+                        opts->prune = PRUNE_CAP_DEFAULT;
+                }
+                else if (strncmp(argv[i], "--prune=", 8) == 0)
+                {
+                        /* At least two, so that pruning keeps one */
+                        opts->prune = parse_size(argv[i] + 8);
+                        if (opts->prune < 2)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                }
+                else if (strncmp(argv[i], "--speculate=", 12) == 0)
+                {
+                        /* A percentage; 0 turns speculation off */
+                        const char *num = argv[i] + 12;
+                        char *end;
+                        if (num[0] < '0' || num[0] > '9')
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        unsigned long pct = strtoul(num, &end, 10);
+                        if (*end != '\0' || pct > 100)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->speculate = (unsigned)pct;
+                }
+                else if (strcmp(argv[i], "--batch") == 0)
+                {
+                        if (i + 2 >= argc)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->batch_in = argv[++i];
+                        opts->batch_out = argv[++i];
+                }
+                else if (strcmp(argv[i], "--serve") == 0)
+                {
+                        if (i + 1 >= argc)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->serve = argv[++i];
+                        if (strlen(opts->serve) > SERVE_SOCKET_MAX)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                }
+                else if (strncmp(argv[i], "-j", 2) == 0)
+                {
+                        /* Either -jN or -j N */
+                        const char *num = argv[i][2] != '\0' ? argv[i] + 2
+                                                             : argv[++i];
+                        char *end;
+                        if (num == NULL || num[0] < '1' || num[0] > '9')
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        unsigned long j = strtoul(num, &end, 10);
+                        if (*end != '\0' || j > MAX_JOBS)
+                        {
+                                RAISE(ArgsBad);
+                        }
+                        opts->jobs = j;
+                }
+                else if (argv[i][0] == '-' && argv[i][1] != '\0')
+                {
+                        RAISE(ArgsBad);
+                }
+                else if (opts->path != NULL)
+                {
+                        RAISE(ArgsBad);
+                }
+                else
+                {
+                        opts->path = argv[i];
+                }
+        }
+
+        /* A batch takes its files from the directory or list only */
+        if (opts->batch_in != NULL && opts->path != NULL)
+        {
+                RAISE(ArgsBad);
+        }
+
+        /* A server takes its inputs from its clients only */
+        if (opts->serve != NULL && (opts->path != NULL ||
+                                    opts->batch_in != NULL))
+        {
+                RAISE(ArgsBad);
+        }
+
+        /*
+         * Read-ahead streams the file once; the modes that map it to go
+         * over it again or split it between threads cannot use it
+         */
+        if (opts->read_ahead &&
+            (opts->two_pass || (opts->batch_in == NULL &&
+                                opts->serve == NULL &&
+                                (opts->lazy || opts->jobs > 1))))
+        {
+                RAISE(ArgsBad);
+        }
 
-        return 0;
+        /* The pieces of a -j scan are merged by exact counts */
+        if (opts->prune > 0 && opts->batch_in == NULL && opts->jobs > 1)
+        {
+                RAISE(ArgsBad);
+        }
+}
+
+/********** parse_size ********
+ *
+ * Reads a byte count such as 512K, 64M or 2G (powers of 1024) for
+ * --spill-limit.
+ *
+ * Parameters:
+ *      const char *arg: the argument
+ *
+ * Return:
+ *      the number of bytes
+ *
+ * Notes:
+ *      CRE (ArgsBad) if arg is not a number with an optional K, M or G
+ ************************/
+static size_t parse_size(const char *arg)
+{
+        char *end;
+        if (arg[0] < '0' || arg[0] > '9')
+        {
+                RAISE(ArgsBad);
+        }
+        unsigned long long n = strtoull(arg, &end, 10);
+        int shift = 0;
+        if (*end == 'K' || *end == 'k')
+        {
+                shift = 10;
+        }
+        else if (*end == 'M' || *end == 'm')
+        {
+                shift = 20;
+        }
+        else if (*end == 'G' || *end == 'g')
+        {
+                shift = 30;
+        }
+        if (shift != 0)
+        {
+                end++;
+        }
+        if (*end != '\0' || n > (SIZE_MAX >> shift))
+        {
+                RAISE(ArgsBad);
+        }
+        return (size_t)n << shift;
+}
+
+/********** print_stats ********
+ *
+ * Writes the --stats=json report: one JSON object on one line, to stderr or
+ * to the file named by --stats=json:FILE.
+ *
+ * Parameters:
+ *      Options opts:        the command-line options
+ *      Stats st:            the stats of the run
+ *      const Except_T *err: why the input could not be restored, or NULL
+ *      Fault fault:         where the scan stopped, or NULL if not known
+ *
+ * Return:
+ *      none
+ *
+ * Notes:
+ *      for --batch the counters and times are summed over every file (times
+ *      over every worker, so they can exceed the wall-clock time). Peak RSS
+ *      is the whole process's. A failed run has an "error" object, e.g.
+ *        {"code": "width_mismatch", "exit_status": 7, "reason": "...",
+ *         "line": 12, "offset": 345}
+ *      ("line" and "offset" are null if not known); otherwise "error" is
+ *      null. CRE (OpenFail) if FILE cannot be created.
+ ************************/
+static void print_stats(Options opts, Stats st, const Except_T *err,
+                        Fault fault)
+{
+        FILE *out = stderr;
+        if (opts->stats_path != NULL)
+        {
+                out = fopen(opts->stats_path, "w");
+                if (out == NULL)
+                {
+                        RAISE(OpenFail);
+                }
+        }
+
+        /* ru_maxrss is in kilobytes on Linux */
+        struct rusage ru;
+        long rss_kb = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+        double share = st->lines > 0 ? (double)st->win_rows
+                                               / (double)st->lines
+                                     : 0;
+
+        char error[512] = "null";
+        if (err != NULL)
+        {
+                char line[32] = "null";
+                char offset[32] = "null";
+                if (fault != NULL && fault->err != NULL && fault->line > 0)
+                {
+                        snprintf(line, sizeof(line), "%zu", fault->line);
+                        snprintf(offset, sizeof(offset), "%zu",
+                                 fault->offset);
+                }
+                const Failure *f = find_failure(err);
+                snprintf(error, sizeof(error), "{\"code\": \"%s\", "
+                         "\"exit_status\": %d, \"reason\": \"%s\", "
+                         "\"line\": %s, \"offset\": %s}", f->code,
+                         f->status, err->reason, line, offset);
+        }
+
+        fprintf(out, "{\"files\": %zu, \"failed\": %zu, "
+                     "\"bytes_read\": %zu, \"lines_read\": %zu, "
+                     "\"rows_rejected_pixelbad\": %zu, "
+                     "\"rows_skipped_nopixels\": %zu, \"buckets\": %zu, "
+                     "\"winner_rows\": %zu, \"winner_share\": %.6f, "
+                     "\"allocs\": %zu, \"alloc_bytes\": %zu, "
+                     "\"spill_bytes\": %zu, \"buckets_pruned\": %zu, "
+                     "\"prune_rescans\": %zu, \"rows_speculated\": %zu, "
+                     "\"peak_rss_bytes\": %zu, "
+                     "\"seconds\": {\"scan\": %.6f, \"key\": %.6f, "
+                     "\"decode\": %.6f, \"output\": %.6f, "
+                     "\"teardown\": %.6f}, \"error\": %s}\n",
+                st->files, st->failed, st->bytes, st->lines, st->rejected,
+                st->empty, st->buckets, st->win_rows, share, st->allocs,
+                st->alloc_bytes, st->spill_bytes, st->evicted, st->rescans,
+                st->speculated, (size_t)rss_kb * 1024,
+                st->scan_s, st->key_s,
+                st->decode_s, st->output_s, st->teardown_s, error);
+
+        if (out != stderr)
+        {
+                fclose(out);
+        }
+}
+
+/********** fail ********
+ *
+ * Reports why the input could not be restored: one line on stderr with the
+ * reason and, if the scan got that far, where it stopped, e.g.
+ *
+ *   restoration: inconsistent row widths (line 12, byte 345)
+ *
+ * and, with --stats=json, the report with its "error" object.
+ *
+ * Parameters:
+ *      Options opts:        the command-line options
+ *      const Except_T *err: what went wrong
+ *      Stats st:            the stats of the run so far, or NULL
+ *      Fault fault:         where the scan stopped, or NULL if not known
+ *
+ * Return:
+ *      the exit status for err (see failures)
+ *
+ ************************/
+static int fail(Options opts, const Except_T *err, Stats st, Fault fault)
+{
+        char where[64];
+        format_where(where, sizeof(where), fault);
+        fprintf(stderr, "%s%s\n", err->reason, where);
+        if (opts->stats)
+        {
+                struct Stats none;
+                memset(&none, 0, sizeof(none));
+                none.failed = 1;
+                print_stats(opts, st != NULL ? st : &none, err, fault);
+        }
+        return find_failure(err)->status;
+}
+
+/********** find_failure ********
+ *
+ * Return:
+ *      how err is reported: its entry in failures, or one with the code
+ *      "error" and EXIT_FAILURE
+ *
+ ************************/
+static const Failure *find_failure(const Except_T *err)
+{
+        static const Failure other = {NULL, "error", EXIT_FAILURE};
+        for (size_t i = 0; i < sizeof(failures) / sizeof(failures[0]); i++)
+        {
+                if (failures[i].err == err)
+                {
+                        return &failures[i];
+                }
+        }
+        return &other;
 }
 
 /********** run ********
@@ -89,288 +620,861 @@ int main(int argc, char *argv[])
  * Runs the restoration program.
  *
  * Parameters:
- *      FILE *in: a pointer to a file object (hacked PGM file)
+ *      Source src:   the input (hacked PGM file), mapped or streamed
+ *      Options opts: the command-line options
  *
  * Return:
- *      none
+ *      EXIT_SUCCESS, or the exit status fail gives the reason the input
+ *      could not be restored
  *
  * Expects:
  *      a hacked PGM file to be restored
  *
+ * Notes:
+ *      with --two-pass and a mapped input, the first pass only counts rows
+ *      per pattern and the second decodes and writes the winner's rows, so
+ *      memory is bounded by the pattern table rather than the input. Other
+ *      inputs cannot be read twice and take the normal path (unless --lazy
+ *      spilled them to a mapped temporary file first). With -j N, a mapped
+ *      input is cut into pieces scanned side by side, and any other goes
+ *      through the pipeline of scan_input_piped.
  ************************/
-static void run(FILE *in)
+static int run(Source src, Options opts)
 {
-        /* Create a Hanson table */
-        Table_T buckets = Table_new(0, NULL, NULL);
-
-        /*
-         * Variables to keep track of the key (Atom) in the Table that 
-         * corresponds to the original lines (for later use)
-         */
-        const char *best_key = NULL;
-        size_t best_count = 0;
+        struct Scan scan;
+        init_scan(&scan, src->map != NULL ? src->len : 0,
+                  opts->two_pass && src->map != NULL);
+        scan.timed = opts->stats;
+        scan.spill_dir = opts->spill_dir;
+        scan.spill_limit = opts->spill_limit;
+        scan.prune_cap = opts->prune;
+        scan.spec_margin = opts->speculate;
+        scan.may_spill = src->map == NULL;
+        double t0 = opts->stats ? scan_clock() : 0;
 
         /* Go through each line of the file and obtain/store relevant info */
-        obtain_sequence(in, buckets, &best_key, &best_count);
+        const Except_T *err = NULL;
+        if (src->map != NULL && opts->jobs > 1)
+        {
+                err = scan_parallel(&scan, src->map, src->pos, src->len,
+                                    opts->jobs);
+        }
+        else if (src->map == NULL && opts->jobs > 1)
+        {
+                err = scan_input_piped(src, &scan, opts->jobs);
+        }
+        else
+        {
+                err = scan_input(src, &scan);
+        }
+        if (opts->stats)
+        {
+                scan.stats.scan_s = scan_clock() - t0;
+        }
+        if (err == NULL && scan.best == NULL)
+        {
+                err = &NoInput;
+        }
 
-        if (in != stdin)
+        char *raster = NULL;
+        size_t cap = 0;
+        if (err == NULL &&
+            write_image(stdout, src, &scan, &raster, &cap, 1) != 0)
         {
-                fclose(in);
+                err = &WriteFail;
         }
-        if (best_key == NULL)
+
+        /* Free memory */
+        struct Stats st = scan.stats;
+        struct Fault fault = scan.fault;
+        st.buckets = PatTable_length(scan.buckets);
+        st.win_rows = scan.best_count;
+        st.files = err == NULL;
+        st.failed = err != NULL;
+        double t1 = opts->stats ? scan_clock() : 0;
+        FREE(raster);
+        free_scan(&scan);
+        close_input(src);
+        if (opts->stats)
         {
-                RAISE(NoInput);
+                st.teardown_s = scan_clock() - t1;
         }
 
-        /* Go to the value of the Table that stores the restored lines */
-        Bucket win = Table_get(buckets, best_key);
-        size_t W = win->width;
-        size_t H = Seq_length(win->rows);
+        if (err != NULL)
+        {
+                return fail(opts, err, &st, &fault);
+        }
+        if (opts->stats)
+        {
+                print_stats(opts, &st, NULL, NULL);
+        }
+        return EXIT_SUCCESS;
+}
+
+/********** run_batch ********
+ *
+ * Restores every file of a --batch run within this one process, writing
+ * each image to outDir/<name>.out. Files are handed out to a pool of worker
+ * threads (-j N of them, or one per CPU), and each worker reuses its pattern
+ * table, slab and raster from file to file, so the per-file cost is the
+ * scan itself rather than process start-up and allocator warm-up.
+ *
+ * Parameters:
+ *      Options opts: the command-line options
+ *
+ * Return:
+ *      EXIT_SUCCESS if every file was restored, EXIT_FAILURE otherwise
+ *
+ * Notes:
+ *      a file that cannot be restored is reported on stderr as
+ *      "<reason>: <file>", followed by " (line N, byte M)" if the scan
+ *      stopped on a line, and skipped; no output is left for it
+ ************************/
+static int run_batch(Options opts)
+{
+        struct Batch batch;
+        batch.paths = list_inputs(opts->batch_in);
+        batch.next = 0;
+        batch.out_dir = opts->batch_out;
+        batch.two_pass = opts->two_pass;
+        batch.timed = opts->stats;
+        batch.spill_dir = opts->spill_dir;
+        batch.spill_limit = opts->spill_limit;
+        batch.prune = opts->prune;
+        batch.speculate = opts->speculate;
+        batch.read_ahead = opts->read_ahead;
+        batch.ra_kind = opts->ra_kind;
+        memset(&batch.stats, 0, sizeof(batch.stats));
+        pthread_mutex_init(&batch.lock, NULL);
 
-        /* Print the header of the PGM 5 image */
-        if (printf("P5\n%zu %zu\n255\n", W, H) < 0)
+        size_t nthreads = opts->jobs;
+        if (nthreads == 0)
         {
-                RAISE(WriteFail);
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = cpus > 0 ? (size_t)cpus : 1;
         }
+        if (nthreads > MAX_JOBS)
+                nthreads = MAX_JOBS;
+        if (nthreads > (size_t)Seq_length(batch.paths))
+                nthreads = (size_t)Seq_length(batch.paths);
 
-        /* Walk through each element of the sequence (each line of the pgm )*/
-        for (size_t r = 0; r < H; r++)
+        /* This thread is a worker too; so is it for any failed start */
+        pthread_t tids[MAX_JOBS];
+        int started[MAX_JOBS];
+        for (size_t t = 1; t < nthreads; t++)
         {
-                char *row = Seq_get(win->rows, (int)r);
-                size_t wrote = fwrite(row, 1, W, stdout);
-                if (wrote != W)
+                started[t] = pthread_create(&tids[t], NULL, batch_worker,
+                                            &batch) == 0;
+        }
+        batch_worker(&batch);
+        for (size_t t = 1; t < nthreads; t++)
+        {
+                if (started[t])
                 {
-                        RAISE(WriteFail);
+                        pthread_join(tids[t], NULL);
                 }
         }
 
-        /* Free memory */
-        Table_map(buckets, free_bucket_cb, NULL);
-        Table_free(&buckets);
+        while (Seq_length(batch.paths) > 0)
+        {
+                char *path = Seq_remhi(batch.paths);
+                FREE(path);
+        }
+        Seq_free(&batch.paths);
+        pthread_mutex_destroy(&batch.lock);
+
+        if (opts->stats)
+        {
+                print_stats(opts, &batch.stats, NULL, NULL);
+        }
+        return batch.stats.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-/********** obtain_sequence ********
+/********** list_inputs ********
  *
- * Parses non-digit sequence and store restored digit bytes into Table from
- *   each line.
+ * Collects the input files of a --batch run: the regular files of a
+ * directory, in name order and skipping dot files, or, when 'in' is "-",
+ * the file names listed one per line on stdin.
  *
  * Parameters:
- *      FILE *in:              pointer to the file to be read
- *      Table_T buckets:       the Table that will store all the lines
- *      const char **best_key: address of the pointer to the key in the Table
- *                               that will store the restored lines
- *      size_t *best_count:    address of the variable that will store the
- *                               number of lines in the restored file
+ *      const char *in: the input directory, or "-"
  *
- * Return: none
+ * Return:
+ *      a Seq_T of ALLOCed path strings
  *
+ * Notes:
+ *      CRE (OpenFail) if the directory cannot be opened
  ************************/
-static void obtain_sequence(FILE *in, Table_T buckets,
-                            const char **best_key, size_t *best_count)
+static Seq_T list_inputs(const char *in)
 {
-        while (1)
+        Seq_T paths = Seq_new(0);
+
+        if (strcmp(in, "-") == 0)
         {
                 char *line = NULL;
-                size_t n = readaline(in, &line);
-                if (n == 0)
-                        break;
+                size_t cap = 0;
+                size_t n;
+                while ((n = readaline_into(stdin, &line, &cap)) > 0)
+                {
+                        /* Drop the line ending, CRLF included */
+                        while (n > 0 && (line[n - 1] == '\n' ||
+                                         line[n - 1] == '\r'))
+                        {
+                                n--;
+                        }
+                        if (n > 0)
+                        {
+                                char *path = ALLOC((long)n + 1);
+                                memcpy(path, line, n);
+                                path[n] = '\0';
+                                Seq_addhi(paths, path);
+                        }
+                }
+                FREE(line);
+                return paths;
+        }
 
-                const char *key = make_pattern_key(line, n);
+        DIR *dir = opendir(in);
+        if (dir == NULL)
+        {
+                RAISE(OpenFail);
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+                if (ent->d_name[0] == '.')
+                {
+                        continue;
+                }
+                char *path = ALLOC((long)(strlen(in) + strlen(ent->d_name)
+                                          + 2));
+                sprintf(path, "%s/%s", in, ent->d_name);
+                struct stat st;
+                if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+                {
+                        FREE(path);
+                        continue;
+                }
+                Seq_addhi(paths, path);
+        }
+        closedir(dir);
 
-                size_t row_w = 0;
-                int skip = 0;
+        /* Restore in name order, whatever order readdir returned */
+        int n = Seq_length(paths);
+        char **names = ALLOC((long)(n > 0 ? n : 1) * (long)sizeof(*names));
+        for (int i = 0; i < n; i++)
+        {
+                names[i] = Seq_remlo(paths);
+        }
+        qsort(names, (size_t)n, sizeof(*names), compare_names);
+        for (int i = 0; i < n; i++)
+        {
+                Seq_addhi(paths, names[i]);
+        }
+        FREE(names);
+        return paths;
+}
 
-                /* Parse digits -> bytes in place; skip row if any pix > 255 */
-                TRY
+/********** compare_names ********
+ *
+ * qsort comparison for two path strings.
+ *
+ ************************/
+static int compare_names(const void *a, const void *b)
+{
+        return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/********** batch_worker ********
+ *
+ * Thread body for run_batch: restores files until none are left unclaimed.
+ * The Scan, its skeleton buffer and the output raster live as long as the
+ * worker and are only reset between files.
+ *
+ * Notes:
+ *      runs without a Hanson exception frame: a bad file is reported through
+ *      restore_file's result, while allocation and read failures are still
+ *      CREs
+ ************************/
+static void *batch_worker(void *cl)
+{
+        Batch batch = cl;
+        struct Scan scan;
+        init_scan(&scan, 0, 0);
+        scan.timed = batch->timed;
+        scan.spill_dir = batch->spill_dir;
+        scan.spill_limit = batch->spill_limit;
+        scan.prune_cap = batch->prune;
+        scan.spec_margin = batch->speculate;
+        struct Stats total;
+        memset(&total, 0, sizeof(total));
+        char *raster = NULL;
+        size_t cap = 0;
+        char *out_path = NULL;
+        size_t out_cap = 0;
+
+        while (1)
+        {
+                pthread_mutex_lock(&batch->lock);
+                int i = batch->next;
+                if (i < Seq_length(batch->paths))
                 {
-                        row_w = compact_digits_to_bytes(line, n);
+                        batch->next++;
                 }
-                EXCEPT(PixelBad)
+                pthread_mutex_unlock(&batch->lock);
+                if (i >= Seq_length(batch->paths))
                 {
-                        skip = 1;
+                        break;
                 }
-                END_TRY;
 
-                if (skip || row_w == 0)
+                /* outDir/<name>.out, as the per-file scripts wrote */
+                const char *path = Seq_get(batch->paths, i);
+                const char *base = strrchr(path, '/');
+                base = base != NULL ? base + 1 : path;
+                size_t need = strlen(batch->out_dir) + strlen(base)
+                              + sizeof("/.out");
+                if (need > out_cap)
                 {
-                        FREE(line);
-                        continue;
+                        FREE(out_path);
+                        out_cap = need;
+                        out_path = ALLOC((long)out_cap);
                 }
+                sprintf(out_path, "%s/%s.out", batch->out_dir, base);
 
-                RESIZE(line, row_w);
-                store_sequence(buckets, key, line, row_w, best_key, best_count);
-                /* ownership of 'line' transferred into the bucket */
+                struct Fault fault;
+                const Except_T *err = restore_file(path, out_path, &scan,
+                                                   &raster, &cap, batch,
+                                                   &total, &fault);
+                if (err != NULL)
+                {
+                        char where[64];
+                        format_where(where, sizeof(where), &fault);
+                        fprintf(stderr, "%s: %s%s\n", err->reason, path,
+                                where);
+                }
         }
+
+        FREE(out_path);
+        FREE(raster);
+        free_scan(&scan);
+
+        pthread_mutex_lock(&batch->lock);
+        add_stats(&batch->stats, &total);
+        pthread_mutex_unlock(&batch->lock);
+        return NULL;
 }
 
-/********** make_pattern_key ********
+/********** restore_file ********
  *
- * Parses the non-digit sequence out of the line and store it in an Atom
+ * Restores one file of a batch into out_path using a worker's Scan, which is
+ * reset again before returning.
  *
  * Parameters:
- *      const char *line: a line from the file
- *      size_t n:         the length of the line
+ *      const char *in_path:  the hacked PGM file
+ *      const char *out_path: where the restored image goes
+ *      Scan scan:            the worker's (empty) scan state
+ *      char **raster:        the worker's raster, grown as needed
+ *      size_t *cap:          bytes *raster has room for
+ *      Batch batch:          the batch, for its --two-pass and
+ *                            --read-ahead settings
+ *      Stats total:          the worker's stats, which this file's are
+ *                            added to
+ *      Fault fault:          receives where the scan stopped, if it did
  *
  * Return:
- *      return the Atom storing the non-digit sequence which will act as a key
- *      to the Table
+ *      NULL on success, or the exception describing why the file could not
+ *      be restored (nothing is RAISEd, as this runs off the main thread)
  *
  ************************/
-static const char *make_pattern_key(const char *line, size_t n)
+static const Except_T *restore_file(const char *in_path, const char *out_path,
+                                    Scan scan, char **raster, size_t *cap,
+                                    Batch batch, Stats total, Fault fault)
 {
-        /* String to store the nondigit bytes */
-        char *tmp = ALLOC(n + 1);
-        /* Variable to keep track of the number of nondigit bytes */
-        size_t out = 0;
+        memset(fault, 0, sizeof(*fault));
+        FILE *in = fopen(in_path, "rb");
+        if (in == NULL)
+        {
+                total->failed++;
+                return &OpenFail;
+        }
+        struct Source src = {in, NULL, 0, 0, NULL, NULL, 0, NULL};
+        open_input(in, &src, batch->read_ahead, batch->ra_kind);
+        open_compressed(&src);
 
-        /* Walk through the whole line */
-        for (size_t i = 0; i < n; i++)
+        scan->count_only = batch->two_pass && src.map != NULL;
+        scan->may_spill = src.map == NULL;
+        double t0 = scan->timed ? scan_clock() : 0;
+        const Except_T *err = scan_input(&src, scan);
+        if (scan->timed)
+        {
+                scan->stats.scan_s = scan_clock() - t0;
+        }
+        if (err == NULL && scan->best == NULL)
         {
-                unsigned char c = (unsigned char)line[i];
-                if (c == '\n')
+                err = &NoInput;
+        }
+
+        if (err == NULL)
+        {
+                FILE *out = fopen(out_path, "wb");
+                if (out == NULL)
                 {
-                        break;
+                        err = &OpenFail;
                 }
-                if (!isdigit(c))
+                else
                 {
-                        /* Append the nondigit byte */
-                        tmp[out++] = (char)c;
+                        int bad = write_image(out, &src, scan, raster, cap,
+                                              0);
+                        if (fclose(out) != 0 || bad)
+                        {
+                                err = &WriteFail;
+                                remove(out_path);
+                        }
                 }
         }
-        tmp[out] = '\0';
-        /* Store the nondigit sequence in an atom and return it*/
-        const char *key = Atom_string(tmp);
-        FREE(tmp);
-        return key;
+
+        scan->stats.buckets = PatTable_length(scan->buckets);
+        scan->stats.win_rows = scan->best_count;
+        scan->stats.files = err == NULL;
+        scan->stats.failed = err != NULL;
+        *fault = scan->fault;
+        t0 = scan->timed ? scan_clock() : 0;
+        close_input(&src);
+        reset_scan(scan);
+        if (scan->timed)
+        {
+                scan->stats.teardown_s = scan_clock() - t0;
+        }
+        add_stats(total, &scan->stats);
+        memset(&scan->stats, 0, sizeof(scan->stats));
+        return err;
 }
 
-/********** compact_digits_to_bytes ********
+/********** run_serve ********
  *
- * Walk through the line can compact the digits into bytes and store it back in
- * the original buffer
+ * Runs restoration as a server on the Unix socket opts->serve (see
+ * serve.h) until a client asks it to quit.
  *
  * Parameters:
- *      char *buf: the line to compact
- *      size_t n:  the length of the line
+ *      Options opts: the command-line options
  *
  * Return:
- *      the size of the compact line
+ *      EXIT_SUCCESS
  *
+ * Notes:
+ *      with --stats=json the summed stats of every request are printed on
+ *      the way out. CRE (OpenFail) if the socket cannot be made
  ************************/
-static size_t compact_digits_to_bytes(char *buf, size_t n)
+static int run_serve(Options opts)
 {
-        size_t i = 0, out = 0;
-        /* Walk through the line */
-        while (i < n)
+        struct ServeConfig cfg = {opts->serve, opts->jobs, opts->stats,
+                                  opts->read_ahead, opts->ra_kind,
+                                  opts->speculate};
+        struct Stats total;
+        const Except_T *err = serve(&cfg, &total);
+        if (err != NULL)
+        {
+                RAISE(*err);
+        }
+        if (opts->stats)
         {
-                unsigned char c = (unsigned char)buf[i];
-                if (c == '\n')
+                print_stats(opts, &total, NULL, NULL);
+        }
+        return EXIT_SUCCESS;
+}
+
+/********** write_image ********
+ *
+ * Writes the winning Bucket as a PGM 5 image: the header, then its rows.
+ * The image bypasses stdio: a large mapped-input image going to a regular
+ * file is decoded straight into a mapping of that file, and anything else
+ * goes out with writev, header and raster in one call.
+ *
+ * Parameters:
+ *      FILE *out:     where the image goes
+ *      Source src:    the input the scan came from
+ *      Scan scan:     a finished scan with a winner
+ *      char **raster: buffer for decoding mapped rows, grown as needed
+ *      size_t *cap:   bytes *raster has room for
+ *      int threaded:  nonzero to decode a large image on several threads
+ *
+ * Return:
+ *      0 on success, -1 on a write error
+ *
+ * Notes:
+ *      --two-pass output still goes through stdio, a row at a time
+ ************************/
+static int write_image(FILE *out, Source src, Scan scan, char **raster,
+                       size_t *cap, int threaded)
+{
+        Bucket win = scan->best;
+        size_t W = win->width;
+        size_t H = win->height;
+        double t0 = scan->timed ? scan_clock() : 0;
+        int status = 0;
+
+        /* The header of the PGM 5 image */
+        char header[64];
+        int hlen = snprintf(header, sizeof(header), "P5\n%zu %zu\n255\n", W,
+                            H);
+
+        if (scan->count_only)
+        {
+                /* Decoding and writing are interleaved; counted as decode */
+                if (fputs(header, out) == EOF)
                 {
-                        break;
+                        return -1;
                 }
-                if (isdigit(c))
+                status = emit_second_pass(out, src, scan);
+                if (status == 0 && fflush(out) != 0)
                 {
-                        unsigned v = 0;
-                        /* Parse consecutive digit bytes into v */
-                        do
-                        {
-                                /* Append consecutive digits */
-                                v = v * 10u + (unsigned)(buf[i] - '0');
-                                i++;
-                        } while (i < n && isdigit((unsigned char)buf[i]));
-                        if (v > 255u)
+                        status = -1;
+                }
+                if (scan->timed)
+                {
+                        scan->stats.decode_s += scan_clock() - t0;
+                }
+                return status;
+        }
+
+        /* Nothing may be left in stdio's buffer once writes bypass it */
+        int fd = fileno(out);
+        if (fflush(out) != 0 || fd < 0)
+        {
+                return -1;
+        }
+
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = (size_t)hlen;
+        if (src->map != NULL)
+        {
+                /*
+                 * Mapped rows are still ASCII lines in the map; only now
+                 * that the winner is known are its rows decoded.
+                 */
+                struct OutMap om;
+                char *dst = map_output(fd, header, (size_t)hlen, W * H, &om);
+                int mapped = dst != NULL;
+                if (!mapped)
+                {
+                        if (W * H > *cap)
                         {
-                                RAISE(PixelBad);
+                                /* The old contents are not needed */
+                                FREE(*raster);
+                                *cap = W * H;
+                                *raster = ALLOC((long)*cap);
+                                scan->stats.allocs++;
+                                scan->stats.alloc_bytes += *cap;
                         }
-                        /* Store the digit bytes back in the original buffer */
-                        buf[out++] = (char)(unsigned char)v;
+                        dst = *raster;
+                }
+                decode_rows(win, src->map + src->len, dst, threaded);
+                if (scan->timed)
+                {
+                        double t1 = scan_clock();
+                        scan->stats.decode_s += t1 - t0;
+                        t0 = t1;
+                }
+                if (mapped)
+                {
+                        status = unmap_output(&om);
                 }
                 else
                 {
-                        i++;
+                        iov[1].iov_base = dst;
+                        iov[1].iov_len = W * H;
+                        status = write_all(fd, iov, 2);
                 }
         }
-        return out;
+        else if (win->spilled > 0)
+        {
+                status = write_spilled(fd, iov, scan, win);
+        }
+        else
+        {
+                /* The raster is already laid out row after row */
+                iov[1].iov_base = win->data;
+                iov[1].iov_len = W * H;
+                status = write_all(fd, iov, 2);
+        }
+
+        if (scan->timed)
+        {
+                scan->stats.output_s += scan_clock() - t0;
+        }
+        return status;
 }
 
-/********** free_bucket_cb ********
+/********** map_output ********
  *
- * Frees the strings in the Sequence and the Sequence itself
+ * Makes room for the image in a regular output file at its current offset
+ * and maps that part of the file, so that the raster can be decoded in
+ * place with no copy through a buffer. The blocks are allocated up front,
+ * so a full disk shows up here rather than as a SIGBUS while decoding.
  *
  * Parameters:
- *      const void *k: pointer to the key of the table
- *      void **v:      address of the pointer to the value of the table
- *      void *cl:      pointer to the closure variable
+ *      int fd:            the output file
+ *      const char *header: the PGM header, copied into the mapping
+ *      size_t hlen:       length of the header
+ *      size_t raster_len: W x H
+ *      OutMap om:         filled in for unmap_output
  *
  * Return:
- *      none
+ *      where the raster goes in the mapping, or NULL if the output is not a
+ *      regular file (or is opened for appending, the raster is small, or the
+ *      space cannot be allocated or mapped); it must then be written
+ *
+ * Notes:
+ *      a write-only output is mapped through a read-write descriptor of
+ *      its own, opened by way of /proc/self/fd; if the file cannot be
+ *      opened for reading, it is written instead
+ *
+ ************************/
+static char *map_output(int fd, const char *header, size_t hlen,
+                        size_t raster_len, OutMap om)
+{
+        struct stat st;
+        if (raster_len < OUTPUT_MAP_MIN || fstat(fd, &st) != 0 ||
+            !S_ISREG(st.st_mode))
+        {
+                return NULL;
+        }
+        int flags = fcntl(fd, F_GETFL);
+        off_t off = lseek(fd, 0, SEEK_CUR);
+        if (flags < 0 || (flags & O_APPEND) || off < 0)
+        {
+                return NULL;
+        }
+
+        /* Grows the file (as ftruncate would) and reserves its blocks */
+        size_t total = hlen + raster_len;
+        if (fallocate(fd, 0, off, (off_t)total) != 0)
+        {
+                return NULL;
+        }
+
+        /*
+         * A shared mapping that is written needs a descriptor open for
+         * reading as well; "> file" and --batch outputs are write-only, so
+         * the file is opened again read-write to be mapped
+         */
+        int mfd = fd;
+        if ((flags & O_ACCMODE) == O_WRONLY)
+        {
+                char path[64];
+                snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+                mfd = open(path, O_RDWR | O_CLOEXEC);
+                if (mfd < 0)
+                {
+                        return NULL;
+                }
+        }
+
+        off_t base = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        size_t skip = (size_t)(off - base);
+        void *map = mmap(NULL, skip + total, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, mfd, base);
+        if (mfd != fd)
+        {
+                /* The mapping keeps the file */
+                close(mfd);
+        }
+        if (map == MAP_FAILED)
+        {
+                return NULL;
+        }
+
+        om->map = map;
+        om->len = skip + total;
+        om->fd = fd;
+        om->end = off + (off_t)total;
+        memcpy(om->map + skip, header, hlen);
+        return om->map + skip + hlen;
+}
+
+/********** unmap_output ********
+ *
+ * Finishes an image written through map_output: unmaps it and moves the
+ * file offset past it, as writing it would have.
+ *
+ * Return:
+ *      0 on success, -1 on error
  *
  ************************/
-static void free_bucket_cb(const void *k, void **v, void *cl)
+static int unmap_output(OutMap om)
 {
-        (void)k;
-        (void)cl;
-        Bucket b = *(Bucket *)v;
-        if (!b)
-                return;
+        int status = munmap(om->map, om->len);
+        if (lseek(om->fd, om->end, SEEK_SET) < 0)
+        {
+                status = -1;
+        }
+        return status;
+}
 
-        size_t h = Seq_length(b->rows);
-        for (size_t r = 0; r < h; r++)
+/********** write_spilled ********
+ *
+ * Writes the header and the rows of a winner that was partly spilled: its
+ * runs from the spill file, in order, then the rows still in memory. The
+ * runs are copied file to file by the kernel, so reading them back costs no
+ * memory.
+ *
+ * Parameters:
+ *      int fd:               where the image goes
+ *      struct iovec *header: the PGM header
+ *      Scan scan:            the scan, with its spill file
+ *      Bucket win:           the winning Bucket
+ *
+ * Return:
+ *      0 on success, -1 on a read or write error
+ *
+ ************************/
+static int write_spilled(int fd, struct iovec *header, Scan scan, Bucket win)
+{
+        if (write_all(fd, header, 1) != 0)
         {
-                char *row = Seq_get(b->rows, (int)r);
-                FREE(row);
+                return -1;
         }
-        Seq_free(&b->rows);
-        FREE(b);
+        for (size_t i = 0; i < win->nruns; i++)
+        {
+                if (copy_spilled(scan->spill_fd, win->runs[i].off,
+                                 win->runs[i].rows * win->rowbytes, fd) != 0)
+                {
+                        return -1;
+                }
+        }
+        struct iovec rest;
+        rest.iov_base = win->data;
+        rest.iov_len = (win->height - win->spilled) * win->rowbytes;
+        return write_all(fd, &rest, 1);
 }
 
-/********** store_sequence ********
+/********** copy_spilled ********
  *
- * Using the non-digit Atom as the key, store its corresponding restored lines
- * in a Sequence in the Table
+ * Copies len bytes at offset off of the spill file to the output, with
+ * sendfile where the output allows it and through a buffer where not (an
+ * output opened for appending, say).
  *
  * Parameters:
- *      Table_T buckets:       the Table to store restored lines
- *      const char *key:       the Atom key used to store lines in the table
- *      char *row_buf:         char * that stores the line
- *      size_t row_width:      the width of each line
- *      const char **best_key: address of the pointer to the key in the Table
- *                             that will store the restored lines
- *      size_t *best_count:    address of the variable that will store the
- *                             number of lines in the restored file
+ *      int in:     the spill file
+ *      off_t off:  where the bytes start
+ *      size_t len: how many
+ *      int out:    the output
  *
  * Return:
- *      true if all scores are under limit, false if not
+ *      0 on success, -1 on a read or write error
  *
  ************************/
-static void store_sequence(Table_T buckets, const char *key, char *row_buf,
-                           size_t row_width, const char **best_key,
-                           size_t *best_count)
+static int copy_spilled(int in, off_t off, size_t len, int out)
 {
-        Bucket b = Table_get(buckets, key);
-        /* If the nondigit sequence key has not been stored yet */
-        if (b == NULL)
+        while (len > 0)
         {
-                /* Allocate memory for the Bucket struct and initialize it */
-                b = ALLOC(sizeof(*b));
-                b->width = row_width;
-                b->rows = Seq_new(0);
-                /* Insert into table */
-                Table_put(buckets, key, b);
+                ssize_t n = sendfile(out, in, &off, len);
+                if (n > 0)
+                {
+                        len -= (size_t)n;
+                }
+                else if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                else if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                        break;
+                }
+                else
+                {
+                        return -1;
+                }
+        }
+        if (len == 0)
+        {
+                return 0;
         }
-        else if (row_width != b->width)
+
+        size_t cap = len < ((size_t)1 << 20) ? len : (size_t)1 << 20;
+        char *buf = ALLOC((long)cap);
+        int status = 0;
+        while (len > 0 && status == 0)
         {
-                RAISE(WidthBad);
+                size_t want = len < cap ? len : cap;
+                ssize_t n = pread(in, buf, want, off);
+                if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (n <= 0)
+                {
+                        status = -1;
+                        break;
+                }
+                struct iovec iov;
+                iov.iov_base = buf;
+                iov.iov_len = (size_t)n;
+                status = write_all(out, &iov, 1);
+                off += n;
+                len -= (size_t)n;
         }
+        FREE(buf);
+        return status;
+}
 
-        /* Append the parsed line to the sequence */
-        Seq_addhi(b->rows, row_buf);
-        size_t cnt = Seq_length(b->rows);
+/********** emit_second_pass ********
+ *
+ * Second pass of --two-pass mode: walks the mapped input again and decodes
+ * and writes each line whose skeleton is the winning one, in input order.
+ * Only one row is held in memory at a time.
+ *
+ * Parameters:
+ *      FILE *out:  where the rows go
+ *      Source src: the mapped input
+ *      Scan scan:  the counts from the first pass
+ *
+ * Return:
+ *      0 on success, -1 on a write error
+ *
+ ************************/
+static int emit_second_pass(FILE *out, Source src, Scan scan)
+{
+        Bucket win = scan->best;
+        Skeleton skel = scan->skel;
+        size_t cap = win->width;
+        char *row = ALLOC(cap);
+        size_t pos = 0;
+        int status = 0;
+        scan->stats.allocs++;
+        scan->stats.alloc_bytes += cap;
 
-        /* The seq with the longest length store the original lines */
-        if (cnt > *best_count)
+        while (pos < src->len)
         {
-                *best_count = cnt;
-                *best_key = key;
+                const char *line = src->map + pos;
+                size_t left = src->len - pos;
+                const char *nl = memchr(line, '\n', left);
+                size_t n = nl != NULL ? (size_t)(nl - line) + 1 : left;
+                pos += n;
+
+                /* A decoy line may hold more pixels than the winning width */
+                if (n > cap)
+                {
+                        cap = n;
+                        RESIZE(row, (long)cap);
+                }
+
+                /* Same rows as the first pass: pixel > 255 is skipped */
+                size_t row_w = scan_row(line, n, row, skel);
+                if (row_w == SCAN_PIXEL_BAD || row_w == 0 ||
+                    PatTable_get(scan->buckets, skel->bytes, skel->len) != win)
+                {
+                        continue;
+                }
+                if (fwrite(row, 1, win->width, out) != win->width)
+                {
+                        status = -1;
+                        break;
+                }
         }
-}
\ No newline at end of file
+
+        FREE(row);
+        return status;
+}
+
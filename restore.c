@@ -0,0 +1,337 @@
+/* restore.c */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "restore.h"
+#include "engine.h"
+#include "mem.h"
+
+#define T Restore_T
+
+/* A restoration fed in pieces by restore_push */
+struct T
+{
+        struct Scan scan;
+        char *carry;        /* the start of a line split between pieces */
+        size_t carry_len;
+        size_t carry_cap;
+        char *row;          /* the pixels of the line being stored */
+        size_t row_cap;
+        size_t pos;         /* input offset of the next line */
+        int status;         /* the first error, which sticks */
+        int finished;       /* restore_finish has been called */
+};
+
+/* The scan kernel is picked once, by whichever call comes first */
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void);
+static int push_line(T r, const char *line, size_t n);
+static char *new_image(restore_out *out, size_t width, size_t height);
+
+/********** restore_buffer ********
+ *
+ * Restores the hacked PGM file held in a buffer. Lines are scanned in the
+ * buffer itself, each Bucket keeping pointers to its lines, and only the
+ * winning lines are decoded, straight into the output image: the input is
+ * never copied.
+ *
+ * Parameters:
+ *      const void *in:   the hacked PGM file
+ *      size_t len:       its length in bytes
+ *      restore_out *out: receives the image (free with restore_out_free)
+ *
+ * Return:
+ *      RESTORE_OK, RESTORE_NO_ROWS, RESTORE_BAD_WIDTH or RESTORE_BAD_ARGS;
+ *      *out is only filled in on RESTORE_OK
+ *
+ * Notes:
+ *      runs entirely on the calling thread; 'in' is only read
+ ************************/
+int restore_buffer(const void *in, size_t len, restore_out *out)
+{
+        if (out == NULL || (in == NULL && len > 0))
+        {
+                return RESTORE_BAD_ARGS;
+        }
+        memset(out, 0, sizeof(*out));
+        pthread_once(&kernel_once, pick_kernel);
+
+        struct Scan scan;
+        init_scan(&scan, len, 0);
+        int status = RESTORE_OK;
+        if (obtain_mapped_sequence(&scan, in, 0, len) != NULL)
+        {
+                /* WidthBad is the only way a scan in memory can fail */
+                status = RESTORE_BAD_WIDTH;
+        }
+        else if (scan.best == NULL)
+        {
+                status = RESTORE_NO_ROWS;
+        }
+        else
+        {
+                Bucket win = scan.best;
+                char *pixels = new_image(out, win->width, win->height);
+                decode_rows(win, (const char *)in + len, pixels, 0);
+        }
+        free_scan(&scan);
+        return status;
+}
+
+/********** restore_new ********
+ *
+ * Starts a restoration whose input is given in pieces with restore_push.
+ *
+ * Return:
+ *      the new session; free it with restore_free
+ *
+ ************************/
+T restore_new(void)
+{
+        pthread_once(&kernel_once, pick_kernel);
+
+        T r;
+        NEW0(r);
+        init_scan(&r->scan, 0, 0);
+        r->status = RESTORE_OK;
+        return r;
+}
+
+/********** restore_push ********
+ *
+ * Scans the next piece of the input. Each whole line is decoded and stored
+ * as it is found; a line left unfinished at the end of the piece is kept
+ * until the piece that finishes it.
+ *
+ * Parameters:
+ *      T r:              the session
+ *      const void *data: the piece
+ *      size_t len:       its length in bytes
+ *
+ * Return:
+ *      RESTORE_OK, or the session's first error (RESTORE_BAD_WIDTH), or
+ *      RESTORE_FINISHED or RESTORE_BAD_ARGS; once an error is returned the
+ *      rest of the input is not scanned
+ *
+ ************************/
+int restore_push(T r, const void *data, size_t len)
+{
+        if (r == NULL || (data == NULL && len > 0))
+        {
+                return RESTORE_BAD_ARGS;
+        }
+        if (r->finished)
+        {
+                return RESTORE_FINISHED;
+        }
+
+        const char *p = data;
+        size_t i = 0;
+        while (r->status == RESTORE_OK && i < len)
+        {
+                const char *nl = memchr(p + i, '\n', len - i);
+                size_t n = nl != NULL ? (size_t)(nl - p) + 1 - i : len - i;
+                if (r->carry_len == 0 && nl != NULL)
+                {
+                        r->status = push_line(r, p + i, n);
+                        i += n;
+                        continue;
+                }
+
+                /* A line split between pieces is put back together */
+                if (r->carry_len + n > r->carry_cap)
+                {
+                        size_t cap = r->carry_cap == 0 ? 256 : r->carry_cap;
+                        while (cap < r->carry_len + n)
+                        {
+                                cap *= 2;
+                        }
+                        if (r->carry == NULL)
+                        {
+                                r->carry = ALLOC((long)cap);
+                        }
+                        else
+                        {
+                                RESIZE(r->carry, (long)cap);
+                        }
+                        r->carry_cap = cap;
+                }
+                memcpy(r->carry + r->carry_len, p + i, n);
+                r->carry_len += n;
+                i += n;
+                if (nl != NULL)
+                {
+                        r->status = push_line(r, r->carry, r->carry_len);
+                        r->carry_len = 0;
+                }
+        }
+        return r->status;
+}
+
+/********** restore_finish ********
+ *
+ * Ends the input (a last line need not end in '\n') and hands over the
+ * restored image.
+ *
+ * Parameters:
+ *      T r:              the session
+ *      restore_out *out: receives the image (free with restore_out_free)
+ *
+ * Return:
+ *      RESTORE_OK, RESTORE_NO_ROWS, RESTORE_BAD_WIDTH, RESTORE_FINISHED (on
+ *      a second call) or RESTORE_BAD_ARGS; *out is only filled in on
+ *      RESTORE_OK
+ *
+ * Notes:
+ *      the session still has to be freed with restore_free
+ ************************/
+int restore_finish(T r, restore_out *out)
+{
+        if (r == NULL || out == NULL)
+        {
+                return RESTORE_BAD_ARGS;
+        }
+        memset(out, 0, sizeof(*out));
+        if (r->finished)
+        {
+                return RESTORE_FINISHED;
+        }
+        r->finished = 1;
+
+        if (r->status == RESTORE_OK && r->carry_len > 0)
+        {
+                r->status = push_line(r, r->carry, r->carry_len);
+                r->carry_len = 0;
+        }
+        if (r->status == RESTORE_OK && r->scan.best == NULL)
+        {
+                r->status = RESTORE_NO_ROWS;
+        }
+        if (r->status != RESTORE_OK)
+        {
+                return r->status;
+        }
+
+        /* Streamed rows are stored decoded, back to back */
+        Bucket win = r->scan.best;
+        char *pixels = new_image(out, win->width, win->height);
+        memcpy(pixels, win->data, win->width * win->height);
+        return RESTORE_OK;
+}
+
+/********** restore_free ********
+ *
+ * Frees a session, finished or not, and sets *r to NULL.
+ *
+ ************************/
+void restore_free(T *r)
+{
+        if (r == NULL || *r == NULL)
+        {
+                return;
+        }
+        free_scan(&(*r)->scan);
+        FREE((*r)->carry);
+        FREE((*r)->row);
+        FREE(*r);
+}
+
+/********** restore_out_free ********
+ *
+ * Frees an image filled in by restore_buffer or restore_finish and clears
+ * *out.
+ *
+ ************************/
+void restore_out_free(restore_out *out)
+{
+        if (out == NULL)
+        {
+                return;
+        }
+        FREE(out->image);
+        memset(out, 0, sizeof(*out));
+}
+
+/********** restore_strerror ********
+ *
+ * Return:
+ *      a message for a return code, e.g. for logging
+ *
+ ************************/
+const char *restore_strerror(int code)
+{
+        switch (code)
+        {
+        case RESTORE_OK:
+                return "success";
+        case RESTORE_NO_ROWS:
+                return "no useable rows";
+        case RESTORE_BAD_WIDTH:
+                return "inconsistent row widths";
+        case RESTORE_BAD_ARGS:
+                return "bad arguments";
+        case RESTORE_FINISHED:
+                return "input already finished";
+        default:
+                return "unknown error";
+        }
+}
+
+/********** pick_kernel ********
+ *
+ * Picks the fastest line-scanning kernel for the CPU (run once).
+ *
+ ************************/
+static void pick_kernel(void)
+{
+        scan_select(SCAN_AUTO);
+}
+
+/********** push_line ********
+ *
+ * Scans one whole line of a pushed input, decoding it into the session's
+ * row buffer, from which the winner's Bucket copies it.
+ *
+ * Return:
+ *      RESTORE_OK or RESTORE_BAD_WIDTH
+ *
+ ************************/
+static int push_line(T r, const char *line, size_t n)
+{
+        if (n > r->row_cap)
+        {
+                /* The old contents are not needed */
+                FREE(r->row);
+                r->row_cap = n < 256 ? 256 : n;
+                r->row = ALLOC((long)r->row_cap);
+        }
+        const Except_T *err = scan_stream_line(&r->scan, line, n, r->row,
+                                               r->pos);
+        r->pos += n;
+        return err != NULL ? RESTORE_BAD_WIDTH : RESTORE_OK;
+}
+
+/********** new_image ********
+ *
+ * Allocates a PGM 5 image of the given size into *out and writes its
+ * header.
+ *
+ * Return:
+ *      where the width x height raster goes
+ *
+ ************************/
+static char *new_image(restore_out *out, size_t width, size_t height)
+{
+        char header[64];
+        int hlen = snprintf(header, sizeof(header), "P5\n%zu %zu\n255\n",
+                            width, height);
+        out->len = (size_t)hlen + width * height;
+        out->image = ALLOC((long)out->len);
+        memcpy(out->image, header, (size_t)hlen);
+        out->pixels = (unsigned char *)out->image + hlen;
+        out->width = width;
+        out->height = height;
+        return out->image + hlen;
+}
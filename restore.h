@@ -0,0 +1,71 @@
+/* restore.h
+ *
+ * librestoration: restores hacked PGM files in-process, the way the
+ * restoration program does, from bytes in memory rather than a file.
+ *
+ *      restore_buffer  restores a whole input held in one buffer; lines are
+ *                      scanned where they lie and only the winning rows are
+ *                      decoded, straight into the output image
+ *      restore_new, restore_push, restore_finish, restore_free
+ *                      restore an input that arrives in pieces of any size
+ *                      (a socket, a request body); lines may be split
+ *                      between pieces
+ *
+ * Every function reports errors by its return code and nothing is RAISEd,
+ * so calls can be made from any thread; separate sessions share nothing.
+ * Running out of memory is the exception: as in the rest of the program,
+ * it aborts.
+ *
+ * Link with -lrestoration -lcii40 -lpthread (-lm).
+ */
+#ifndef RESTORE_INCLUDED
+#define RESTORE_INCLUDED
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define RESTORE_API __attribute__((visibility("default")))
+#else
+#define RESTORE_API
+#endif
+
+/* Return codes */
+#define RESTORE_OK 0
+#define RESTORE_NO_ROWS 1    /* no line held a usable row */
+#define RESTORE_BAD_WIDTH 2  /* rows with one skeleton differ in width */
+#define RESTORE_BAD_ARGS 3   /* NULL where a pointer is needed */
+#define RESTORE_FINISHED 4   /* restore_push after restore_finish */
+
+/*
+ * A restored image. 'image' is the whole PGM 5 file, ready to be written
+ * out; 'pixels' points at its raster, width x height bytes, inside it.
+ */
+typedef struct restore_out
+{
+        char *image;
+        size_t len;
+        unsigned char *pixels;
+        size_t width;
+        size_t height;
+} restore_out;
+
+#define T Restore_T
+typedef struct T *T;
+
+extern RESTORE_API int restore_buffer(const void *in, size_t len,
+                                      restore_out *out);
+
+extern RESTORE_API T restore_new(void);
+
+extern RESTORE_API int restore_push(T r, const void *data, size_t len);
+
+extern RESTORE_API int restore_finish(T r, restore_out *out);
+
+extern RESTORE_API void restore_free(T *r);
+
+extern RESTORE_API void restore_out_free(restore_out *out);
+
+extern RESTORE_API const char *restore_strerror(int code);
+
+#undef T
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "restore.h"
+
+/*
+ * Driver for librestoration: restores a file through restore_buffer, or
+ * through restore_push in pieces of N bytes with -c N, and writes the
+ * image to stdout.
+ */
+int main(int argc, char *argv[])
+{
+    size_t chunk = 0;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        chunk = strtoul(argv[2], NULL, 10);
+        arg = 3;
+    }
+    if (arg >= argc) {
+        printf("Please provide a file\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[arg], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s %s %s\n",
+                         argv[0], "Could not open file",
+                         argv[arg], "for reading");
+        return EXIT_FAILURE;
+    }
+
+    /* The whole file in memory, as a service would hold a request body */
+    size_t len = 0, cap = 1 << 16;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf != NULL && (got = fread(buf + len, 1, cap - len, fp)) > 0) {
+        len += got;
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    fclose(fp);
+    if (buf == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    restore_out out;
+    int rc;
+    if (chunk == 0) {
+        rc = restore_buffer(buf, len, &out);
+    }
+    else {
+        Restore_T r = restore_new();
+        rc = RESTORE_OK;
+        for (size_t i = 0; i < len && rc == RESTORE_OK; i += chunk) {
+            rc = restore_push(r, buf + i, len - i < chunk ? len - i : chunk);
+        }
+        if (rc == RESTORE_OK) {
+            rc = restore_finish(r, &out);
+        }
+        restore_free(&r);
+    }
+    free(buf);
+
+    if (rc != RESTORE_OK) {
+        fprintf(stderr, "%s: %s\n", argv[0], restore_strerror(rc));
+        return EXIT_FAILURE;
+    }
+    fwrite(out.image, 1, out.len, stdout);
+    restore_out_free(&out);
+    return EXIT_SUCCESS;
+}
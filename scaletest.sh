@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# scaletest.sh - restore an image taller than INT_MAX rows (make scaletest)
+#
+# pgmgen streams a hacked input of a very tall, narrow image (a scientific
+# strip) through a FIFO into restoration, so the input is never stored; only
+# the expected image and restoration's output go to disk. The output is
+# checked against the expected image, and the row count against the one
+# asked for, so that nothing on the way caps or wraps a 32-bit row index.
+#
+# Environment (all optional):
+#       SCALE_ROWS    rows in the image (default 2147487744, 2^31 + 4096)
+#       SCALE_WIDTH   pixels per row (default 1)
+#       SCALE_DECOYS  decoy rows per original row (default 0.0001)
+#       SCALE_DIR     where the images go (default $TMPDIR or /tmp)
+#       SCALE_FLAGS   extra restoration options, e.g. --spill-dir DIR
+#       SCALE_SEED    random seed (default 1)
+#
+# Needs about SCALE_ROWS * SCALE_WIDTH bytes of memory and twice that of
+# disk. Exits nonzero if restoration fails or restores the wrong image.
+
+rows=${SCALE_ROWS:-2147487744}
+width=${SCALE_WIDTH:-1}
+decoys=${SCALE_DECOYS:-0.0001}
+dir=${SCALE_DIR:-${TMPDIR:-/tmp}}
+seed=${SCALE_SEED:-1}
+
+fifo="$dir/scale.$$.fifo"
+want="$dir/scale.$$.pgm"
+got="$dir/scale.$$.out"
+stats="$dir/scale.$$.json"
+trap 'rm -f "$fifo" "$want" "$got" "$stats"' EXIT INT TERM
+
+mkfifo "$fifo" || exit 1
+./pgmgen -w "$width" -h "$rows" -d "$decoys" -s "$seed" "$fifo" "$want" \
+        > /dev/null &
+gen=$!
+start=$(date +%s)
+./restoration $SCALE_FLAGS --stats=json:"$stats" < "$fifo" > "$got"
+rc=$?
+wait $gen || { echo "scaletest: pgmgen failed"; exit 1; }
+secs=$(( $(date +%s) - start ))
+
+if [ $rc -ne 0 ]; then
+        echo "scaletest: restoration exited $rc"
+        exit 1
+fi
+if ! cmp -s "$got" "$want"; then
+        echo "scaletest: wrong image for $rows rows of $width"
+        exit 1
+fi
+if ! grep -q "\"winner_rows\": $rows," "$stats"; then
+        echo "scaletest: row count is not $rows"
+        exit 1
+fi
+echo "scaletest: $rows rows of $width restored in ${secs}s"
@@ -0,0 +1,761 @@
+/* serve.c */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "serve.h"
+#include "mem.h"
+#include "input.h"
+
+static const Except_T RequestBad = {"restoration: bad request"};
+
+/* Frame kinds and statuses (see serve.h) */
+#define SERVE_INPUT 'I'
+#define SERVE_PATH 'P'
+#define SERVE_STATS 'S'
+#define SERVE_QUIT 'Q'
+#define SERVE_OK 0
+#define SERVE_ERROR 1
+#define FRAME_HEAD 9
+
+/* Longest file name a path request may carry */
+#define SERVE_PATH_MAX 4096
+
+/*
+ * Request buffer a worker starts with, and the most a worker keeps of its
+ * request buffer and raster between requests: either one grown past
+ * KEEP_MAX for an oversized input is given back once the request is
+ * answered, so an idle worker does not hold on to the largest request it
+ * has seen.
+ */
+#define REQ_CAP_MIN (64 * 1024)
+#define KEEP_MAX ((size_t)16 << 20)
+
+/* Request latencies in power-of-two buckets: [2^i, 2^(i+1)) microseconds */
+#define LATENCY_BUCKETS 32
+
+typedef struct Latency
+{
+        size_t count;
+        double total_us;
+        double max_us;
+        size_t buckets[LATENCY_BUCKETS];
+} *Latency;
+
+/*
+ * A server, shared by its worker threads. Each worker accepts connections
+ * on the listening socket itself and serves one at a time.
+ */
+typedef struct Server
+{
+        int fd;                 /* the listening socket */
+        int timed;              /* --stats: time each worker's phases */
+        int read_ahead;         /* --read-ahead, for path requests */
+        ReadAhead_Kind ra_kind;
+        unsigned speculate;     /* --speculate, for every request */
+        int stop;               /* a quit request was served */
+        size_t requests;        /* input and path requests served */
+        size_t errors;          /* of those, how many were not restored */
+        struct Latency lat[2];  /* of input requests, of path requests */
+        struct Stats stats;     /* the workers' stats, summed */
+        pthread_mutex_t lock;
+} *Server;
+
+/*
+ * What a worker keeps between requests: its Scan (pattern table and slab
+ * are only reset), the request buffer and the raster.
+ */
+typedef struct Worker
+{
+        struct Scan scan;
+        char *req;         /* the request payload, NUL-terminated */
+        size_t req_cap;
+        char *raster;      /* decoded rows of an input held in memory */
+        size_t raster_cap;
+        struct Stats total;
+} *Worker;
+
+static void *serve_worker(void *cl);
+
+static void serve_connection(Server srv, Worker w, int c);
+
+static int serve_job(Server srv, Worker w, int c, int kind, size_t len);
+
+static void trim_worker(Worker w);
+
+static const char *ready_image(Source src, Scan scan, Worker w);
+
+static int send_image(int c, Scan scan, const char *raster);
+
+static int send_reply(int c, int status, const char *payload, size_t len);
+
+static int send_latency_report(Server srv, int c);
+
+static void record_latency(Latency lat, double us);
+
+static int format_latency(char *buf, size_t cap, Latency lat);
+
+static int read_full(int fd, void *buf, size_t n);
+
+/********** serve ********
+ *
+ * Runs a server on the Unix socket cfg->path, restoring the inputs its
+ * clients send (see serve.h) until a client asks it to quit. Requests are
+ * handled on a pool of cfg->jobs worker threads (default: one per CPU),
+ * each keeping its Scan, request buffer and raster warm from one request to
+ * the next.
+ *
+ * Parameters:
+ *      ServeConfig cfg: how to run
+ *      Stats total:     receives the stats of every request, summed
+ *
+ * Return:
+ *      NULL once a client has asked the server to quit, or &OpenFail if the
+ *      socket cannot be made (the path is too long, or cannot be bound)
+ *
+ * Notes:
+ *      a stale socket file at the path is replaced, and the socket is
+ *      removed on the way out
+ ************************/
+const Except_T *serve(ServeConfig cfg, Stats total)
+{
+        memset(total, 0, sizeof(*total));
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(cfg->path) > SERVE_SOCKET_MAX)
+        {
+                return &OpenFail;
+        }
+        strcpy(addr.sun_path, cfg->path);
+
+        /* Only a socket left behind by an earlier server is removed */
+        struct stat st;
+        if (lstat(cfg->path, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+                unlink(cfg->path);
+        }
+
+        struct Server srv;
+        memset(&srv, 0, sizeof(srv));
+        srv.timed = cfg->timed;
+        srv.read_ahead = cfg->read_ahead;
+        srv.speculate = cfg->speculate;
+        srv.ra_kind = cfg->ra_kind;
+        srv.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (srv.fd < 0)
+        {
+                return &OpenFail;
+        }
+        if (bind(srv.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(srv.fd, SOMAXCONN) != 0)
+        {
+                close(srv.fd);
+                return &OpenFail;
+        }
+        pthread_mutex_init(&srv.lock, NULL);
+
+        /* A client that hangs up early must not kill the server */
+        signal(SIGPIPE, SIG_IGN);
+
+        size_t nthreads = cfg->jobs;
+        if (nthreads == 0)
+        {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = cpus > 0 ? (size_t)cpus : 1;
+        }
+        if (nthreads > MAX_JOBS)
+                nthreads = MAX_JOBS;
+
+        /* This thread is a worker too, as in run_batch */
+        pthread_t tids[MAX_JOBS];
+        int started[MAX_JOBS];
+        for (size_t t = 1; t < nthreads; t++)
+        {
+                started[t] = pthread_create(&tids[t], NULL, serve_worker,
+                                            &srv) == 0;
+        }
+        serve_worker(&srv);
+        for (size_t t = 1; t < nthreads; t++)
+        {
+                if (started[t])
+                {
+                        pthread_join(tids[t], NULL);
+                }
+        }
+
+        close(srv.fd);
+        unlink(cfg->path);
+        pthread_mutex_destroy(&srv.lock);
+        *total = srv.stats;
+        return NULL;
+}
+
+/********** serve_worker ********
+ *
+ * Thread body for serve: accepts connections and serves their requests
+ * until a quit request has been served.
+ *
+ * Notes:
+ *      a worker busy with a connection when another one asks to quit
+ *      finishes that connection first. Nothing is RAISEd except on
+ *      allocation failure
+ ************************/
+static void *serve_worker(void *cl)
+{
+        Server srv = cl;
+        struct Worker w;
+        memset(&w, 0, sizeof(w));
+        init_scan(&w.scan, 0, 0);
+        w.scan.timed = srv->timed;
+        w.scan.spec_margin = srv->speculate;
+
+        /* Plain malloc: a client's length must not be able to abort us */
+        w.req_cap = REQ_CAP_MIN;
+        w.req = malloc(w.req_cap);
+
+        while (w.req != NULL)
+        {
+                int c = accept4(srv->fd, NULL, NULL, SOCK_CLOEXEC);
+                pthread_mutex_lock(&srv->lock);
+                int stop = srv->stop;
+                pthread_mutex_unlock(&srv->lock);
+                if (c < 0)
+                {
+                        if (stop || errno == EBADF || errno == EINVAL)
+                        {
+                                break;
+                        }
+                        if (errno == EMFILE || errno == ENFILE)
+                        {
+                                /* Wait for a connection to be closed */
+                                struct timespec pause = {0, 10000000};
+                                nanosleep(&pause, NULL);
+                        }
+                        continue;
+                }
+                serve_connection(srv, &w, c);
+                close(c);
+                trim_worker(&w);
+        }
+
+        free(w.req);
+        FREE(w.raster);
+        free_scan(&w.scan);
+
+        pthread_mutex_lock(&srv->lock);
+        add_stats(&srv->stats, &w.total);
+        pthread_mutex_unlock(&srv->lock);
+        return NULL;
+}
+
+/********** serve_connection ********
+ *
+ * Reads requests from a connection and answers each in turn, until the
+ * client hangs up, sends a malformed request or asks the server to quit.
+ *
+ * Parameters:
+ *      Server srv: the server
+ *      Worker w:   the worker's state
+ *      int c:      the connection
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+static void serve_connection(Server srv, Worker w, int c)
+{
+        unsigned char head[FRAME_HEAD];
+        while (read_full(c, head, FRAME_HEAD) == 0)
+        {
+                int kind = head[0];
+                uint64_t len = 0;
+                for (int i = 1; i < FRAME_HEAD; i++)
+                {
+                        len = (len << 8) | head[i];
+                }
+
+                int known = kind == SERVE_INPUT || kind == SERVE_PATH ||
+                            kind == SERVE_STATS || kind == SERVE_QUIT;
+                if (!known || (kind == SERVE_PATH && len >= SERVE_PATH_MAX)
+                    || len >= SIZE_MAX)
+                {
+                        send_reply(c, SERVE_ERROR, RequestBad.reason,
+                                   strlen(RequestBad.reason));
+                        return;
+                }
+
+                /* The buffer grows to fit (see trim_worker); a NUL ends a path */
+                if (len + 1 > w->req_cap)
+                {
+                        char *bigger = realloc(w->req, (size_t)len + 1);
+                        if (bigger == NULL)
+                        {
+                                send_reply(c, SERVE_ERROR,
+                                           RequestBad.reason,
+                                           strlen(RequestBad.reason));
+                                return;
+                        }
+                        w->req = bigger;
+                        w->req_cap = (size_t)len + 1;
+                }
+                if (read_full(c, w->req, (size_t)len) != 0)
+                {
+                        return;
+                }
+                w->req[len] = '\0';
+
+                if (kind == SERVE_STATS)
+                {
+                        if (send_latency_report(srv, c) != 0)
+                        {
+                                return;
+                        }
+                }
+                else if (kind == SERVE_QUIT)
+                {
+                        send_reply(c, SERVE_OK, NULL, 0);
+                        pthread_mutex_lock(&srv->lock);
+                        srv->stop = 1;
+                        pthread_mutex_unlock(&srv->lock);
+
+                        /* Wakes the workers waiting in accept */
+                        shutdown(srv->fd, SHUT_RDWR);
+                        return;
+                }
+                else if (serve_job(srv, w, c, kind, (size_t)len) != 0)
+                {
+                        return;
+                }
+
+                /* Before waiting on the client for its next request */
+                trim_worker(w);
+        }
+}
+
+/********** serve_job ********
+ *
+ * Restores the input of an input or path request and sends the image, or
+ * the reason there is none, back to the client. The input of an input
+ * request is scanned where it lies in the request buffer.
+ *
+ * Parameters:
+ *      Server srv: the server, whose latencies the request is added to
+ *      Worker w:   the worker's state; w->req holds the payload
+ *      int c:      the connection
+ *      int kind:   SERVE_INPUT or SERVE_PATH
+ *      size_t len: length of the payload
+ *
+ * Return:
+ *      0, or -1 if the reply could not be sent
+ *
+ ************************/
+static int serve_job(Server srv, Worker w, int c, int kind, size_t len)
+{
+        double t0 = scan_clock();
+        Scan scan = &w->scan;
+        struct Source src = {NULL, NULL, 0, 0, NULL, NULL, 0, NULL};
+        const Except_T *err = NULL;
+        if (kind == SERVE_INPUT)
+        {
+                src.map = w->req;
+                src.len = len;
+        }
+        else
+        {
+                src.fp = fopen(w->req, "rb");
+                if (src.fp == NULL)
+                {
+                        err = &OpenFail;
+                }
+                else
+                {
+                        open_input(src.fp, &src, srv->read_ahead,
+                                   srv->ra_kind);
+                }
+        }
+
+        if (err == NULL)
+        {
+                open_compressed(&src);
+                scan->may_spill = 0;
+                err = scan_input(&src, scan);
+                if (scan->timed)
+                {
+                        scan->stats.scan_s = scan_clock() - t0;
+                }
+                if (err == NULL && scan->best == NULL)
+                {
+                        err = &NoInput;
+                }
+        }
+
+        /*
+         * The request is counted before its reply goes out, so a stats
+         * request sees every request answered before it. The latency is
+         * the time taken to have the reply ready to send.
+         */
+        const char *raster = err == NULL ? ready_image(&src, scan, w) : NULL;
+        double us = (scan_clock() - t0) * 1e6;
+        pthread_mutex_lock(&srv->lock);
+        record_latency(&srv->lat[kind == SERVE_PATH], us);
+        srv->requests++;
+        srv->errors += err != NULL;
+        pthread_mutex_unlock(&srv->lock);
+        int bad;
+        if (err == NULL)
+        {
+                bad = send_image(c, scan, raster);
+        }
+        else
+        {
+                char msg[160];
+                char where[64];
+                format_where(where, sizeof(where), &scan->fault);
+                int n = snprintf(msg, sizeof(msg), "%s%s", err->reason,
+                                 where);
+                bad = send_reply(c, SERVE_ERROR, msg, (size_t)n);
+        }
+
+        /* The request buffer is not a mapping to be undone */
+        if (kind == SERVE_INPUT)
+        {
+                src.map = NULL;
+                src.zmap = NULL;
+        }
+        scan->stats.buckets = PatTable_length(scan->buckets);
+        scan->stats.win_rows = scan->best_count;
+        scan->stats.files = err == NULL;
+        scan->stats.failed = err != NULL;
+        close_input(&src);
+        reset_scan(scan);
+        add_stats(&w->total, &scan->stats);
+        memset(&scan->stats, 0, sizeof(scan->stats));
+        return bad;
+}
+
+/********** trim_worker ********
+ *
+ * Gives back a request buffer or raster an oversized request grew past
+ * KEEP_MAX, so that the worker goes back to its usual footprint: the
+ * request buffer is shrunk to REQ_CAP_MIN, the raster freed (ready_image
+ * allocates one again as needed).
+ *
+ * Parameters:
+ *      Worker w: the worker, between requests
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+static void trim_worker(Worker w)
+{
+        if (w->req_cap > KEEP_MAX)
+        {
+                /* A failed shrink leaves the larger buffer, still valid */
+                char *smaller = realloc(w->req, REQ_CAP_MIN);
+                if (smaller != NULL)
+                {
+                        w->req = smaller;
+                        w->req_cap = REQ_CAP_MIN;
+                }
+        }
+        if (w->raster_cap > KEEP_MAX)
+        {
+                FREE(w->raster);
+                w->raster_cap = 0;
+        }
+}
+
+/********** ready_image ********
+ *
+ * Gets the winning Bucket's raster ready to send: rows of an input held in
+ * memory are decoded into the worker's raster, while streamed rows are
+ * already laid out in the Bucket.
+ *
+ * Parameters:
+ *      Source src: the input the scan came from
+ *      Scan scan:  a finished scan with a winner
+ *      Worker w:   the worker, whose raster is grown as needed
+ *
+ * Return:
+ *      the width x height raster
+ *
+ ************************/
+static const char *ready_image(Source src, Scan scan, Worker w)
+{
+        Bucket win = scan->best;
+        if (src->map == NULL)
+        {
+                return win->data;
+        }
+
+        double t0 = scan->timed ? scan_clock() : 0;
+        size_t raster_len = win->width * win->height;
+        if (raster_len > w->raster_cap)
+        {
+                /* The old contents are not needed */
+                FREE(w->raster);
+                w->raster_cap = raster_len;
+                w->raster = ALLOC((long)w->raster_cap);
+                scan->stats.allocs++;
+                scan->stats.alloc_bytes += w->raster_cap;
+        }
+        decode_rows(win, src->map + src->len, w->raster, 0);
+        if (scan->timed)
+        {
+                scan->stats.decode_s += scan_clock() - t0;
+        }
+        return w->raster;
+}
+
+/********** send_image ********
+ *
+ * Sends the winning Bucket as a PGM 5 image in an OK reply: frame head,
+ * image header and raster in one writev.
+ *
+ * Parameters:
+ *      int c:              the connection
+ *      Scan scan:          a finished scan with a winner
+ *      const char *raster: its raster, from ready_image
+ *
+ * Return:
+ *      0, or -1 if the reply could not be sent
+ *
+ ************************/
+static int send_image(int c, Scan scan, const char *raster)
+{
+        Bucket win = scan->best;
+        size_t W = win->width;
+        size_t H = win->height;
+        char header[64];
+        int hlen = snprintf(header, sizeof(header), "P5\n%zu %zu\n255\n", W,
+                            H);
+
+        double t0 = scan->timed ? scan_clock() : 0;
+        unsigned char head[FRAME_HEAD];
+        uint64_t len = (uint64_t)hlen + W * H;
+        head[0] = SERVE_OK;
+        for (int i = FRAME_HEAD - 1; i > 0; i--)
+        {
+                head[i] = (unsigned char)len;
+                len >>= 8;
+        }
+        struct iovec iov[3];
+        iov[0].iov_base = head;
+        iov[0].iov_len = FRAME_HEAD;
+        iov[1].iov_base = header;
+        iov[1].iov_len = (size_t)hlen;
+        iov[2].iov_base = (void *)raster;
+        iov[2].iov_len = W * H;
+        int status = write_all(c, iov, 3);
+        if (scan->timed)
+        {
+                scan->stats.output_s += scan_clock() - t0;
+        }
+        return status;
+}
+
+/********** send_reply ********
+ *
+ * Sends a reply frame with the given status and payload.
+ *
+ * Parameters:
+ *      int c:               the connection
+ *      int status:          SERVE_OK or SERVE_ERROR
+ *      const char *payload: the payload (NULL if len is 0)
+ *      size_t len:          its length
+ *
+ * Return:
+ *      0, or -1 on a write error
+ *
+ ************************/
+static int send_reply(int c, int status, const char *payload, size_t len)
+{
+        unsigned char head[FRAME_HEAD];
+        uint64_t n = len;
+        head[0] = (unsigned char)status;
+        for (int i = FRAME_HEAD - 1; i > 0; i--)
+        {
+                head[i] = (unsigned char)n;
+                n >>= 8;
+        }
+        struct iovec iov[2];
+        iov[0].iov_base = head;
+        iov[0].iov_len = FRAME_HEAD;
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = len;
+        return write_all(c, iov, len > 0 ? 2 : 1);
+}
+
+/********** send_latency_report ********
+ *
+ * Answers a stats request with one JSON object: the number of input and
+ * path requests served, how many failed, and the latency histogram of each
+ * kind, e.g.
+ *
+ *   {"requests": 3, "errors": 1, "latency_us": {"input": {"count": 2,
+ *    "mean": 80.5, "max": 97.0, "p50": 64.0, "p90": 97.0, "p99": 97.0,
+ *    "buckets": [[64, 1], [128, 1]]}, "path": {...}}}
+ *
+ * where each bucket is [upper bound in microseconds, requests] and the
+ * percentiles are the upper bounds of the buckets they fall in (or the
+ * maximum, if lower).
+ *
+ * Return:
+ *      0, or -1 if the reply could not be sent
+ *
+ ************************/
+static int send_latency_report(Server srv, int c)
+{
+        char buf[8192];
+        pthread_mutex_lock(&srv->lock);
+        int n = snprintf(buf, sizeof(buf), "{\"requests\": %zu, "
+                         "\"errors\": %zu, \"latency_us\": {\"input\": ",
+                         srv->requests, srv->errors);
+        n += format_latency(buf + n, sizeof(buf) - (size_t)n, &srv->lat[0]);
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n, ", \"path\": ");
+        n += format_latency(buf + n, sizeof(buf) - (size_t)n, &srv->lat[1]);
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n, "}}\n");
+        pthread_mutex_unlock(&srv->lock);
+        return send_reply(c, SERVE_OK, buf, (size_t)n);
+}
+
+/********** record_latency ********
+ *
+ * Adds one request's latency to a histogram.
+ *
+ * Parameters:
+ *      Latency lat: the histogram
+ *      double us:   the latency in microseconds
+ *
+ * Return:
+ *      none
+ *
+ ************************/
+static void record_latency(Latency lat, double us)
+{
+        int i = 0;
+        while (i < LATENCY_BUCKETS - 1 && us >= (double)(2ull << i))
+        {
+                i++;
+        }
+        lat->buckets[i]++;
+        lat->count++;
+        lat->total_us += us;
+        if (us > lat->max_us)
+        {
+                lat->max_us = us;
+        }
+}
+
+/********** format_latency ********
+ *
+ * Writes a latency histogram as a JSON object (see send_latency_report).
+ *
+ * Parameters:
+ *      char *buf:   where it goes
+ *      size_t cap:  room in buf, which is enough for every bucket
+ *      Latency lat: the histogram
+ *
+ * Return:
+ *      the number of characters written
+ *
+ ************************/
+static int format_latency(char *buf, size_t cap, Latency lat)
+{
+        static const double quantiles[3] = {0.50, 0.90, 0.99};
+        static const char *names[3] = {"p50", "p90", "p99"};
+
+        int n = snprintf(buf, cap, "{\"count\": %zu, \"mean\": %.1f, "
+                         "\"max\": %.1f", lat->count,
+                         lat->count > 0 ? lat->total_us / (double)lat->count
+                                        : 0, lat->max_us);
+        for (int q = 0; q < 3; q++)
+        {
+                /* The request it falls on, counting from 1 */
+                double want = quantiles[q] * (double)lat->count;
+                size_t rank = (size_t)want;
+                if ((double)rank < want || rank == 0)
+                {
+                        rank++;
+                }
+                size_t seen = 0;
+                double upper = 0;
+                for (int i = 0; i < LATENCY_BUCKETS && lat->count > 0; i++)
+                {
+                        seen += lat->buckets[i];
+                        if (seen >= rank)
+                        {
+                                upper = (double)(2ull << i);
+                                break;
+                        }
+                }
+                if (upper > lat->max_us)
+                {
+                        upper = lat->max_us;
+                }
+                n += snprintf(buf + n, cap - (size_t)n, ", \"%s\": %.1f",
+                              names[q], upper);
+        }
+
+        n += snprintf(buf + n, cap - (size_t)n, ", \"buckets\": [");
+        const char *sep = "";
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+                if (lat->buckets[i] > 0)
+                {
+                        n += snprintf(buf + n, cap - (size_t)n,
+                                      "%s[%llu, %zu]", sep, 2ull << i,
+                                      lat->buckets[i]);
+                        sep = ", ";
+                }
+        }
+        n += snprintf(buf + n, cap - (size_t)n, "]}");
+        return n;
+}
+
+/********** read_full ********
+ *
+ * read that carries on after short reads and interruptions.
+ *
+ * Parameters:
+ *      int fd:     where to read from
+ *      void *buf:  where the bytes go
+ *      size_t n:   how many to read
+ *
+ * Return:
+ *      0 once n bytes are read, -1 on error or end of file
+ *
+ ************************/
+static int read_full(int fd, void *buf, size_t n)
+{
+        char *p = buf;
+        while (n > 0)
+        {
+                ssize_t r = read(fd, p, n);
+                if (r < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (r <= 0)
+                {
+                        return -1;
+                }
+                p += r;
+                n -= (size_t)r;
+        }
+        return 0;
+}
@@ -0,0 +1,44 @@
+/* serve.h
+ *
+ * restoration --serve: restores hacked PGM files sent over a Unix socket, on
+ * a pool of worker threads that keep their Scans warm from one request to
+ * the next.
+ *
+ * A request is a kind byte, a payload length (8 bytes, most significant
+ * first) and the payload; a reply is a status byte, a length and a payload
+ * in the same way. A connection may carry any number of requests, each
+ * answered before the next is read.
+ *
+ *      'I' input   payload: a hacked PGM file (plain, gzip or zstd)
+ *      'P' path    payload: the name of one, opened by the server
+ *                  reply: the P5 image, or an error message
+ *      'S' stats   reply: request counts and latencies, as JSON
+ *      'Q' quit    reply: empty; the server stops accepting connections
+ */
+#ifndef SERVE_INCLUDED
+#define SERVE_INCLUDED
+
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "except.h"
+#include "readahead.h"
+#include "engine.h"
+
+/* Longest socket path a server can listen on */
+#define SERVE_SOCKET_MAX (sizeof(((struct sockaddr_un *)0)->sun_path) - 1)
+
+/* How a server runs */
+typedef struct ServeConfig
+{
+        const char *path;       /* the socket to listen on */
+        size_t jobs;            /* worker threads, 0 for one per CPU */
+        int timed;              /* --stats: time each worker's phases */
+        int read_ahead;         /* --read-ahead, for path requests */
+        ReadAhead_Kind ra_kind;
+        unsigned speculate;     /* --speculate, for every request */
+} *ServeConfig;
+
+extern const Except_T *serve(ServeConfig cfg, Stats total);
+
+#endif
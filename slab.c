@@ -0,0 +1,130 @@
+/* slab.c */
+#include <stdlib.h>
+
+#include "slab.h"
+#include "mem.h"
+
+#define T Slab_T
+
+/* Smallest block; a larger request gets a block of its own size */
+#define BLOCK_BYTES (64 * 1024)
+
+/* Every allocation is rounded up to this, enough for any scalar type */
+#define ALIGN 16
+
+struct block
+{
+        struct block *next;
+        size_t used;
+        size_t cap;
+        /* Pads the header so that bytes[] starts ALIGN-aligned */
+        size_t pad;
+        char bytes[];
+};
+
+struct T
+{
+        struct block *blocks; /* newest first */
+        size_t bytes;         /* of the blocks, headers included */
+};
+
+/********** Slab_new ********
+ *
+ * Return:
+ *      a new, empty Slab
+ *
+ ************************/
+T Slab_new(void)
+{
+        T slab;
+        NEW(slab);
+        slab->blocks = NULL;
+        slab->bytes = 0;
+        return slab;
+}
+
+/********** Slab_alloc ********
+ *
+ * Allocates nbytes (rounded up to ALIGN) from the newest block, starting a
+ * new block when it is full.
+ *
+ * Parameters:
+ *      T slab:        the Slab to allocate from
+ *      size_t nbytes: bytes needed
+ *
+ * Return:
+ *      the storage, ALIGN-aligned; it lives until Slab_reset or Slab_free
+ *
+ ************************/
+void *Slab_alloc(T slab, size_t nbytes)
+{
+        nbytes = (nbytes + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+        struct block *b = slab->blocks;
+        if (b == NULL || b->cap - b->used < nbytes)
+        {
+                size_t cap = nbytes > BLOCK_BYTES ? nbytes : BLOCK_BYTES;
+                b = ALLOC((long)(sizeof(*b) + cap));
+                b->used = 0;
+                b->cap = cap;
+                b->next = slab->blocks;
+                slab->blocks = b;
+                slab->bytes += sizeof(*b) + cap;
+        }
+
+        void *p = b->bytes + b->used;
+        b->used += nbytes;
+        return p;
+}
+
+/********** Slab_reset ********
+ *
+ * Releases everything allocated from the Slab, keeping its newest block for
+ * reuse so that a Slab recycled across jobs rarely calls malloc.
+ *
+ ************************/
+void Slab_reset(T slab)
+{
+        struct block *b = slab->blocks;
+        if (b == NULL)
+        {
+                return;
+        }
+        struct block *rest = b->next;
+        while (rest != NULL)
+        {
+                struct block *next = rest->next;
+                FREE(rest);
+                rest = next;
+        }
+        b->next = NULL;
+        b->used = 0;
+        slab->bytes = sizeof(*b) + b->cap;
+}
+
+/********** Slab_bytes ********
+ *
+ * Return:
+ *      the memory the Slab holds, in bytes, whether allocated from or not
+ *
+ ************************/
+size_t Slab_bytes(T slab)
+{
+        return slab->bytes;
+}
+
+/********** Slab_free ********
+ *
+ * Frees the Slab and all its blocks, and sets *slab to NULL.
+ *
+ ************************/
+void Slab_free(T *slab)
+{
+        struct block *b = (*slab)->blocks;
+        while (b != NULL)
+        {
+                struct block *next = b->next;
+                FREE(b);
+                b = next;
+        }
+        FREE(*slab);
+}
@@ -0,0 +1,26 @@
+/* slab.h
+ *
+ * Bump allocator for many small, same-lifetime objects. Unlike Hanson's
+ * Arena it keeps no process-wide free list, so separate Slab_Ts may be used
+ * from separate threads at the same time.
+ */
+#ifndef SLAB_INCLUDED
+#define SLAB_INCLUDED
+
+#include <stddef.h>
+
+#define T Slab_T
+typedef struct T *T;
+
+extern T Slab_new(void);
+
+extern void *Slab_alloc(T slab, size_t nbytes);
+
+extern void Slab_reset(T slab);
+
+extern size_t Slab_bytes(T slab);
+
+extern void Slab_free(T *slab);
+
+#undef T
+#endif